@@ -1,2 +1,3 @@
+#include "dataguard/page_store.h"
 #include "dataguard/snapshot.h"
 #include "dataguard/txn_logger.h"
\ No newline at end of file
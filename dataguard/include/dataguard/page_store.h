@@ -0,0 +1,105 @@
+#ifndef PAGE_STORE_H
+#define PAGE_STORE_H
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "map.hpp"
+#include "vector.hpp"
+
+/**
+ * @brief the content address of a page, a 128-bit hash of its kPageSize bytes, see PageStore::Put for collisions
+ */
+struct PageKey {
+  uint64_t low = 0;
+  uint64_t high = 0;
+  inline bool operator==(const PageKey &other) const { return low == other.low && high == other.high; }
+  inline bool operator!=(const PageKey &other) const { return !(*this == other); }
+  inline bool operator<(const PageKey &other) const {
+    return high != other.high ? high < other.high : low < other.low;
+  }
+};
+
+/**
+ * @brief the content of a file as of a snapshot, the key of every page in order
+ * @details The last page is zero padded if the file size is not a multiple of kPageSize. A missing manifest is read as
+ * an empty file, like the files at INIT.
+ * The structure of a manifest file is [file size: u64][page count: u64][keys: PageKey * page count].
+ */
+struct PageManifest {
+  size_t file_size = 0;
+  sjtu::vector<PageKey> pages;
+};
+/**
+ * @return false if the manifest does not exist, then manifest is left empty
+ */
+bool ReadPageManifest(const std::string &manifest_file, PageManifest &manifest);
+/**
+ * @brief replace the manifest file atomically by a durable new one
+ */
+void WritePageManifest(const std::string &manifest_file, const PageManifest &manifest);
+
+/**
+ * @brief PageStore is a content-addressed store of pages, where identical pages are stored only once.
+ * @details The pages live in `<directory>/pack`, a flat array of kPageSize slots, and `<directory>/index` maps every
+ * stored key to its slot. The slots of the pages dropped by Sweep are reused by later pages, so the pack only grows
+ * with the number of distinct pages alive at the same time.
+ *
+ * The index is only written by Save. A page put after the last Save is lost by a crash, so a manifest must not be
+ * published before the store is saved. Likewise Save must follow Sweep before anything is put, or a reused slot could
+ * be reachable by its old key from the saved index.
+ */
+class PageStore {
+  std::string directory;
+  int pack_fd;
+  sjtu::map<PageKey, uint64_t> index;  // key -> offset of the slot in the pack
+  sjtu::vector<uint64_t> free_slots;
+  uint64_t pack_end = 0;  // the slots are all below it
+  sjtu::vector<uint8_t> compare_buf;  // a stored page read back by Put, guarded by latch
+  std::mutex latch;
+
+ public:
+  /**
+   * @brief open the store in directory, which is created with an empty store if it does not exist
+   */
+  explicit PageStore(std::string directory_);
+  ~PageStore();
+  PageStore(const PageStore &) = delete;
+  PageStore(PageStore &&) = delete;
+  PageStore &operator=(const PageStore &) = delete;
+  PageStore &operator=(PageStore &&) = delete;
+  /**
+   * @brief the key of kPageSize bytes, a non-cryptographic hash run over four 64-bit lanes like xxHash
+   */
+  static PageKey Hash(const uint8_t *page);
+  /**
+   * @brief whether a store exists in directory
+   */
+  static bool Exists(const std::string &directory);
+  /**
+   * @brief store a page unless an identical one is stored already, it is thread safe
+   * @details The bytes of a stored page with the same key are compared. If they differ, the key is probed forward
+   * until a free key or the identical page is found, so a key always stands for one content.
+   * @return the key of the page
+   */
+  PageKey Put(const uint8_t *page);
+  /**
+   * @brief read the page of key into page, it is thread safe
+   */
+  void Get(const PageKey &key, uint8_t *page);
+  /**
+   * @brief drop every page that is_live(key) rejects
+   * @return the number of pages dropped
+   */
+  size_t Sweep(const std::function<bool(const PageKey &)> &is_live);
+  /**
+   * @brief make the pack and the index durable, the index is replaced atomically
+   */
+  void Save();
+  /**
+   * @return the number of distinct pages stored
+   */
+  size_t size();
+};
+#endif  // PAGE_STORE_H
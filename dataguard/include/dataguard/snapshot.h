@@ -4,13 +4,59 @@
 #include <spdlog/sinks/basic_file_sink.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
+#include <cstdint>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include "dataguard/page_store.h"
 #include "list.hpp"
 #include "map.hpp"
 #include "storage/driver.h"
+#include "storage/thread_pool.hpp"
 #include "vector.hpp"
-void GenerateDiff(const std::string &old_file, const std::string &new_file, const std::string &diff_file);
+/**
+ * @brief how the diffs are compressed
+ * @details The diffs are streamed through zstd, so the memory used is bounded by the window instead of the size of the
+ * diff. A larger window (or long distance matching, which implies a window of 128 MiB unless set) finds repetitions
+ * further apart at the cost of memory on both sides.
+ */
+struct DiffCompressionConfig {
+  int level = 12;
+  int workers = -1;     // threads compressing besides the caller, -1 for one per core, 0 to compress in the caller
+  int window_log = 0;   // log2 of the window in bytes, 0 for the default of the level
+  bool long_distance_matching = false;
+};
+void GenerateDiff(const std::string &old_file, const std::string &new_file, const std::string &diff_file,
+                  const DiffCompressionConfig &config = DiffCompressionConfig());
+/**
+ * @brief generate the same diff as GenerateDiff, but only compare the given pages (ascending) and the tails
+ * @details It is valid if the pages out of the list are known to be unchanged, the cost is proportional to the pages
+ * in the list instead of the size of the files.
+ */
+void GeneratePageDiff(const std::string &old_file, const std::string &new_file, const sjtu::vector<page_id_t> &pages,
+                      const std::string &diff_file, const DiffCompressionConfig &config = DiffCompressionConfig());
+/**
+ * @brief read_page(page_id, buf) reads kPageSize bytes of the page into buf
+ */
+using PageReader = std::function<void(page_id_t, uint8_t *)>;
+/**
+ * @brief the same as GeneratePageDiff, but the new content is read by read_new_page instead of from a file
+ */
+void GeneratePageDiff(const std::string &old_file, const PageReader &read_new_page, size_t new_file_size,
+                      const sjtu::vector<page_id_t> &pages, const std::string &diff_file,
+                      const DiffCompressionConfig &config = DiffCompressionConfig());
+/**
+ * @brief make frontier_file equal to new_file by copying the given pages (ascending) and the tail
+ */
+void UpdateFrontier(const std::string &frontier_file, const std::string &new_file,
+                    const sjtu::vector<page_id_t> &pages);
+void UpdateFrontier(const std::string &frontier_file, const PageReader &read_new_page, size_t new_file_size,
+                    const sjtu::vector<page_id_t> &pages);
 void ApplyPatch(const std::string &old_file, const std::string &diff_file, const std::string &new_file,
                 bool is_reverse);
 void CopyFile(const std::string &src, const std::string &dst);
@@ -29,92 +75,97 @@ class SnapShotManager {
   bool has_set_meta_file = false;
   sjtu::vector<DataDriverBase *> drivers;
   std::string meta_file;
+  bool has_set_stage_meta_file = false;
+  std::string stage_meta_file;
   std::shared_ptr<spdlog::logger> logger_ptr;
+  DiffCompressionConfig compression;
+  size_t key_frame_interval = 16;
+  size_t file_concurrency = 0;
+  std::mutex file_pool_latch;  // the background snapshot may create file_pool at the same time as the foreground
+  std::unique_ptr<WorkStealingThreadPool> file_pool;  // created on first use
+  bool page_store_enabled = false;
+  std::unique_ptr<PageStore> page_store;  // set if the repository keeps its snapshots in a page store
+  /**
+   * @brief flush every driver (and lock it down if asked) and list the files of all of them
+   */
+  sjtu::vector<DataDriverBase::FileEntry> FlushAndListFiles(bool lock_down = false);
+  /**
+   * @brief run fn(i) for every i in [0, count) on the file pool, the first error is rethrown after all of them end
+   */
+  void ParallelForFiles(size_t count, const std::function<void(size_t)> &fn);
+  /**
+   * @brief replace the meta file atomically by a durable new one
+   */
+  void WriteMetaFile(const std::string &HEAD,
+                     const sjtu::vector<std::pair<std::string, std::string>> &snapshot_relationship);
+  /**
+   * @brief read the stage meta file, [LSN] [generation] [log offset]
+   * @return false if nothing has been staged
+   */
+  bool ReadStageMeta(uint64_t &lsn, int &generation, uint64_t *log_offset = nullptr);
+  static bool ReadStageMeta(const std::string &meta_file, uint64_t &lsn, int &generation,
+                            uint64_t *log_offset = nullptr);
+  /**
+   * @brief replace the stage meta file atomically by a durable new one
+   */
+  void WriteStageMeta(uint64_t lsn, int generation, uint64_t log_offset);
+  /**
+   * @brief a file frozen by CreateSnapShot or Stage, whose diff or copy is still being written in the background
+   */
+  struct FrozenFile {
+    std::string path;
+    DiskManager *disk_manager;
+    size_t frozen_size;
+    sjtu::vector<page_id_t> pages;  // the pages that may differ from the frontier
+  };
+  /**
+   * @brief open the page store of the repository if it has one
+   */
+  void LoadPageStore();
+  /**
+   * @brief put the given pages (ascending) and the tail of a file into the page store, and write the manifest of the
+   * file at the snapshot, the frontier is updated as well
+   * @details The other pages are unchanged since the last snapshot, so their keys are taken from the manifest of the
+   * frontier, and the cost is proportional to the pages in the list.
+   */
+  void StorePages(const std::string &path, const PageReader &read_new_page, size_t new_file_size,
+                  const sjtu::vector<page_id_t> &pages, const std::string &snap_shot_ID);
+  /**
+   * @brief drop the pages no manifest of the remaining snapshots or of the frontier refers to
+   */
+  void CollectPageGarbage(const sjtu::vector<DataDriverBase::FileEntry> &files,
+                          const sjtu::vector<std::pair<std::string, std::string>> &snapshot_relationship);
+  std::thread pending_snap_shot;
+  std::exception_ptr pending_error;
   struct WayEntry {
     std::string snap_ID;
     std::string diff_ID;
     bool is_reverse;
   };
-  friend void ApplyLongChange(const std::string &old_file, const std::string &new_file,
-                              const sjtu::vector<SnapShotManager::WayEntry> &way);
-  inline sjtu::vector<WayEntry> FindWay(std::string dest) {
-    if (!has_set_meta_file) {
-      throw std::runtime_error("SnapShotManager has not set the meta file");
-    }
-    if (!has_connected) {
-      throw std::runtime_error("SnapShotManager has not connected to the data drivers");
-    }
-    std::fstream fs(meta_file, std::ios::in);
-    std::string HEAD;
-    fs >> HEAD;
-    std::string cur, anc;
-    sjtu::map<std::string, sjtu::vector<std::string>> son_list;
-    sjtu::map<std::string, std::string> get_anc;
-    while (fs >> cur >> anc) {
-      son_list[anc].push_back(cur);
-      get_anc[cur] = anc;
-    }
-    if (son_list.find(dest) == son_list.end() && get_anc.find(dest) == get_anc.end()) {
-      throw std::runtime_error("unable to find destination");
-    }
-    sjtu::vector<WayEntry> res;
-    if (HEAD == dest) return res;
-    sjtu::list<std::string> Q;
-    sjtu::map<std::string, WayEntry> visit_record;
-    Q.push_back(dest);
-    while (!Q.empty()) {
-      std::string cur = Q.front();
-      Q.pop_front();
-      if (get_anc.find(cur) != get_anc.end()) {
-        std::string v = get_anc[cur];
-        if (visit_record.find(v) == visit_record.end()) {
-          visit_record[v] = {cur, cur, false};
-          if (v == HEAD) goto ed;
-          Q.push_back(v);
-        }
-      }
-      if (son_list.find(cur) != son_list.end()) {
-        auto &s_l = son_list[cur];
-        for (size_t j = 0; j < s_l.size(); j++) {
-          std::string v = s_l[j];
-          if (visit_record.find(v) == visit_record.end()) {
-            visit_record[v] = {cur, v, true};
-            if (v == HEAD) goto ed;
-            Q.push_back(v);
-          }
-        }
-      }
-    }
-  ed:;
-    std::string tmp = HEAD;
-    while (tmp != dest) {
-      res.push_back(visit_record[tmp]);
-      tmp = visit_record[tmp].snap_ID;
-    }
-    return res;
-  }
-  inline void ApplyLongChange(const std::string &old_file, const std::string &new_file,
-                              const sjtu::vector<SnapShotManager::WayEntry> &way, const std::string &file_name_base) {
-    CopyFile(old_file, new_file);
-    for (size_t i = 0; i < way.size(); i++) {
-      if (logger_ptr) {
-        logger_ptr->info("Applying diff {} to {} with inverse mark {}", file_name_base + "." + way[i].diff_ID + ".diff",
-                         new_file, way[i].is_reverse);
-      }
-      ApplyPatch(new_file, file_name_base + "." + way[i].diff_ID + ".diff", new_file + ".tmp", way[i].is_reverse);
-      remove(new_file.c_str());
-      rename((new_file + ".tmp").c_str(), new_file.c_str());
-      if (logger_ptr) {
-        logger_ptr->info("Applied diff {} to {} with inverse mark {}", file_name_base + "." + way[i].diff_ID + ".diff",
-                         new_file, way[i].is_reverse);
-      }
-    }
-  }
+  /**
+   * @brief whether every file has a keyframe (a full compressed copy) at the snapshot, INIT counts as an empty one
+   */
+  bool HasKeyFrame(const std::string &snap_shot_ID);
+  /**
+   * @brief find the way to dest from the nearest base, which is the frontier (base is set to "") or a keyframe
+   * @details The way is as short as the closest base allows, so with a keyframe every key_frame_interval snapshots
+   * along every chain, a checkout never replays more diffs than that, however deep the history is.
+   */
+  sjtu::vector<WayEntry> FindShortestWay(const std::string &dest, std::string &base);
+  /**
+   * @brief compose the diffs of way in memory and write the result on top of base into new_file in one pass
+   * @param base "" for the frontier, otherwise the keyframe of the snapshot
+   */
+  void ApplyLongChange(const std::string &base, const std::string &new_file, const sjtu::vector<WayEntry> &way,
+                       const std::string &file_name_base);
 
  public:
   // For safety and simplicity, we delete all the copy/move constructor and copy/move assignment operator. Please
   // manager it using smart pointer.
   SnapShotManager() = default;
+  inline ~SnapShotManager() {
+    if (pending_snap_shot.joinable()) pending_snap_shot.join();
+  }
   SnapShotManager(const SnapShotManager &) = delete;
   SnapShotManager(SnapShotManager &&) = delete;
   SnapShotManager &operator=(const SnapShotManager &) = delete;
@@ -131,6 +182,32 @@ class SnapShotManager {
     has_connected = true;
   }
   inline void SetLogger(const std::shared_ptr<spdlog::logger> &logger_ptr_) { logger_ptr = logger_ptr_; }
+  inline void SetCompression(const DiffCompressionConfig &compression_) { compression = compression_; }
+  /**
+   * @brief write a keyframe of a new snapshot once its chain has that many diffs since the last keyframe, 0 for never
+   */
+  inline void SetKeyFrameInterval(size_t key_frame_interval_) { key_frame_interval = key_frame_interval_; }
+  /**
+   * @brief the number of files processed at the same time, 0 for one per core
+   */
+  inline void SetConcurrency(size_t file_concurrency_) {
+    WaitForPendingSnapShot();
+    std::lock_guard<std::mutex> guard(file_pool_latch);
+    file_concurrency = file_concurrency_;
+    file_pool.reset();
+  }
+  /**
+   * @brief keep the snapshots of a new repository in a content-addressed page store instead of diffs
+   * @details Every snapshot is then a manifest of page keys per file (<path>.<ID>.manifest) and identical pages, within
+   * a file, across files or across snapshots, are stored once in <meta file>.pages, so a snapshot of an unchanged state
+   * costs only its manifests. A checkout compares the manifest of the target with the one of the frontier and only
+   * reads the pages that differ, whatever the distance in the tree is. The compression and keyframe settings do not
+   * apply. It must be called before SetMetaFile, and a repository keeps the format it is created with.
+   */
+  inline void EnablePageStore() {
+    if (has_set_meta_file) throw std::runtime_error("the page store must be enabled before setting the meta file");
+    page_store_enabled = true;
+  }
   inline void SetMetaFile(const std::string &meta_file_) {
     if (has_set_meta_file) throw std::runtime_error("SnapShotManager has already set the meta file");
     has_set_meta_file = true;
@@ -145,9 +222,66 @@ class SnapShotManager {
     } else {
       fclose(f);
     }
+    LoadPageStore();
+  }
+  /**
+   * @brief set the meta file of the stage area
+   * @details The stage area keeps a full copy of the data files as of the last checkpoint of the transaction log, so
+   * recovery can restore it and replay the log after it. There are two generations of copies, <path>.stage0 and
+   * <path>.stage1, and the meta file names the complete one with the LSN of its checkpoint. A new stage always goes to
+   * the other generation and the meta file is replaced atomically at last, so a crash while staging leaves the previous
+   * stage intact.
+   */
+  inline void SetStageMetaFile(const std::string &stage_meta_file_) {
+    if (has_set_stage_meta_file) throw std::runtime_error("SnapShotManager has already set the stage meta file");
+    has_set_stage_meta_file = true;
+    stage_meta_file = stage_meta_file_;
   }
+  /**
+   * @return whether anything has been staged, and if so the LSN of the checkpoint of the stage in lsn, and the offset
+   * of its record in the log in log_offset if asked
+   */
+  bool HasStage(uint64_t &lsn, uint64_t *log_offset = nullptr);
+  /**
+   * @brief copy the data files into the stage area as of the checkpoint lsn, and make them durable
+   * @param log_offset where the record of the checkpoint starts in the log, so recovery reads the log from there
+   * @details The files are frozen like in CreateSnapShot and copied by the background thread, which writes the meta
+   * file last, so the caller only waits for the freeze. The copy still reads and writes the whole size of the data,
+   * and the next Stage, or any other operation of the manager, waits for it. Meanwhile every first write to a page
+   * saves its pre-image, see DiskManager::FreezeForSnapShot.
+   * @warning the data drivers must have been flushed, and must not be locked down or destroyed before
+   * WaitForPendingSnapShot returns
+   */
+  void Stage(uint64_t lsn, uint64_t log_offset = 0);
+  /**
+   * @brief overwrite the data files with the stage area
+   * @details The data drivers are locked down first, so they are unusable afterwards and must be reopened.
+   * @return the LSN of the checkpoint of the stage, and the offset of its record in the log in log_offset if asked
+   */
+  uint64_t RestoreStage(uint64_t *log_offset = nullptr);
+  /**
+   * @brief overwrite the data files with the stage area of another data directory, which is only read
+   * @details The files are matched by name, and the drivers are locked down as in RestoreStage. The owner of the other
+   * directory may stage again meanwhile and overwrite the generation being copied, so the copy is retried until the
+   * stage meta file stays the same during a whole copy.
+   * @return the LSN of the checkpoint of the stage, and the offset of its record in the log in log_offset if asked
+   */
+  uint64_t RestoreStageFrom(const std::string &source_directory, uint64_t *log_offset = nullptr);
   void InitializeRepository();
+  /**
+   * @brief create a snapshot of the current state and make it the HEAD
+   * @details The drivers are flushed and every open file is frozen by copy-on-write (see
+   * DiskManager::FreezeForSnapShot), which only costs O(1) per file. Then it returns, and a background thread writes
+   * the diffs against the frontier from the frozen pages while the drivers keep serving reads and writes. Every other
+   * operation of the manager waits for the background work first.
+   * @warning the drivers must not be locked down or destroyed before WaitForPendingSnapShot returns
+   */
   void CreateSnapShot(const std::string &snap_shot_ID);
+  /**
+   * @brief wait for the diffs of the last snapshot, or the copies of the last stage, to be written
+   * @details An error in the background is rethrown here.
+   */
+  void WaitForPendingSnapShot();
   void CheckOutFrontier();
   void SwitchToSnapShot(const std::string &snap_shot_ID);
   void RemoveSnapShot(const std::string &snap_shot_ID);
@@ -1,4 +1,122 @@
 #ifndef TXN_LOGGER_H
 #define TXN_LOGGER_H
+#include <spdlog/spdlog.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "vector.hpp"
 
-#endif
\ No newline at end of file
+/**
+ * @brief TxnLogger is the business-level transaction log (write-ahead log) of the ticket system.
+ * @details Every record is a frame of
+ * [payload length: u32][type: u8][LSN: u64][checksum: u32][payload]
+ * in little endian, the checksum covers the type, the LSN and the payload, so a torn tail left by a crash is detected
+ * and ignored when reading. The LSNs start from 1 and are consecutive.
+ *
+ * Append only copies the frame into an in-memory ring and returns. A dedicated writer thread takes everything in the
+ * ring as one batch, writes it and calls fdatasync once for the whole batch (group commit). After the first record of
+ * a batch arrives, the writer keeps collecting for at most `group_commit_window`, so that is also the window in which
+ * acknowledged records may be lost by a crash. With `synchronous_commit`, Append waits until its record is durable
+ * instead, and the writer does not wait for the window while someone is waiting.
+ *
+ * A failed write or fdatasync is sticky: the writer stops, as the file may end with a torn frame, durable_lsn stays
+ * where it was, and Append and WaitDurable throw from then on.
+ *
+ * The content of the payloads is up to the caller, the log only distinguishes commands from checkpoints.
+ */
+class TxnLogger {
+ public:
+  enum RecordType : uint8_t { kCommand = 1, kCheckpoint = 2 };
+  struct Config {
+    size_t ring_capacity = 1 << 22;  // in bytes, Append blocks while the ring is full
+    std::chrono::microseconds group_commit_window{2000};
+    bool synchronous_commit = false;
+  };
+  struct Record {
+    uint64_t lsn;
+    RecordType type;
+    std::string payload;
+  };
+  struct Stats {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t batches = 0;  // also the number of fdatasync calls
+  };
+  const static size_t kFrameHeaderSize = 17;
+
+ private:
+  std::string log_file_path;
+  Config config;
+  int fd;
+  sjtu::vector<char> ring;
+  uint64_t base_offset = 0;     // the size of the file when it was opened
+  uint64_t appended_bytes = 0;  // total bytes ever copied into the ring
+  uint64_t written_bytes = 0;   // total bytes ever written to the file, always <= appended_bytes
+  uint64_t last_lsn = 0;
+  uint64_t durable_lsn = 0;
+  size_t synchronous_waiters = 0;
+  bool stop = false;
+  std::string write_error;  // set once by the writer, nothing is written after it
+  Stats stats;
+  std::mutex latch;
+  std::condition_variable writer_cv;   // there is something to write, or someone is waiting, or stopping
+  std::condition_variable space_cv;    // some space of the ring is freed
+  std::condition_variable durable_cv;  // durable_lsn is advanced
+  std::thread writer;
+  std::shared_ptr<spdlog::logger> logger_ptr;
+
+  void WriterLoop();
+  void WaitDurableLocked(std::unique_lock<std::mutex> &lock, uint64_t lsn);
+
+ public:
+  /**
+   * @brief open the log file for appending, the LSNs continue from the last complete record in it
+   * @details A torn tail is cut off first, so new records are never appended after garbage.
+   * @param scan_offset where an intact record starts, such as the one of the staged checkpoint, the log before it is
+   * not scanned
+   * @throw std::runtime_error if there is no record at scan_offset
+   */
+  TxnLogger(std::string log_file_path_, Config config_, size_t scan_offset = 0);
+  /**
+   * @brief make every appended record durable and stop the writer thread
+   */
+  ~TxnLogger();
+  TxnLogger(const TxnLogger &) = delete;
+  TxnLogger(TxnLogger &&) = delete;
+  TxnLogger &operator=(const TxnLogger &) = delete;
+  TxnLogger &operator=(TxnLogger &&) = delete;
+  inline void SetLogger(const std::shared_ptr<spdlog::logger> &logger_ptr_) { logger_ptr = logger_ptr_; }
+
+  /**
+   * @brief append a record, it is thread safe
+   * @param record_offset set to where the record starts in the file if it is not nullptr
+   * @return the LSN of the record
+   * @throw std::runtime_error if the log failed to be written
+   */
+  uint64_t Append(RecordType type, std::string_view payload, uint64_t *record_offset = nullptr);
+  /**
+   * @brief wait until every record up to lsn is durable
+   * @throw std::runtime_error if the log failed to be written before that
+   */
+  void WaitDurable(uint64_t lsn);
+  uint64_t LastLSN();
+  uint64_t DurableLSN();
+  Stats GetStats();
+
+  /**
+   * @brief call fn(const Record &) on every complete record of a log file, in order
+   * @param offset where to start reading, it must be the end of a record returned by an earlier call or 0
+   * @return the size of the valid prefix of the file, the bytes after it are a torn or corrupted tail, or a record
+   * still being written by another process
+   */
+  static size_t ReadLog(const std::string &log_file_path, const std::function<void(const Record &)> &fn,
+                        size_t offset = 0);
+};
+#endif  // TXN_LOGGER_H
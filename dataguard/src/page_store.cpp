@@ -0,0 +1,201 @@
+#include "dataguard/page_store.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "storage/config.h"
+
+namespace {
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+inline uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline uint64_t Avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+/**
+ * @brief write the whole buffer at offset
+ */
+void WriteAll(int fd, const void *buf, size_t len, uint64_t offset) {
+  const char *src = static_cast<const char *>(buf);
+  while (len > 0) {
+    ssize_t res = pwrite(fd, src, len, offset);
+    if (res < 0) throw std::runtime_error("pwrite failed");
+    src += res;
+    len -= res;
+    offset += res;
+  }
+}
+/**
+ * @brief replace path atomically by a durable file written by write_content(fd)
+ */
+void ReplaceDurably(const std::string &path, const std::function<void(int)> &write_content) {
+  std::string tmp_file = path + ".tmp";
+  int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw std::runtime_error("failed to open " + tmp_file);
+  try {
+    write_content(fd);
+    if (fsync(fd) != 0) throw std::runtime_error("fsync failed");
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  if (rename(tmp_file.c_str(), path.c_str()) != 0) throw std::runtime_error("rename failed");
+}
+}  // namespace
+
+bool ReadPageManifest(const std::string &manifest_file, PageManifest &manifest) {
+  manifest.file_size = 0;
+  manifest.pages.clear();
+  FILE *f = fopen(manifest_file.c_str(), "rb");
+  if (f == nullptr) return false;
+  uint64_t header[2];
+  bool ok = fread(header, sizeof(uint64_t), 2, f) == 2;
+  if (ok) {
+    manifest.file_size = header[0];
+    manifest.pages.resize(header[1]);
+    ok = fread(manifest.pages.data(), sizeof(PageKey), header[1], f) == header[1];
+  }
+  fclose(f);
+  if (!ok) throw std::runtime_error("the manifest " + manifest_file + " is corrupted");
+  return true;
+}
+
+void WritePageManifest(const std::string &manifest_file, const PageManifest &manifest) {
+  ReplaceDurably(manifest_file, [&manifest](int fd) {
+    uint64_t header[2] = {manifest.file_size, manifest.pages.size()};
+    WriteAll(fd, header, sizeof(header), 0);
+    // sjtu::vector only exposes data() on a non-const vector
+    PageKey *keys = const_cast<sjtu::vector<PageKey> &>(manifest.pages).data();
+    WriteAll(fd, keys, sizeof(PageKey) * manifest.pages.size(), sizeof(header));
+  });
+}
+
+PageStore::PageStore(std::string directory_) : directory(std::move(directory_)) {
+  mkdir(directory.c_str(), 0755);
+  pack_fd = open((directory + "/pack").c_str(), O_RDWR | O_CREAT, 0644);
+  if (pack_fd < 0) throw std::runtime_error("failed to open the page store " + directory);
+  compare_buf.resize(kPageSize);
+  FILE *f = fopen((directory + "/index").c_str(), "rb");
+  if (f == nullptr) return;
+  uint64_t header[2];
+  bool ok = fread(header, sizeof(uint64_t), 2, f) == 2;
+  pack_end = ok ? header[0] : 0;
+  sjtu::vector<bool> used(pack_end / kPageSize);
+  for (uint64_t i = 0; ok && i < header[1]; i++) {
+    PageKey key;
+    uint64_t offset;
+    ok = fread(&key, sizeof(key), 1, f) == 1 && fread(&offset, sizeof(offset), 1, f) == 1 && offset < pack_end;
+    if (!ok) break;
+    index[key] = offset;
+    used[offset / kPageSize] = true;
+  }
+  fclose(f);
+  if (!ok) {
+    close(pack_fd);
+    throw std::runtime_error("the index of the page store " + directory + " is corrupted");
+  }
+  for (size_t i = 0; i < used.size(); i++) {
+    if (!used[i]) free_slots.push_back(i * kPageSize);
+  }
+}
+
+PageStore::~PageStore() { close(pack_fd); }
+
+bool PageStore::Exists(const std::string &directory) { return access((directory + "/index").c_str(), F_OK) == 0; }
+
+PageKey PageStore::Hash(const uint8_t *page) {
+  uint64_t lane[4] = {kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1};
+  for (size_t i = 0; i < kPageSize; i += 32) {
+    for (int j = 0; j < 4; j++) {
+      uint64_t word;
+      memcpy(&word, page + i + 8 * j, 8);
+      lane[j] = Rotl(lane[j] + word * kPrime2, 31) * kPrime1;
+    }
+  }
+  PageKey key;
+  key.low = Avalanche(Rotl(lane[0], 1) + Rotl(lane[1], 7) + Rotl(lane[2], 12) + Rotl(lane[3], 18));
+  key.high = Avalanche((lane[0] ^ Rotl(lane[2], 29)) * kPrime3 + (lane[1] ^ Rotl(lane[3], 41)));
+  return key;
+}
+
+PageKey PageStore::Put(const uint8_t *page) {
+  PageKey key = Hash(page);
+  std::lock_guard<std::mutex> guard(latch);
+  for (auto it = index.find(key); it != index.end(); it = index.find(key)) {
+    if (pread(pack_fd, compare_buf.data(), kPageSize, it->second) != (ssize_t)kPageSize) {
+      throw std::runtime_error("pread failed");
+    }
+    if (memcmp(compare_buf.data(), page, kPageSize) == 0) return key;
+    // a collision, the key is taken by another content
+    key.low += kPrime3;
+  }
+  uint64_t offset;
+  if (!free_slots.empty()) {
+    offset = free_slots.back();
+    free_slots.pop_back();
+  } else {
+    offset = pack_end;
+    pack_end += kPageSize;
+  }
+  WriteAll(pack_fd, page, kPageSize, offset);
+  index[key] = offset;
+  return key;
+}
+
+void PageStore::Get(const PageKey &key, uint8_t *page) {
+  uint64_t offset;
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    auto it = index.find(key);
+    if (it == index.end()) throw std::runtime_error("the page store " + directory + " misses a page");
+    offset = it->second;
+  }
+  // a slot is only rewritten after its page is swept, which never happens to a page still being read
+  if (pread(pack_fd, page, kPageSize, offset) != (ssize_t)kPageSize) throw std::runtime_error("pread failed");
+}
+
+size_t PageStore::Sweep(const std::function<bool(const PageKey &)> &is_live) {
+  std::lock_guard<std::mutex> guard(latch);
+  sjtu::vector<PageKey> dead;
+  for (auto it = index.begin(); it != index.end(); ++it) {
+    if (!is_live(it->first)) dead.push_back(it->first);
+  }
+  for (size_t i = 0; i < dead.size(); i++) {
+    auto it = index.find(dead[i]);
+    free_slots.push_back(it->second);
+    index.erase(it);
+  }
+  return dead.size();
+}
+
+void PageStore::Save() {
+  std::lock_guard<std::mutex> guard(latch);
+  if (fdatasync(pack_fd) != 0) throw std::runtime_error("fdatasync failed");
+  ReplaceDurably(directory + "/index", [this](int fd) {
+    sjtu::vector<char> buf;
+    auto append = [&buf](const void *src, size_t len) {
+      for (size_t i = 0; i < len; i++) buf.push_back(static_cast<const char *>(src)[i]);
+    };
+    uint64_t header[2] = {pack_end, index.size()};
+    append(header, sizeof(header));
+    for (auto it = index.begin(); it != index.end(); ++it) {
+      append(&it->first, sizeof(PageKey));
+      append(&it->second, sizeof(uint64_t));
+    }
+    WriteAll(fd, buf.data(), buf.size(), 0);
+  });
+}
+
+size_t PageStore::size() {
+  std::lock_guard<std::mutex> guard(latch);
+  return index.size();
+}
@@ -1,9 +1,17 @@
 #include "dataguard/snapshot.h"
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <zstd.h>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include "map.hpp"
 #include "storage/config.h"
 #include "vector.hpp"
@@ -31,6 +39,31 @@ void CopyFile(const std::string &src, const std::string &dst) {
   fclose(f1);
   fclose(f2);
 }
+/**
+ * @brief write a file as of its freeze into dst, frozen_size is returned by DiskManager::FreezeForSnapShot
+ */
+void CopyFrozenFile(DiskManager *disk_manager, size_t frozen_size, const std::string &dst) {
+  FILE *f = fopen(dst.c_str(), "wb");
+  if (f == nullptr) throw std::runtime_error("fopen failed");
+  sjtu::vector<char> page(kPageSize);
+  bool ok = true;
+  for (size_t offset = 0; ok && offset < frozen_size; offset += kPageSize) {
+    disk_manager->ReadFrozenPage(offset / kPageSize, page.data());
+    size_t len = std::min<size_t>(kPageSize, frozen_size - offset);
+    ok = fwrite(page.data(), 1, len, f) == len;
+  }
+  if (fclose(f) != 0 || !ok) throw std::runtime_error("failed to write " + dst);
+}
+/**
+ * @brief make the content of a file (or the entries of a directory) durable
+ */
+void SyncFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("open failed");
+  int rc = fsync(fd);
+  close(fd);
+  if (rc != 0) throw std::runtime_error("fsync failed");
+}
 struct uint8_t_reader {
   FILE *f;
   uint8_t *buf, *p1, *p2;
@@ -71,242 +104,564 @@ struct uint8_t_writer {
     return *p++ = ch;
   }
 };
-void GenerateDiff(const std::string &old_file, const std::string &new_file, const std::string &diff_file) {
+/**
+ * @brief write the uncompressed diff stream into a zstd compressed file chunk by chunk
+ * @details The memory used is bounded by the chunk buffers and the window of the compressor, no matter how large the
+ * diff is. With config.workers > 0, zstd compresses the chunks in its own threads while the diff is being generated.
+ */
+class CompressedDiffWriter {
+  FILE *fp;
+  ZSTD_CCtx *cctx;
+  sjtu::vector<uint8_t> in_buf, out_buf;
+  size_t in_size = 0;
+  size_t total_size = 0;
+
+  void Compress(ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = {in_buf.data(), in_size, 0};
+    while (true) {
+      ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+      size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+      if (ZSTD_isError(remaining)) throw std::runtime_error(ZSTD_getErrorName(remaining));
+      if (fwrite(out_buf.data(), 1, output.pos, fp) != output.pos) throw std::runtime_error("fwrite failed");
+      if (mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size) break;
+    }
+    in_size = 0;
+  }
+
+ public:
+  CompressedDiffWriter(const std::string &diff_file, const DiffCompressionConfig &config)
+      : in_buf(ZSTD_CStreamInSize()), out_buf(ZSTD_CStreamOutSize()) {
+    cctx = ZSTD_createCCtx();
+    if (cctx == nullptr) throw std::runtime_error("ZSTD_createCCtx failed");
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, config.level);
+    if (config.window_log > 0) ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, config.window_log);
+    if (config.long_distance_matching) ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    int workers = config.workers >= 0 ? config.workers : (int)std::thread::hardware_concurrency();
+    // it fails harmlessly if zstd is built without multithreading, then the calling thread compresses
+    if (workers > 1) ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers);
+    fp = fopen(diff_file.c_str(), "wb");
+    if (fp == nullptr) {
+      ZSTD_freeCCtx(cctx);
+      throw std::runtime_error("fopen failed");
+    }
+  }
+  ~CompressedDiffWriter() {
+    if (fp != nullptr) fclose(fp);
+    ZSTD_freeCCtx(cctx);
+  }
+  CompressedDiffWriter(const CompressedDiffWriter &) = delete;
+  CompressedDiffWriter &operator=(const CompressedDiffWriter &) = delete;
+  inline void Put(uint8_t c) {
+    if (in_size == in_buf.size()) [[unlikely]]
+      Compress(ZSTD_e_continue);
+    in_buf[in_size++] = c;
+    total_size++;
+  }
+  inline void Put(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) Put(data[i]);
+  }
+  inline size_t BytesWritten() const { return total_size; }
+  void Finish() {
+    Compress(ZSTD_e_end);
+    int rc = fclose(fp);
+    fp = nullptr;
+    if (rc != 0) throw std::runtime_error("fclose failed");
+  }
+};
+/**
+ * @brief read the uncompressed diff stream back from a zstd compressed file chunk by chunk
+ */
+class CompressedDiffReader {
+  FILE *fp;
+  ZSTD_DCtx *dctx;
+  sjtu::vector<uint8_t> in_buf, out_buf;
+  ZSTD_inBuffer input;
+  size_t out_pos = 0, out_size = 0;
+  bool frame_ended = true;
+
+  bool Refill() {
+    while (true) {
+      if (input.pos == input.size) {
+        input.size = fread(in_buf.data(), 1, in_buf.size(), fp);
+        input.pos = 0;
+        if (input.size == 0) {
+          if (!frame_ended) throw std::runtime_error("the diff file is truncated");
+          return false;
+        }
+      }
+      ZSTD_outBuffer output = {out_buf.data(), out_buf.size(), 0};
+      size_t rc = ZSTD_decompressStream(dctx, &output, &input);
+      if (ZSTD_isError(rc)) throw std::runtime_error(ZSTD_getErrorName(rc));
+      frame_ended = rc == 0;
+      out_pos = 0;
+      out_size = output.pos;
+      if (out_size > 0) return true;
+    }
+  }
+
+ public:
+  explicit CompressedDiffReader(const std::string &diff_file)
+      : in_buf(ZSTD_DStreamInSize()), out_buf(ZSTD_DStreamOutSize()) {
+    dctx = ZSTD_createDCtx();
+    if (dctx == nullptr) throw std::runtime_error("ZSTD_createDCtx failed");
+    // accept whatever window the writer was configured with
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+    fp = fopen(diff_file.c_str(), "rb");
+    if (fp == nullptr) {
+      ZSTD_freeDCtx(dctx);
+      throw std::runtime_error("fopen failed");
+    }
+    input = {in_buf.data(), 0, 0};
+  }
+  ~CompressedDiffReader() {
+    fclose(fp);
+    ZSTD_freeDCtx(dctx);
+  }
+  CompressedDiffReader(const CompressedDiffReader &) = delete;
+  CompressedDiffReader &operator=(const CompressedDiffReader &) = delete;
+  /**
+   * @return false at the end of the stream
+   */
+  inline bool Get(uint8_t &c) {
+    if (out_pos == out_size && !Refill()) return false;
+    c = out_buf[out_pos++];
+    return true;
+  }
+  inline uint8_t Get() {
+    uint8_t c;
+    if (!Get(c)) throw std::runtime_error("the diff file ends unexpectedly");
+    return c;
+  }
   /**
-   * Step 1: compare content of old_file and new_file, write it to buf
-   * Step 2: use zstd to compress buf, write it to diff_file
+   * @return the number of bytes read into buf, less than len only at the end of the stream
    */
-  sjtu::vector<uint8_t> buf;
-  // Step 1
+  size_t Read(uint8_t *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+      if (out_pos == out_size && !Refill()) break;
+      size_t n = std::min(len - done, out_size - out_pos);
+      memcpy(buf + done, out_buf.data() + out_pos, n);
+      out_pos += n;
+      done += n;
+    }
+    return done;
+  }
+};
+/**
+ * @brief the longest run of changed bytes in one segment, longer runs are split so that they need not be buffered
+ */
+const default_numeric_index_t kMaxDiffSegmentLength = 1 << 20;
+/**
+ * @brief append a segment of changed bytes at pos to a diff, in the format read by ApplyPatch
+ */
+static void AppendDiffSegment(CompressedDiffWriter &writer, default_numeric_index_t pos, const uint8_t *old_bytes,
+                              const uint8_t *new_bytes, default_numeric_index_t len) {
+  writer.Put(0);
+  writer.Put((len >> 24) & 0xFF);
+  writer.Put((len >> 16) & 0xFF);
+  writer.Put((len >> 8) & 0xFF);
+  writer.Put(len & 0xFF);
+  writer.Put((pos >> 24) & 0xFF);
+  writer.Put((pos >> 16) & 0xFF);
+  writer.Put((pos >> 8) & 0xFF);
+  writer.Put(pos & 0xFF);
+  writer.Put(old_bytes, len);
+  writer.Put(new_bytes, len);
+}
+void GenerateDiff(const std::string &old_file, const std::string &new_file, const std::string &diff_file,
+                  const DiffCompressionConfig &config) {
+  /**
+   * compare the content of old_file and new_file, and stream the diff into the compressor of diff_file
+   */
+  CompressedDiffWriter writer(diff_file, config);
   default_numeric_index_t old_file_size = GetFileSize(old_file);
   default_numeric_index_t new_file_size = GetFileSize(new_file);
   default_numeric_index_t shared_size = std::min(old_file_size, new_file_size);
-  bool current_is_diff = false;
-  default_numeric_index_t current_diff_len = 0, current_diff_pos = 0;
+  default_numeric_index_t current_diff_pos = 0;
   sjtu::vector<uint8_t> diff_buff_in_old, diff_buff_in_new;
   FILE *old_fp = fopen(old_file.c_str(), "rb");
   FILE *new_fp = fopen(new_file.c_str(), "rb");
   uint8_t_reader old_reader(old_fp), new_reader(new_fp);
+  auto flush_segment = [&]() {
+    if (diff_buff_in_old.size() == 0) return;
+    AppendDiffSegment(writer, current_diff_pos, diff_buff_in_old.data(), diff_buff_in_new.data(),
+                      diff_buff_in_old.size());
+    diff_buff_in_old.clear();
+    diff_buff_in_new.clear();
+  };
   for (size_t i = 0; i < shared_size; i++) {
     uint8_t o_c = old_reader(), n_c = new_reader();
     if (o_c == n_c) {
-      if (current_is_diff) {
-        buf.push_back(0);
-        buf.push_back((current_diff_len >> 24) & 0xFF);
-        buf.push_back((current_diff_len >> 16) & 0xFF);
-        buf.push_back((current_diff_len >> 8) & 0xFF);
-        buf.push_back(current_diff_len & 0xFF);
-        buf.push_back((current_diff_pos >> 24) & 0xFF);
-        buf.push_back((current_diff_pos >> 16) & 0xFF);
-        buf.push_back((current_diff_pos >> 8) & 0xFF);
-        buf.push_back(current_diff_pos & 0xFF);
-        for (uint8_t c : diff_buff_in_old) {
-          buf.push_back(c);
-        }
-        for (uint8_t c : diff_buff_in_new) {
-          buf.push_back(c);
-        }
-        current_is_diff = false;
-        current_diff_len = 0;
-        diff_buff_in_old.clear();
-        diff_buff_in_new.clear();
-      } else {
+      flush_segment();
+      continue;
+    }
+    if (diff_buff_in_old.size() == kMaxDiffSegmentLength) flush_segment();
+    if (diff_buff_in_old.size() == 0) current_diff_pos = i;
+    diff_buff_in_old.push_back(o_c);
+    diff_buff_in_new.push_back(n_c);
+  }
+  flush_segment();
+  if (old_file_size > shared_size) {
+    writer.Put(1);
+    for (size_t i = shared_size; i < old_file_size; i++) writer.Put(old_reader());
+  }
+  if (new_file_size > shared_size) {
+    writer.Put(2);
+    for (size_t i = shared_size; i < new_file_size; i++) writer.Put(new_reader());
+  }
+  fclose(old_fp);
+  fclose(new_fp);
+  if (writer.BytesWritten() == 0) writer.Put(3);  // an empty diff is a single flag 3
+  writer.Finish();
+}
+/**
+ * @brief read a whole file page by page, the part of the last page beyond the end of the file is zero
+ */
+class FilePageReader {
+  FILE *fp;
+
+ public:
+  explicit FilePageReader(const std::string &file) : fp(fopen(file.c_str(), "rb")) {
+    if (fp == nullptr) throw std::runtime_error("fopen failed");
+  }
+  ~FilePageReader() { fclose(fp); }
+  void operator()(page_id_t page_id, uint8_t *page) {
+    memset(page, 0, kPageSize);
+    fseek(fp, (size_t)page_id * kPageSize, SEEK_SET);
+    fread(page, 1, kPageSize, fp);
+  }
+};
+void GeneratePageDiff(const std::string &old_file, const PageReader &read_new_page, size_t new_file_size,
+                      const sjtu::vector<page_id_t> &pages, const std::string &diff_file,
+                      const DiffCompressionConfig &config) {
+  CompressedDiffWriter writer(diff_file, config);
+  default_numeric_index_t old_file_size = GetFileSize(old_file);
+  default_numeric_index_t shared_size = std::min<size_t>(old_file_size, new_file_size);
+  FilePageReader read_old_page(old_file);
+  sjtu::vector<uint8_t> old_page(kPageSize), new_page(kPageSize);
+  for (size_t k = 0; k < pages.size(); k++) {
+    size_t page_begin = (size_t)pages[k] * kPageSize;
+    if (page_begin >= shared_size) break;  // the rest is in the tails
+    size_t len = std::min(kPageSize, shared_size - page_begin);
+    read_old_page(pages[k], old_page.data());
+    read_new_page(pages[k], new_page.data());
+    // the runs of changed bytes inside the page
+    for (size_t i = 0; i < len;) {
+      if (old_page[i] == new_page[i]) {
+        i++;
         continue;
       }
-    } else {
-      if (current_is_diff) {
-        diff_buff_in_old.push_back(o_c);
-        diff_buff_in_new.push_back(n_c);
-        current_diff_len++;
-      } else {
-        current_is_diff = true;
-        current_diff_len = 1;
-        current_diff_pos = i;
-        diff_buff_in_old.push_back(o_c);
-        diff_buff_in_new.push_back(n_c);
-      }
+      size_t j = i;
+      while (j < len && old_page[j] != new_page[j]) j++;
+      AppendDiffSegment(writer, page_begin + i, old_page.data() + i, new_page.data() + i, j - i);
+      i = j;
     }
   }
-  if (current_is_diff) {
-    buf.push_back(0);
-    buf.push_back((current_diff_len >> 24) & 0xFF);
-    buf.push_back((current_diff_len >> 16) & 0xFF);
-    buf.push_back((current_diff_len >> 8) & 0xFF);
-    buf.push_back(current_diff_len & 0xFF);
-    buf.push_back((current_diff_pos >> 24) & 0xFF);
-    buf.push_back((current_diff_pos >> 16) & 0xFF);
-    buf.push_back((current_diff_pos >> 8) & 0xFF);
-    buf.push_back(current_diff_pos & 0xFF);
-    for (uint8_t c : diff_buff_in_old) {
-      buf.push_back(c);
+  auto append_tail = [&writer](const PageReader &read_page, size_t begin, size_t end, sjtu::vector<uint8_t> &page) {
+    while (begin < end) {
+      read_page(begin / kPageSize, page.data());
+      size_t offset = begin % kPageSize, len = std::min(kPageSize - offset, end - begin);
+      writer.Put(page.data() + offset, len);
+      begin += len;
     }
-    for (uint8_t c : diff_buff_in_new) {
-      buf.push_back(c);
+  };
+  if (old_file_size > shared_size) {
+    writer.Put(1);
+    append_tail(std::ref(read_old_page), shared_size, old_file_size, old_page);
+  }
+  if (new_file_size > shared_size) {
+    writer.Put(2);
+    append_tail(read_new_page, shared_size, new_file_size, new_page);
+  }
+  if (writer.BytesWritten() == 0) writer.Put(3);  // an empty diff is a single flag 3
+  writer.Finish();
+}
+void GeneratePageDiff(const std::string &old_file, const std::string &new_file, const sjtu::vector<page_id_t> &pages,
+                      const std::string &diff_file, const DiffCompressionConfig &config) {
+  FilePageReader read_new_page(new_file);
+  GeneratePageDiff(old_file, std::ref(read_new_page), GetFileSize(new_file), pages, diff_file, config);
+}
+void UpdateFrontier(const std::string &frontier_file, const PageReader &read_new_page, size_t new_file_size,
+                    const sjtu::vector<page_id_t> &pages) {
+  default_numeric_index_t old_file_size = GetFileSize(frontier_file);
+  FILE *frontier_fp = fopen(frontier_file.c_str(), "r+b");
+  if (frontier_fp == nullptr) throw std::runtime_error("fopen failed");
+  sjtu::vector<uint8_t> page(kPageSize);
+  auto copy_range = [&](size_t begin, size_t end) {
+    while (begin < end) {
+      read_new_page(begin / kPageSize, page.data());
+      size_t offset = begin % kPageSize, len = std::min(kPageSize - offset, end - begin);
+      fseek(frontier_fp, begin, SEEK_SET);
+      fwrite(page.data() + offset, 1, len, frontier_fp);
+      begin += len;
     }
+  };
+  for (size_t k = 0; k < pages.size(); k++) {
+    size_t page_begin = (size_t)pages[k] * kPageSize;
+    if (page_begin >= std::min<size_t>(old_file_size, new_file_size)) break;
+    copy_range(page_begin, std::min(page_begin + kPageSize, new_file_size));
   }
-  if (old_file_size > shared_size) {
-    buf.push_back(1);
-    for (size_t i = shared_size; i < old_file_size; i++) {
-      buf.push_back(old_reader());
+  if (new_file_size > old_file_size) copy_range(old_file_size, new_file_size);
+  fclose(frontier_fp);
+  if (new_file_size < old_file_size && truncate(frontier_file.c_str(), new_file_size) != 0) {
+    throw std::runtime_error("truncate failed");
+  }
+}
+void UpdateFrontier(const std::string &frontier_file, const std::string &new_file,
+                    const sjtu::vector<page_id_t> &pages) {
+  FilePageReader read_new_page(new_file);
+  UpdateFrontier(frontier_file, std::ref(read_new_page), GetFileSize(new_file), pages);
+}
+/**
+ * @brief the composition of a chain of diffs, as the bytes they overwrite on top of a base file
+ * @details The diffs are replayed on sparse overlay pages in memory instead of on the file, so a chain of any length
+ * costs one pass over every diff and a single pass over the base file when writing the result. The memory used is
+ * proportional to the bytes touched by the chain, not to its length.
+ */
+class DiffComposer {
+  constexpr static size_t kOverlayPageSize = 4096;
+  struct OverlayPage {
+    uint8_t data[kOverlayPageSize];
+    uint64_t mask[kOverlayPageSize / 64] = {};  // which bytes of data are written by the diffs
+  };
+  sjtu::map<size_t, OverlayPage *> pages;
+  size_t size;  // the size of the composed file
+  size_t last_page_index = -1;
+  OverlayPage *last_page = nullptr;
+
+  inline void Write(size_t pos, uint8_t c) {
+    if (pos / kOverlayPageSize != last_page_index) {
+      last_page_index = pos / kOverlayPageSize;
+      OverlayPage *&page = pages[last_page_index];
+      if (page == nullptr) page = new OverlayPage;
+      last_page = page;
     }
+    OverlayPage *page = last_page;
+    size_t offset = pos % kOverlayPageSize;
+    page->data[offset] = c;
+    page->mask[offset / 64] |= 1ull << (offset % 64);
   }
-  if (new_file_size > shared_size) {
-    buf.push_back(2);
-    for (size_t i = shared_size; i < new_file_size; i++) {
-      buf.push_back(new_reader());
-    }
-  }
-  if (buf.size() == 0) buf.push_back(3);
-  // Step 2
-  size_t compressed_size_bound = ZSTD_compressBound(buf.size());
-  uint8_t *compressed_buf = new uint8_t[compressed_size_bound];
-  size_t compressed_size = ZSTD_compress(compressed_buf, compressed_size_bound, buf.data(), buf.size(), 12);
-  if (ZSTD_isError(compressed_size)) {
-    delete[] compressed_buf;
-    throw std::runtime_error(ZSTD_getErrorName(compressed_size));
-  }
-  FILE *fp = fopen(diff_file.c_str(), "wb");
-  if (fp == nullptr) {
-    delete[] compressed_buf;
-    throw std::runtime_error("fopen failed");
+
+ public:
+  explicit DiffComposer(size_t base_size) : size(base_size) {}
+  ~DiffComposer() {
+    for (auto it = pages.begin(); it != pages.end(); ++it) delete it->second;
+  }
+  DiffComposer(const DiffComposer &) = delete;
+  DiffComposer &operator=(const DiffComposer &) = delete;
+  /**
+   * @brief compose one more diff of the chain, in the same format as ApplyPatch reads
+   */
+  void Apply(const std::string &diff_file, bool is_reverse) {
+    CompressedDiffReader diff(diff_file);
+    uint8_t flag;
+    while (diff.Get(flag)) {
+      if (flag == 3) break;
+      if (flag == 0) {
+        default_numeric_index_t len = 0, pos = 0;
+        for (int i = 0; i < 4; i++) len = len << 8 | diff.Get();
+        for (int i = 0; i < 4; i++) pos = pos << 8 | diff.Get();
+        if ((size_t)pos + len > size) throw std::runtime_error("the diff does not match the chain");
+        for (size_t i = 0; i < len; i++) {
+          uint8_t c = diff.Get();
+          if (is_reverse) Write(pos + i, c);
+        }
+        for (size_t i = 0; i < len; i++) {
+          uint8_t c = diff.Get();
+          if (!is_reverse) Write(pos + i, c);
+        }
+        continue;
+      }
+      uint8_t c;
+      if ((flag == 1) != is_reverse) {
+        size_t delta_len = 0;
+        while (diff.Get(c)) delta_len++;
+        if (delta_len > size) throw std::runtime_error("the diff does not match the chain");
+        size -= delta_len;
+      } else {
+        while (diff.Get(c)) Write(size++, c);
+      }
+      break;
+    }
+  }
+  /**
+   * @brief write the base with the composed diffs on top of it into new_file
+   * @param read_base read_base(buf, len) reads the next bytes of the base sequentially, returns the count read
+   */
+  void WriteResult(const std::function<size_t(uint8_t *, size_t)> &read_base, size_t base_size,
+                   const std::string &new_file) {
+    FILE *fp = fopen(new_file.c_str(), "wb");
+    if (fp == nullptr) throw std::runtime_error("fopen failed");
+    uint8_t chunk[kOverlayPageSize];
+    auto it = pages.begin();
+    for (size_t begin = 0; begin < size; begin += kOverlayPageSize) {
+      size_t len = std::min(kOverlayPageSize, size - begin);
+      size_t from_base = begin < base_size ? std::min(len, base_size - begin) : 0;
+      if (from_base > 0 && read_base(chunk, from_base) != from_base) {
+        fclose(fp);
+        throw std::runtime_error("the base of the chain is too short");
+      }
+      memset(chunk + from_base, 0, len - from_base);
+      while (it != pages.end() && it->first < begin / kOverlayPageSize) ++it;
+      if (it != pages.end() && it->first == begin / kOverlayPageSize) {
+        const OverlayPage *page = it->second;
+        for (size_t i = 0; i < len; i++)
+          if (page->mask[i / 64] >> (i % 64) & 1) chunk[i] = page->data[i];
+      }
+      fwrite(chunk, 1, len, fp);
+    }
+    fclose(fp);
   }
-  fwrite(compressed_buf, 1, compressed_size, fp);
+};
+/**
+ * @brief write the full content of a file as a keyframe, which is [size: u64 LE][content] compressed by zstd
+ */
+static void WriteKeyFrame(const std::string &file, const std::string &key_frame_file,
+                          const DiffCompressionConfig &config) {
+  // a keyframe is trusted once it exists, so it only appears under its name when complete
+  CompressedDiffWriter writer(key_frame_file + ".tmp", config);
+  uint64_t file_size = GetFileSize(file);
+  for (int i = 0; i < 8; i++) writer.Put(file_size >> (8 * i) & 0xFF);
+  FILE *fp = fopen(file.c_str(), "rb");
+  if (fp == nullptr) throw std::runtime_error("fopen failed");
+  uint8_t buf[1 << 12];
+  size_t read_size;
+  while ((read_size = fread(buf, 1, sizeof(buf), fp)) > 0) writer.Put(buf, read_size);
   fclose(fp);
-  delete[] compressed_buf;
+  writer.Finish();
+  if (rename((key_frame_file + ".tmp").c_str(), key_frame_file.c_str()) != 0) {
+    throw std::runtime_error("rename failed");
+  }
 }
 void ApplyPatch(const std::string &old_file, const std::string &diff_file, const std::string &new_file,
                 bool is_reverse) {
-  default_numeric_index_t compressed_size = GetFileSize(diff_file);
-  uint8_t *compressed_buf = new uint8_t[compressed_size + 5];
-  FILE *fp = fopen(diff_file.c_str(), "rb");
-  fread(compressed_buf, 1, compressed_size, fp);
-  fclose(fp);
-  size_t decompressed_buf_size = ZSTD_decompressBound(compressed_buf, compressed_size);
-  uint8_t *decompressed_buf = new uint8_t[decompressed_buf_size];
-  size_t decompressed_size = ZSTD_decompress(decompressed_buf, decompressed_buf_size, compressed_buf, compressed_size);
-  if (ZSTD_isError(decompressed_size)) {
-    delete[] compressed_buf;
-    delete[] decompressed_buf;
-    throw std::runtime_error(ZSTD_getErrorName(decompressed_size));
-  }
-  delete[] compressed_buf;
-  fp = fopen(old_file.c_str(), "rb");
+  CompressedDiffReader diff(diff_file);
+  FILE *fp = fopen(old_file.c_str(), "rb");
   size_t old_file_size = GetFileSize(old_file);
   FILE *fp2 = fopen(new_file.c_str(), "wb");
   uint8_t_reader reader(fp);
   uint8_t_writer writer(fp2);
-  size_t diff_buf_cnt = 0;
   size_t reader_cursor = 0;
-  while (diff_buf_cnt < decompressed_size) {
-    uint8_t flag;
-    flag = decompressed_buf[diff_buf_cnt++];
-    if (flag == 3) goto just_copy;
+  auto copy_old_until = [&](size_t end) {
+    while (reader_cursor < end) {
+      writer(reader());
+      reader_cursor++;
+    }
+  };
+  uint8_t flag;
+  while (diff.Get(flag)) {
+    if (flag == 3) break;
     if (flag == 0) {
-      default_numeric_index_t current_diff_len = 0, current_diff_pos = 0, tmp = 0;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_len |= tmp << 24;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_len |= tmp << 16;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_len |= tmp << 8;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_len |= tmp;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_pos |= tmp << 24;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_pos |= tmp << 16;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_pos |= tmp << 8;
-      tmp = decompressed_buf[diff_buf_cnt++];
-      current_diff_pos |= tmp;
-      while (reader_cursor < current_diff_pos) {
-        writer(reader());
-        reader_cursor++;
-      }
-      uint8_t *old_buf = new uint8_t[current_diff_len];
-      uint8_t *new_buf = new uint8_t[current_diff_len];
+      default_numeric_index_t current_diff_len = 0, current_diff_pos = 0;
+      for (int i = 0; i < 4; i++) current_diff_len = current_diff_len << 8 | diff.Get();
+      for (int i = 0; i < 4; i++) current_diff_pos = current_diff_pos << 8 | diff.Get();
+      copy_old_until(current_diff_pos);
+      // the old bytes come first, then the new bytes, keep the ones of the direction
       for (size_t i = 0; i < current_diff_len; i++) {
-        old_buf[i] = decompressed_buf[diff_buf_cnt++];
+        uint8_t c = diff.Get();
+        if (is_reverse) writer(c);
       }
       for (size_t i = 0; i < current_diff_len; i++) {
-        new_buf[i] = decompressed_buf[diff_buf_cnt++];
-      }
-      if (!is_reverse) {
-        for (size_t i = 0; i < current_diff_len; i++) {
-          writer(new_buf[i]);
-          reader_cursor++;
-          reader();
-        }
-      } else {
-        for (size_t i = 0; i < current_diff_len; i++) {
-          writer(old_buf[i]);
-          reader_cursor++;
-          reader();
-        }
-      }
-      delete[] old_buf;
-      delete[] new_buf;
-    } else if (flag == 1) {
-      size_t delta_len = decompressed_size - diff_buf_cnt;
-      if (!is_reverse) {
-        // Just make the last bytes disappear
-        while (reader_cursor < old_file_size - delta_len) {
-          writer(reader());
-          reader_cursor++;
-        }
-        goto ed;
-      } else {
-        while (reader_cursor < old_file_size) {
-          writer(reader());
-          reader_cursor++;
-        }
-        while (diff_buf_cnt < decompressed_size) {
-          writer(decompressed_buf[diff_buf_cnt++]);
-        }
-        goto ed;
+        uint8_t c = diff.Get();
+        if (!is_reverse) writer(c);
+        reader();
+        reader_cursor++;
       }
-    } else if (flag == 2) {
-      size_t delta_len = decompressed_size - diff_buf_cnt;
-      if (is_reverse) {
-        // Just make the last bytes disappear
-        while (reader_cursor < old_file_size - delta_len) {
-          writer(reader());
-          reader_cursor++;
-        }
-        goto ed;
+    } else {
+      // the rest of the diff is the tail of the old file (flag 1) or the new file (flag 2)
+      if ((flag == 1) != is_reverse) {
+        // make the tail disappear, the length of the tail is only known after reading it through
+        size_t delta_len = 0;
+        uint8_t c;
+        while (diff.Get(c)) delta_len++;
+        copy_old_until(old_file_size - delta_len);
       } else {
-        while (reader_cursor < old_file_size) {
-          writer(reader());
-          reader_cursor++;
-        }
-        while (diff_buf_cnt < decompressed_size) {
-          writer(decompressed_buf[diff_buf_cnt++]);
-        }
-        goto ed;
+        copy_old_until(old_file_size);
+        uint8_t c;
+        while (diff.Get(c)) writer(c);
       }
+      goto ed;
     }
   }
-just_copy:;
-  if (reader_cursor < old_file_size) {
-    while (reader_cursor < old_file_size) {
-      writer(reader());
-      reader_cursor++;
-    }
-  }
+  copy_old_until(old_file_size);
 ed:;
   writer.Flush();
   fclose(fp);
   fclose(fp2);
-  delete[] decompressed_buf;
 }
 
-void SnapShotManager::InitializeRepository() {
-  FILE *f = fopen(meta_file.c_str(), "w");
-  if (f == nullptr) {
-    throw std::runtime_error("fopen failed");
+/**
+ * @brief make frontier_file, whose content is described by current, match target by only writing the pages that differ
+ * @return the number of pages read from the store
+ */
+static size_t CheckOutPages(PageStore &store, const std::string &frontier_file, const PageManifest &current,
+                            const PageManifest &target) {
+  FILE *frontier_fp = fopen(frontier_file.c_str(), "r+b");
+  if (frontier_fp == nullptr) throw std::runtime_error("fopen failed");
+  sjtu::vector<uint8_t> page(kPageSize);
+  size_t changed_pages = 0;
+  try {
+    for (size_t k = 0; k < target.pages.size(); k++) {
+      // the padding of the last page is zero in both, so it is made right by the truncate below
+      if (k < current.pages.size() && current.pages[k] == target.pages[k]) continue;
+      store.Get(target.pages[k], page.data());
+      fseek(frontier_fp, k * kPageSize, SEEK_SET);
+      fwrite(page.data(), 1, std::min(kPageSize, target.file_size - k * kPageSize), frontier_fp);
+      changed_pages++;
+    }
+  } catch (...) {
+    fclose(frontier_fp);
+    throw;
+  }
+  fclose(frontier_fp);
+  if (truncate(frontier_file.c_str(), target.file_size) != 0) throw std::runtime_error("truncate failed");
+  return changed_pages;
+}
+
+sjtu::vector<DataDriverBase::FileEntry> SnapShotManager::FlushAndListFiles(bool lock_down) {
+  sjtu::vector<DataDriverBase::FileEntry> res;
+  for (size_t i = 0; i < drivers.size(); i++) {
+    drivers[i]->Flush();
+    if (lock_down) drivers[i]->LockDownForCheckOut();
+    sjtu::vector<DataDriverBase::FileEntry> files = drivers[i]->ListFiles();
+    for (size_t j = 0; j < files.size(); j++) res.push_back(files[j]);
+  }
+  return res;
+}
+
+void SnapShotManager::ParallelForFiles(size_t count, const std::function<void(size_t)> &fn) {
+  WorkStealingThreadPool *pool;
+  {
+    std::lock_guard<std::mutex> guard(file_pool_latch);
+    if (file_pool == nullptr) {
+      size_t worker_count = file_concurrency > 0 ? file_concurrency : std::thread::hardware_concurrency();
+      file_pool = std::make_unique<WorkStealingThreadPool>(worker_count);
+    }
+    pool = file_pool.get();
+  }
+  pool->ParallelFor(0, count, 1, fn);
+}
+
+void SnapShotManager::WriteMetaFile(const std::string &HEAD,
+                                    const sjtu::vector<std::pair<std::string, std::string>> &snapshot_relationship) {
+  std::string tmp_file = meta_file + ".tmp";
+  {
+    std::fstream fs(tmp_file, std::ios::out | std::ios::trunc);
+    fs << HEAD << '\n';
+    for (size_t i = 0; i < snapshot_relationship.size(); i++) {
+      fs << snapshot_relationship[i].first << ' ' << snapshot_relationship[i].second << '\n';
+    }
+    if (!fs.good()) throw std::runtime_error("failed to write the meta file");
   }
-  fprintf(f, "INIT\n");
-  fclose(f);
+  SyncFile(tmp_file);
+  if (rename(tmp_file.c_str(), meta_file.c_str()) != 0) {
+    throw std::runtime_error("rename failed");
+  }
+}
+
+void SnapShotManager::InitializeRepository() {
+  if (page_store_enabled) PageStore(meta_file + ".pages").Save();
+  WriteMetaFile("INIT", {});
   for (size_t i = 0; i < drivers.size(); i++) {
     sjtu::vector<DataDriverBase::FileEntry> files = drivers[i]->ListFiles();
     for (size_t j = 0; j < files.size(); j++) {
@@ -317,10 +672,71 @@ void SnapShotManager::InitializeRepository() {
         throw std::runtime_error("fopen failed");
       }
       fclose(f);
+      if (page_store_enabled) WritePageManifest(frontier_file + ".manifest", PageManifest());
     }
   }
 }
 
+void SnapShotManager::LoadPageStore() {
+  std::string directory = meta_file + ".pages";
+  if (PageStore::Exists(directory)) {
+    page_store = std::make_unique<PageStore>(directory);
+  } else if (page_store_enabled) {
+    throw std::runtime_error("the snapshot repository was created without the page store");
+  }
+}
+
+void SnapShotManager::StorePages(const std::string &path, const PageReader &read_new_page, size_t new_file_size,
+                                 const sjtu::vector<page_id_t> &pages, const std::string &snap_shot_ID) {
+  std::string frontier_file = path + ".frontier";
+  PageManifest manifest;
+  ReadPageManifest(frontier_file + ".manifest", manifest);
+  size_t old_file_size = manifest.file_size, old_count = manifest.pages.size();
+  size_t new_count = (new_file_size + kPageSize - 1) / kPageSize;
+  manifest.pages.resize(new_count);
+  manifest.file_size = new_file_size;
+  sjtu::vector<uint8_t> page(kPageSize);
+  auto store_page = [&](size_t page_id) {
+    read_new_page(page_id, page.data());
+    size_t valid = std::min(kPageSize, new_file_size - page_id * kPageSize);
+    memset(page.data() + valid, 0, kPageSize - valid);
+    manifest.pages[page_id] = page_store->Put(page.data());
+  };
+  size_t common_count = std::min(old_count, new_count);
+  for (size_t k = 0; k < pages.size() && pages[k] < common_count; k++) store_page(pages[k]);
+  // the padding of the last common page changes with the size
+  if (new_file_size != old_file_size && common_count > 0) store_page(common_count - 1);
+  for (size_t k = common_count; k < new_count; k++) store_page(k);
+  // a frontier without a manifest is rewritten as a whole next time, which is what a crash in between needs
+  remove((frontier_file + ".manifest").c_str());
+  UpdateFrontier(frontier_file, read_new_page, new_file_size, pages);
+  WritePageManifest(path + "." + snap_shot_ID + ".manifest", manifest);
+  WritePageManifest(frontier_file + ".manifest", manifest);
+}
+
+void SnapShotManager::CollectPageGarbage(
+    const sjtu::vector<DataDriverBase::FileEntry> &files,
+    const sjtu::vector<std::pair<std::string, std::string>> &snapshot_relationship) {
+  sjtu::map<PageKey, bool> live;
+  PageManifest manifest;
+  auto mark = [&](const std::string &manifest_file) {
+    ReadPageManifest(manifest_file, manifest);
+    for (size_t k = 0; k < manifest.pages.size(); k++) live[manifest.pages[k]] = true;
+  };
+  for (size_t j = 0; j < files.size(); j++) {
+    mark(files[j].path + ".frontier.manifest");
+    for (size_t i = 0; i < snapshot_relationship.size(); i++) {
+      mark(files[j].path + "." + snapshot_relationship[i].first + ".manifest");
+    }
+  }
+  size_t dropped = page_store->Sweep([&live](const PageKey &key) { return live.find(key) != live.end(); });
+  // the index must not refer to the dropped slots once they are reused
+  page_store->Save();
+  if (logger_ptr) {
+    logger_ptr->info("dropped {} pages from the page store, {} remain", dropped, page_store->size());
+  }
+}
+
 void SnapShotManager::CreateSnapShot(const std::string &snap_shot_ID) {
   if (!has_set_meta_file) {
     throw std::runtime_error("SnapShotManager has not set the meta file");
@@ -328,6 +744,7 @@ void SnapShotManager::CreateSnapShot(const std::string &snap_shot_ID) {
   if (!has_connected) {
     throw std::runtime_error("SnapShotManager has not connected to the data drivers");
   }
+  WaitForPendingSnapShot();
   std::fstream fs(meta_file, std::ios::in | std::ios::out);
   std::string HEAD;
   fs >> HEAD;
@@ -344,22 +761,211 @@ void SnapShotManager::CreateSnapShot(const std::string &snap_shot_ID) {
     throw std::runtime_error("Snapshot already exists");
   }
   fs.close();
-  fs.open(meta_file, std::ios::in | std::ios::out);
-  fs << snap_shot_ID << '\n';
-  for (size_t i = 0; i < snapshot_relationship.size(); i++) {
-    fs << snapshot_relationship[i].first << ' ' << snapshot_relationship[i].second << '\n';
+  bool write_key_frame = false;
+  if (page_store == nullptr && key_frame_interval > 0) {
+    // the number of diffs from the new snapshot up to the closest keyframe of its chain
+    size_t depth = 1;
+    for (std::string node = HEAD; !HasKeyFrame(node) && get_anc.find(node) != get_anc.end(); node = get_anc[node]) {
+      depth++;
+    }
+    write_key_frame = depth >= key_frame_interval;
+  }
+  sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles();
+  sjtu::vector<DataDriverBase::FileEntry> locked_files;
+  sjtu::vector<FrozenFile> frozen_files;
+  for (size_t j = 0; j < files.size(); j++) {
+    DiskManager *disk_manager = files[j].disk_manager;
+    if (disk_manager == nullptr) {
+      locked_files.push_back(files[j]);
+      continue;
+    }
+    FrozenFile frozen;
+    frozen.path = files[j].path;
+    frozen.disk_manager = disk_manager;
+    // the frontier matches the file as of the last snapshot, so only the pages written since then can differ
+    bool reliable = disk_manager->DirtyPages(frozen.pages);
+    frozen.frozen_size = disk_manager->FreezeForSnapShot();
+    disk_manager->ResetDirtyPages();
+    if (!reliable) {
+      frozen.pages.clear();
+      for (size_t k = 0; k * kPageSize < frozen.frozen_size; k++) frozen.pages.push_back(k);
+    }
+    frozen_files.push_back(frozen);
+  }
+  // the locked down drivers cannot change meanwhile, so their files are done right away
+  ParallelForFiles(locked_files.size(), [&](size_t j) {
+    std::string frontier_file = locked_files[j].path + ".frontier";
+    if (page_store != nullptr) {
+      FilePageReader read_new_page(locked_files[j].path);
+      size_t file_size = GetFileSize(locked_files[j].path);
+      sjtu::vector<page_id_t> pages;
+      for (size_t k = 0; k * kPageSize < file_size; k++) pages.push_back(k);
+      StorePages(locked_files[j].path, std::ref(read_new_page), file_size, pages, snap_shot_ID);
+      return;
+    }
+    GenerateDiff(frontier_file, locked_files[j].path, locked_files[j].path + "." + snap_shot_ID + ".diff", compression);
+    CopyFile(locked_files[j].path, frontier_file);
+    if (write_key_frame) WriteKeyFrame(frontier_file, locked_files[j].path + "." + snap_shot_ID + ".key", compression);
+  });
+  // the snapshot becomes visible when every diff is written
+  snapshot_relationship.push_back({snap_shot_ID, HEAD});
+  if (frozen_files.empty()) {
+    if (page_store != nullptr) page_store->Save();
+    WriteMetaFile(snap_shot_ID, snapshot_relationship);
+    return;
+  }
+  pending_snap_shot = std::thread([this, snap_shot_ID, frozen_files, write_key_frame, snapshot_relationship]() {
+    try {
+      ParallelForFiles(frozen_files.size(), [&](size_t i) {
+        const FrozenFile &frozen = frozen_files[i];
+        try {
+          std::string frontier_file = frozen.path + ".frontier";
+          std::string diff_file = frozen.path + "." + snap_shot_ID + ".diff";
+          PageReader read_frozen_page = [&frozen](page_id_t page_id, uint8_t *page) {
+            frozen.disk_manager->ReadFrozenPage(page_id, reinterpret_cast<char *>(page));
+          };
+          if (page_store != nullptr) {
+            StorePages(frozen.path, read_frozen_page, frozen.frozen_size, frozen.pages, snap_shot_ID);
+          } else {
+            GeneratePageDiff(frontier_file, read_frozen_page, frozen.frozen_size, frozen.pages, diff_file, compression);
+            UpdateFrontier(frontier_file, read_frozen_page, frozen.frozen_size, frozen.pages);
+            if (write_key_frame) WriteKeyFrame(frontier_file, frozen.path + "." + snap_shot_ID + ".key", compression);
+          }
+        } catch (...) {
+          frozen.disk_manager->ReleaseFrozen();
+          throw;
+        }
+        frozen.disk_manager->ReleaseFrozen();
+        if (logger_ptr) {
+          logger_ptr->info("{}: snapshot {} written from {} pages", frozen.path, snap_shot_ID, frozen.pages.size());
+        }
+      });
+      if (page_store != nullptr) page_store->Save();
+      WriteMetaFile(snap_shot_ID, snapshot_relationship);
+    } catch (...) {
+      pending_error = std::current_exception();
+      if (logger_ptr) logger_ptr->error("failed to write snapshot {}", snap_shot_ID);
+    }
+  });
+}
+
+void SnapShotManager::WaitForPendingSnapShot() {
+  if (!pending_snap_shot.joinable()) return;
+  pending_snap_shot.join();
+  if (pending_error) {
+    std::exception_ptr error = pending_error;
+    pending_error = nullptr;
+    std::rethrow_exception(error);
   }
-  fs << snap_shot_ID << " " << HEAD << std::endl;
+}
+
+bool SnapShotManager::HasKeyFrame(const std::string &snap_shot_ID) {
+  if (snap_shot_ID == "INIT") return true;
   for (size_t i = 0; i < drivers.size(); i++) {
-    drivers[i]->Flush();
     sjtu::vector<DataDriverBase::FileEntry> files = drivers[i]->ListFiles();
     for (size_t j = 0; j < files.size(); j++) {
-      std::string frontier_file = files[j].path + ".frontier";
-      std::string diff_file = files[j].path + "." + snap_shot_ID + ".diff";
-      GenerateDiff(frontier_file, files[j].path, diff_file);
-      // then overwrite the frontier file
-      CopyFile(files[j].path, frontier_file);
+      if (access((files[j].path + "." + snap_shot_ID + ".key").c_str(), F_OK) != 0) return false;
+    }
+  }
+  return true;
+}
+
+sjtu::vector<SnapShotManager::WayEntry> SnapShotManager::FindShortestWay(const std::string &dest, std::string &base) {
+  if (!has_set_meta_file) {
+    throw std::runtime_error("SnapShotManager has not set the meta file");
+  }
+  if (!has_connected) {
+    throw std::runtime_error("SnapShotManager has not connected to the data drivers");
+  }
+  std::fstream fs(meta_file, std::ios::in);
+  std::string HEAD;
+  fs >> HEAD;
+  std::string cur, anc;
+  sjtu::map<std::string, sjtu::vector<std::string>> son_list;
+  sjtu::map<std::string, std::string> get_anc;
+  while (fs >> cur >> anc) {
+    son_list[anc].push_back(cur);
+    get_anc[cur] = anc;
+  }
+  if (son_list.find(dest) == son_list.end() && get_anc.find(dest) == get_anc.end()) {
+    throw std::runtime_error("unable to find destination");
+  }
+  // BFS from dest over the whole tree, visit_record[v] is the first step from v towards dest
+  sjtu::map<std::string, WayEntry> visit_record;
+  sjtu::map<std::string, size_t> distance;
+  sjtu::list<std::string> Q;
+  distance[dest] = 0;
+  Q.push_back(dest);
+  while (!Q.empty()) {
+    cur = Q.front();
+    Q.pop_front();
+    auto visit = [&](const std::string &v, const WayEntry &step) {
+      if (distance.find(v) != distance.end()) return;
+      distance[v] = distance[cur] + 1;
+      visit_record[v] = step;
+      Q.push_back(v);
+    };
+    if (get_anc.find(cur) != get_anc.end()) visit(get_anc[cur], {cur, cur, false});
+    if (son_list.find(cur) != son_list.end()) {
+      auto &s_l = son_list[cur];
+      for (size_t j = 0; j < s_l.size(); j++) visit(s_l[j], {cur, s_l[j], true});
+    }
+  }
+  if (distance.find(HEAD) == distance.end()) {
+    throw std::runtime_error("HEAD is isolated from the tree, maybe the snapshot repository is currupted");
+  }
+  // the frontier is preferred on a tie, as it needs no decompression
+  base = "";
+  size_t best = distance[HEAD];
+  for (auto it = distance.begin(); it != distance.end(); ++it) {
+    if (it->second < best && HasKeyFrame(it->first)) {
+      best = it->second;
+      base = it->first;
+    }
+  }
+  sjtu::vector<WayEntry> res;
+  std::string tmp = base.empty() ? HEAD : base;
+  while (tmp != dest) {
+    res.push_back(visit_record[tmp]);
+    tmp = visit_record[tmp].snap_ID;
+  }
+  if (logger_ptr) {
+    logger_ptr->info("the way to {} starts from {} with {} diffs", dest, base.empty() ? "the frontier" : base,
+                     res.size());
+  }
+  return res;
+}
+
+void SnapShotManager::ApplyLongChange(const std::string &base, const std::string &new_file,
+                                      const sjtu::vector<WayEntry> &way, const std::string &file_name_base) {
+  size_t base_size = 0;
+  std::function<size_t(uint8_t *, size_t)> read_base = [](uint8_t *, size_t) -> size_t { return 0; };
+  FILE *base_fp = nullptr;
+  std::unique_ptr<CompressedDiffReader> key_frame;
+  if (base.empty()) {
+    std::string frontier_file = file_name_base + ".frontier";
+    base_size = GetFileSize(frontier_file);
+    base_fp = fopen(frontier_file.c_str(), "rb");
+    if (base_fp == nullptr) throw std::runtime_error("fopen failed");
+    read_base = [base_fp](uint8_t *buf, size_t len) { return fread(buf, 1, len, base_fp); };
+  } else if (base != "INIT") {
+    key_frame = std::make_unique<CompressedDiffReader>(file_name_base + "." + base + ".key");
+    for (int i = 0; i < 8; i++) base_size |= (size_t)key_frame->Get() << (8 * i);
+    read_base = [&key_frame](uint8_t *buf, size_t len) { return key_frame->Read(buf, len); };
+  }
+  try {
+    DiffComposer composer(base_size);
+    for (size_t i = 0; i < way.size(); i++) {
+      composer.Apply(file_name_base + "." + way[i].diff_ID + ".diff", way[i].is_reverse);
     }
+    composer.WriteResult(read_base, base_size, new_file);
+  } catch (...) {
+    if (base_fp != nullptr) fclose(base_fp);
+    throw;
+  }
+  if (base_fp != nullptr) fclose(base_fp);
+  if (logger_ptr) {
+    logger_ptr->info("composed {} diffs onto {} into {}", way.size(), base.empty() ? "the frontier" : base, new_file);
   }
 }
 
@@ -370,29 +976,28 @@ void SnapShotManager::CheckOutFrontier() {
   if (!has_connected) {
     throw std::runtime_error("SnapShotManager has not connected to the data drivers");
   }
+  WaitForPendingSnapShot();
   if (logger_ptr) {
     logger_ptr->info("Checking out frontier");
   }
   std::fstream fs(meta_file, std::ios::in);
   std::string HEAD;
   fs >> HEAD;
-  for (size_t i = 0; i < drivers.size(); i++) {
-    drivers[i]->Flush();
-    drivers[i]->LockDownForCheckOut();
-    if (logger_ptr) {
-      logger_ptr->info("flushed and locked down driver {}", i);
-    }
-    sjtu::vector<DataDriverBase::FileEntry> files = drivers[i]->ListFiles();
-    for (size_t j = 0; j < files.size(); j++) {
-      if (HEAD == "INIT") {
-        remove(files[j].path.c_str());
-        continue;
-      }
-      std::string frontier_file = files[j].path + ".frontier";
-      // then overwrite the frontier file
-      CopyFile(frontier_file, files[j].path);
-    }
+  sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles(true);
+  if (logger_ptr) {
+    logger_ptr->info("flushed and locked down {} drivers", drivers.size());
   }
+  ParallelForFiles(files.size(), [&](size_t j) {
+    if (HEAD == "INIT") {
+      remove(files[j].path.c_str());
+      DiskManager::ResetDirtyPages(files[j].path, false);
+      return;
+    }
+    std::string frontier_file = files[j].path + ".frontier";
+    // then overwrite the frontier file
+    CopyFile(frontier_file, files[j].path);
+    DiskManager::ResetDirtyPages(files[j].path, true);
+  });
 }
 
 void SnapShotManager::SwitchToSnapShot(const std::string &snap_shot_ID) {
@@ -402,43 +1007,61 @@ void SnapShotManager::SwitchToSnapShot(const std::string &snap_shot_ID) {
   if (!has_connected) {
     throw std::runtime_error("SnapShotManager has not connected to the data drivers");
   }
+  WaitForPendingSnapShot();
   if (logger_ptr) {
     logger_ptr->info("Try switching to snapshot {}", snap_shot_ID);
   }
-  sjtu::vector<WayEntry> way = std::move(FindWay(snap_shot_ID));
-  if (logger_ptr) {
-    logger_ptr->info("Successfully found the way");
+  std::fstream fs(meta_file, std::ios::in);
+  std::string HEAD;
+  fs >> HEAD;
+  sjtu::vector<std::pair<std::string, std::string>> snapshot_relationship;
+  std::string cur, anc;
+  bool found = false;
+  while (fs >> cur >> anc) {
+    snapshot_relationship.push_back({cur, anc});
+    if (cur == snap_shot_ID || anc == snap_shot_ID) found = true;
   }
-  for (size_t i = 0; i < drivers.size(); i++) {
-    drivers[i]->Flush();
-    sjtu::vector<DataDriverBase::FileEntry> files = drivers[i]->ListFiles();
-    for (size_t j = 0; j < files.size(); j++) {
+  fs.close();
+  if (page_store != nullptr) {
+    if (!found && snap_shot_ID != "INIT") throw std::runtime_error("unable to find destination");
+    sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles();
+    ParallelForFiles(files.size(), [&](size_t j) {
+      std::string frontier_file = files[j].path + ".frontier";
+      PageManifest current, target;
+      ReadPageManifest(frontier_file + ".manifest", current);
+      if (snap_shot_ID != "INIT") ReadPageManifest(files[j].path + "." + snap_shot_ID + ".manifest", target);
+      remove((frontier_file + ".manifest").c_str());
+      size_t changed_pages = CheckOutPages(*page_store, frontier_file, current, target);
+      WritePageManifest(frontier_file + ".manifest", target);
+      if (files[j].disk_manager != nullptr) files[j].disk_manager->ResetDirtyPages(false);
+      if (logger_ptr) {
+        logger_ptr->info("{}: read {} of {} pages from the page store", frontier_file, changed_pages,
+                         target.pages.size());
+      }
+    });
+  } else {
+    std::string base;
+    sjtu::vector<WayEntry> way = std::move(FindShortestWay(snap_shot_ID, base));
+    if (logger_ptr) {
+      logger_ptr->info("Successfully found the way");
+    }
+    sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles();
+    ParallelForFiles(files.size(), [&](size_t j) {
       std::string frontier_file = files[j].path + ".frontier";
       if (logger_ptr) {
         logger_ptr->info("applying changes to {}", frontier_file);
       }
-      ApplyLongChange(frontier_file, frontier_file + ".tmp", way, files[j].path);
+      ApplyLongChange(base, frontier_file + ".tmp", way, files[j].path);
       remove(frontier_file.c_str());
       rename((frontier_file + ".tmp").c_str(), frontier_file.c_str());
+      // the file no longer matches the frontier, the dirty pages tell nothing until it is checked out
+      if (files[j].disk_manager != nullptr) files[j].disk_manager->ResetDirtyPages(false);
       if (logger_ptr) {
         logger_ptr->info("successfully applied changes to {}", frontier_file);
       }
-    }
-  }
-  std::fstream fs(meta_file, std::ios::in | std::ios::out);
-  std::string HEAD;
-  fs >> HEAD;
-  sjtu::vector<std::pair<std::string, std::string>> snapshot_relationship;
-  std::string cur, anc;
-  while (fs >> cur >> anc) {
-    snapshot_relationship.push_back({cur, anc});
-  }
-  fs.close();
-  fs.open(meta_file, std::ios::in | std::ios::out);
-  fs << snap_shot_ID << '\n';
-  for (size_t i = 0; i < snapshot_relationship.size(); i++) {
-    fs << snapshot_relationship[i].first << ' ' << snapshot_relationship[i].second << '\n';
+    });
   }
+  WriteMetaFile(snap_shot_ID, snapshot_relationship);
   if (logger_ptr) {
     logger_ptr->info("Successfully switched to snapshot {}", snap_shot_ID);
   }
@@ -451,6 +1074,7 @@ void SnapShotManager::RemoveSnapShot(const std::string &snap_shot_ID) {
   if (!has_connected) {
     throw std::runtime_error("SnapShotManager has not connected to the data drivers");
   }
+  WaitForPendingSnapShot();
   if (snap_shot_ID == "INIT") {
     throw std::runtime_error("Cannot remove INIT snapshot");
   }
@@ -476,27 +1100,43 @@ void SnapShotManager::RemoveSnapShot(const std::string &snap_shot_ID) {
     throw std::runtime_error("unable to find snapshot to remove");
   }
   fs.close();
+  if (page_store != nullptr) {
+    // a manifest does not depend on the other snapshots, so the sons are simply attached to the ancestor
+    if (son_list.find(snap_shot_ID) != son_list.end() && get_anc.find(snap_shot_ID) == get_anc.end()) {
+      throw std::runtime_error("the snapshot to remove is isolated from the tree, maybe the repository is corrupted");
+    }
+    sjtu::vector<std::pair<std::string, std::string>> remaining_relationship;
+    for (size_t i = 0; i < snapshot_relationship.size(); i++) {
+      if (snapshot_relationship[i].first == snap_shot_ID) continue;
+      if (snapshot_relationship[i].second == snap_shot_ID) {
+        remaining_relationship.push_back({snapshot_relationship[i].first, get_anc[snap_shot_ID]});
+      } else {
+        remaining_relationship.push_back(snapshot_relationship[i]);
+      }
+    }
+    WriteMetaFile(HEAD, remaining_relationship);
+    sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles();
+    for (size_t j = 0; j < files.size(); j++) remove((files[j].path + "." + snap_shot_ID + ".manifest").c_str());
+    CollectPageGarbage(files, remaining_relationship);
+    return;
+  }
   if (son_list.find(snap_shot_ID) == son_list.end()) {
     // simply remove it
     if (logger_ptr) {
       logger_ptr->info("Removing snapshot {}", snap_shot_ID);
       logger_ptr->info("since it has no son, we can remove it directly");
     }
-    for (size_t i = 0; i < drivers.size(); i++) {
-      drivers[i]->Flush();
-      sjtu::vector<DataDriverBase::FileEntry> files = drivers[i]->ListFiles();
-      for (size_t j = 0; j < files.size(); j++) {
-        remove((files[j].path + "." + snap_shot_ID + ".diff").c_str());
-        if (logger_ptr) {
-          logger_ptr->info("removed diff file {}", files[j].path + "." + snap_shot_ID + ".diff");
-        }
-      }
-    }
-    fs.open(meta_file, std::ios::in | std::ios::out);
-    fs << HEAD << '\n';
+    sjtu::vector<std::pair<std::string, std::string>> remaining_relationship;
     for (size_t i = 0; i < snapshot_relationship.size(); i++) {
-      if (snapshot_relationship[i].first != snap_shot_ID) {
-        fs << snapshot_relationship[i].first << ' ' << snapshot_relationship[i].second << '\n';
+      if (snapshot_relationship[i].first != snap_shot_ID) remaining_relationship.push_back(snapshot_relationship[i]);
+    }
+    WriteMetaFile(HEAD, remaining_relationship);
+    sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles();
+    for (size_t j = 0; j < files.size(); j++) {
+      remove((files[j].path + "." + snap_shot_ID + ".diff").c_str());
+      remove((files[j].path + "." + snap_shot_ID + ".key").c_str());
+      if (logger_ptr) {
+        logger_ptr->info("removed diff file {}", files[j].path + "." + snap_shot_ID + ".diff");
       }
     }
     return;
@@ -506,39 +1146,214 @@ void SnapShotManager::RemoveSnapShot(const std::string &snap_shot_ID) {
         "yor are trying to remove a snapshot that is isolated from the tree, maybe the snapshot repository is "
         "currupted");
   }
-  sjtu::vector<WayEntry> way = std::move(FindWay(snap_shot_ID));
+  std::string base;
+  sjtu::vector<WayEntry> way = std::move(FindShortestWay(snap_shot_ID, base));
   if (logger_ptr) {
     logger_ptr->info("Successfully found the way");
   }
+  // the sons inherit the keyframe, or their chains would grow longer than the interval
+  bool had_key_frame = HasKeyFrame(snap_shot_ID);
   anc = get_anc[snap_shot_ID];
   auto &sons = son_list[snap_shot_ID];
+  sjtu::vector<DataDriverBase::FileEntry> files = FlushAndListFiles();
   for (size_t i = 0; i < sons.size(); i++) {
     std::string cur_song = sons[i];
-    for (size_t j = 0; j < drivers.size(); j++) {
-      drivers[j]->Flush();
-      sjtu::vector<DataDriverBase::FileEntry> files = drivers[j]->ListFiles();
-      for (size_t k = 0; k < files.size(); k++) {
-        std::string frontier_file = files[k].path + ".frontier";
-        ApplyLongChange(frontier_file, frontier_file + ".tmp", way, files[k].path);
-        ApplyPatch(frontier_file + ".tmp", files[k].path + "." + cur_song + ".diff", frontier_file + ".tmp." + cur_song,
-                   false);
-        ApplyPatch(frontier_file + ".tmp", files[k].path + "." + snap_shot_ID + ".diff", frontier_file + ".tmp.anctmp",
-                   true);
-        remove((files[k].path + "." + cur_song + ".diff").c_str());
-        GenerateDiff(frontier_file + ".tmp.anctmp", frontier_file + ".tmp." + cur_song,
-                     files[k].path + "." + cur_song + ".diff");
-        remove((frontier_file + ".tmp").c_str());
-        remove((frontier_file + ".tmp." + cur_song).c_str());
-        remove((frontier_file + ".tmp.anctmp").c_str());
+    ParallelForFiles(files.size(), [&](size_t k) {
+      std::string frontier_file = files[k].path + ".frontier";
+      ApplyLongChange(base, frontier_file + ".tmp", way, files[k].path);
+      ApplyPatch(frontier_file + ".tmp", files[k].path + "." + cur_song + ".diff", frontier_file + ".tmp." + cur_song,
+                 false);
+      ApplyPatch(frontier_file + ".tmp", files[k].path + "." + snap_shot_ID + ".diff", frontier_file + ".tmp.anctmp",
+                 true);
+      std::string son_diff = files[k].path + "." + cur_song + ".diff";
+      GenerateDiff(frontier_file + ".tmp.anctmp", frontier_file + ".tmp." + cur_song, son_diff + ".tmp", compression);
+      rename((son_diff + ".tmp").c_str(), son_diff.c_str());
+      std::string son_key_frame = files[k].path + "." + cur_song + ".key";
+      if (had_key_frame && access(son_key_frame.c_str(), F_OK) != 0) {
+        WriteKeyFrame(frontier_file + ".tmp." + cur_song, son_key_frame, compression);
       }
-    }
+      remove((frontier_file + ".tmp").c_str());
+      remove((frontier_file + ".tmp." + cur_song).c_str());
+      remove((frontier_file + ".tmp.anctmp").c_str());
+    });
   }
-  fs.open(meta_file, std::ios::out);
-  fs << HEAD << '\n';
+  sjtu::vector<std::pair<std::string, std::string>> remaining_relationship;
   for (size_t i = 0; i < snapshot_relationship.size(); i++) {
     if (snapshot_relationship[i].first == snap_shot_ID) continue;
     if (snapshot_relationship[i].second == snap_shot_ID) continue;
-    fs << snapshot_relationship[i].first << ' ' << snapshot_relationship[i].second << '\n';
+    remaining_relationship.push_back(snapshot_relationship[i]);
+  }
+  for (size_t i = 0; i < sons.size(); i++) remaining_relationship.push_back({sons[i], anc});
+  WriteMetaFile(HEAD, remaining_relationship);
+  for (size_t j = 0; j < files.size(); j++) {
+    remove((files[j].path + "." + snap_shot_ID + ".diff").c_str());
+    remove((files[j].path + "." + snap_shot_ID + ".key").c_str());
+  }
+}
+bool SnapShotManager::ReadStageMeta(uint64_t &lsn, int &generation, uint64_t *log_offset) {
+  if (!has_set_stage_meta_file) {
+    throw std::runtime_error("SnapShotManager has not set the stage meta file");
+  }
+  return ReadStageMeta(stage_meta_file, lsn, generation, log_offset);
+}
+
+bool SnapShotManager::ReadStageMeta(const std::string &meta_file, uint64_t &lsn, int &generation,
+                                    uint64_t *log_offset) {
+  std::fstream fs(meta_file, std::ios::in);
+  if (!fs.is_open()) return false;
+  if (!(fs >> lsn >> generation)) throw std::runtime_error("the stage meta file is corrupted");
+  uint64_t offset;
+  // a meta file written before the offset was recorded has none
+  if (!(fs >> offset)) offset = 0;
+  if (log_offset != nullptr) *log_offset = offset;
+  return true;
+}
+
+bool SnapShotManager::HasStage(uint64_t &lsn, uint64_t *log_offset) {
+  WaitForPendingSnapShot();
+  int generation;
+  return ReadStageMeta(lsn, generation, log_offset);
+}
+
+void SnapShotManager::Stage(uint64_t lsn, uint64_t log_offset) {
+  if (!has_connected) {
+    throw std::runtime_error("SnapShotManager has not connected to the data drivers");
+  }
+  // a pending snapshot or stage holds the freeze of the same files
+  WaitForPendingSnapShot();
+  uint64_t old_lsn;
+  int generation = 0;
+  if (ReadStageMeta(old_lsn, generation)) generation ^= 1;
+  sjtu::vector<DataDriverBase::FileEntry> locked_files;
+  sjtu::vector<FrozenFile> frozen_files;
+  for (size_t i = 0; i < drivers.size(); i++) {
+    sjtu::vector<DataDriverBase::FileEntry> driver_files = drivers[i]->ListFiles();
+    for (size_t j = 0; j < driver_files.size(); j++) {
+      if (driver_files[j].disk_manager == nullptr) {
+        locked_files.push_back(driver_files[j]);
+        continue;
+      }
+      FrozenFile frozen;
+      frozen.path = driver_files[j].path;
+      frozen.disk_manager = driver_files[j].disk_manager;
+      frozen.frozen_size = frozen.disk_manager->FreezeForSnapShot();
+      frozen_files.push_back(frozen);
+    }
+  }
+  // the files without a disk manager cannot be frozen, so they are copied right away
+  ParallelForFiles(locked_files.size(), [&](size_t j) {
+    std::string stage_file = locked_files[j].path + ".stage" + std::to_string(generation);
+    CopyFile(locked_files[j].path, stage_file);
+    SyncFile(stage_file);
+  });
+  if (frozen_files.empty()) {
+    WriteStageMeta(lsn, generation, log_offset);
+    return;
+  }
+  pending_snap_shot = std::thread([this, lsn, generation, log_offset, frozen_files]() {
+    try {
+      ParallelForFiles(frozen_files.size(), [&](size_t i) {
+        const FrozenFile &frozen = frozen_files[i];
+        std::string stage_file = frozen.path + ".stage" + std::to_string(generation);
+        try {
+          CopyFrozenFile(frozen.disk_manager, frozen.frozen_size, stage_file);
+        } catch (...) {
+          frozen.disk_manager->ReleaseFrozen();
+          throw;
+        }
+        frozen.disk_manager->ReleaseFrozen();
+        SyncFile(stage_file);
+      });
+      WriteStageMeta(lsn, generation, log_offset);
+    } catch (...) {
+      pending_error = std::current_exception();
+      if (logger_ptr) logger_ptr->error("failed to stage the data files at LSN {}", lsn);
+    }
+  });
+}
+
+void SnapShotManager::WriteStageMeta(uint64_t lsn, int generation, uint64_t log_offset) {
+  // the stage becomes visible only when the new meta file replaces the old one
+  std::string tmp_file = stage_meta_file + ".tmp";
+  {
+    std::fstream fs(tmp_file, std::ios::out | std::ios::trunc);
+    fs << lsn << ' ' << generation << ' ' << log_offset << '\n';
+  }
+  SyncFile(tmp_file);
+  if (rename(tmp_file.c_str(), stage_meta_file.c_str()) != 0) {
+    throw std::runtime_error("rename failed");
+  }
+  size_t slash = stage_meta_file.find_last_of('/');
+  SyncFile(slash == std::string::npos ? "." : stage_meta_file.substr(0, slash + 1));
+  if (logger_ptr) {
+    logger_ptr->info("staged the data files at LSN {} into generation {}", lsn, generation);
+  }
+}
+
+uint64_t SnapShotManager::RestoreStage(uint64_t *log_offset) {
+  if (!has_connected) {
+    throw std::runtime_error("SnapShotManager has not connected to the data drivers");
+  }
+  WaitForPendingSnapShot();
+  uint64_t lsn;
+  int generation;
+  if (!ReadStageMeta(lsn, generation, log_offset)) {
+    throw std::runtime_error("nothing has been staged");
   }
-  for (size_t i = 0; i < sons.size(); i++) fs << sons[i] << ' ' << anc << '\n';
-}
\ No newline at end of file
+  sjtu::vector<DataDriverBase::FileEntry> files;
+  for (size_t i = 0; i < drivers.size(); i++) {
+    drivers[i]->LockDownForCheckOut();
+    sjtu::vector<DataDriverBase::FileEntry> driver_files = drivers[i]->ListFiles();
+    for (size_t j = 0; j < driver_files.size(); j++) files.push_back(driver_files[j]);
+  }
+  ParallelForFiles(files.size(), [&](size_t j) {
+    CopyFile(files[j].path + ".stage" + std::to_string(generation), files[j].path);
+    DiskManager::ResetDirtyPages(files[j].path, false);
+  });
+  if (logger_ptr) {
+    logger_ptr->info("restored the data files from generation {} at LSN {}", generation, lsn);
+  }
+  return lsn;
+}
+
+uint64_t SnapShotManager::RestoreStageFrom(const std::string &source_directory, uint64_t *log_offset) {
+  if (!has_connected) {
+    throw std::runtime_error("SnapShotManager has not connected to the data drivers");
+  }
+  if (!has_set_stage_meta_file) {
+    throw std::runtime_error("SnapShotManager has not set the stage meta file");
+  }
+  WaitForPendingSnapShot();
+  auto file_name = [](const std::string &path) { return path.substr(path.find_last_of('/') + 1); };
+  sjtu::vector<DataDriverBase::FileEntry> files;
+  for (size_t i = 0; i < drivers.size(); i++) {
+    drivers[i]->LockDownForCheckOut();
+    sjtu::vector<DataDriverBase::FileEntry> driver_files = drivers[i]->ListFiles();
+    for (size_t j = 0; j < driver_files.size(); j++) files.push_back(driver_files[j]);
+  }
+  std::string source_meta_file = source_directory + "/" + file_name(stage_meta_file);
+  const int kMaxAttempts = 16;
+  uint64_t lsn;
+  int generation;
+  for (int attempt = 1;; attempt++) {
+    if (!ReadStageMeta(source_meta_file, lsn, generation, log_offset)) {
+      throw std::runtime_error("nothing has been staged in " + source_directory);
+    }
+    ParallelForFiles(files.size(), [&](size_t j) {
+      CopyFile(source_directory + "/" + file_name(files[j].path) + ".stage" + std::to_string(generation),
+               files[j].path);
+    });
+    // a stage only overwrites the generation the meta file does not name, and then replaces the meta file with a
+    // larger LSN, so the generation copied is intact if the meta file is still the same
+    uint64_t lsn_after;
+    int generation_after;
+    if (ReadStageMeta(source_meta_file, lsn_after, generation_after) && lsn_after == lsn) break;
+    if (attempt == kMaxAttempts) throw std::runtime_error("the stage of " + source_directory + " keeps changing");
+  }
+  for (size_t j = 0; j < files.size(); j++) DiskManager::ResetDirtyPages(files[j].path, false);
+  if (logger_ptr) {
+    logger_ptr->info("restored the data files from generation {} of {} at LSN {}", generation, source_directory,
+                     lsn);
+  }
+  return lsn;
+}
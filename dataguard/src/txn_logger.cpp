@@ -1 +1,217 @@
-#include "dataguard/txn_logger.h"
\ No newline at end of file
+#include "dataguard/txn_logger.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+inline uint32_t FNV1a32(uint32_t hash, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+inline void PutLE(char *dst, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) dst[i] = (value >> (8 * i)) & 0xFF;
+}
+inline uint64_t GetLE(const char *src, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) value |= (uint64_t)(uint8_t)src[i] << (8 * i);
+  return value;
+}
+/**
+ * @brief the checksum of a frame, header is the first 13 bytes of the frame
+ */
+inline uint32_t FrameChecksum(const char *header, const char *payload, size_t payload_len) {
+  uint32_t hash = 2166136261u;
+  hash = FNV1a32(hash, header + 4, 9);  // type and LSN
+  return FNV1a32(hash, payload, payload_len);
+}
+}  // namespace
+
+size_t TxnLogger::ReadLog(const std::string &log_file_path, const std::function<void(const Record &)> &fn,
+                          size_t offset) {
+  FILE *f = fopen(log_file_path.c_str(), "rb");
+  if (f == nullptr) return offset;
+  size_t valid_size = offset;
+  if (fseek(f, offset, SEEK_SET) != 0) {
+    fclose(f);
+    return offset;
+  }
+  char header[kFrameHeaderSize];
+  Record record;
+  while (fread(header, 1, kFrameHeaderSize, f) == kFrameHeaderSize) {
+    size_t payload_len = GetLE(header, 4);
+    record.type = (RecordType)(uint8_t)header[4];
+    record.lsn = GetLE(header + 5, 8);
+    record.payload.resize(payload_len);
+    if (fread(record.payload.data(), 1, payload_len, f) != payload_len) break;
+    if (GetLE(header + 13, 4) != FrameChecksum(header, record.payload.data(), payload_len)) break;
+    if (record.type != kCommand && record.type != kCheckpoint) break;
+    fn(record);
+    valid_size += kFrameHeaderSize + payload_len;
+  }
+  fclose(f);
+  return valid_size;
+}
+
+TxnLogger::TxnLogger(std::string log_file_path_, Config config_, size_t scan_offset)
+    : log_file_path(std::move(log_file_path_)), config(config_) {
+  if (config.ring_capacity < 2 * kFrameHeaderSize) throw std::runtime_error("the ring of the txn log is too small");
+  size_t valid_size = ReadLog(
+      log_file_path, [this](const Record &record) { last_lsn = record.lsn; }, scan_offset);
+  if (scan_offset > 0 && valid_size == scan_offset) {
+    throw std::runtime_error("no record at offset " + std::to_string(scan_offset) + " of the txn log " +
+                             log_file_path);
+  }
+  durable_lsn = last_lsn;
+  fd = open(log_file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) throw std::runtime_error("failed to open the txn log " + log_file_path);
+  struct stat stat_buf;
+  if (fstat(fd, &stat_buf) == 0 && (size_t)stat_buf.st_size > valid_size) {
+    // cut off the torn tail, or the records appended later would be unreachable
+    if (ftruncate(fd, valid_size) != 0) {
+      close(fd);
+      throw std::runtime_error("failed to truncate the txn log " + log_file_path);
+    }
+    fdatasync(fd);
+  }
+  base_offset = valid_size;
+  ring.resize(config.ring_capacity);
+  writer = std::thread(&TxnLogger::WriterLoop, this);
+}
+
+TxnLogger::~TxnLogger() {
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    stop = true;
+  }
+  writer_cv.notify_all();
+  writer.join();
+  close(fd);
+  if (logger_ptr) {
+    logger_ptr->info("txn log closed: {} records, {} bytes in {} batches", stats.records, stats.bytes, stats.batches);
+  }
+}
+
+uint64_t TxnLogger::Append(RecordType type, std::string_view payload, uint64_t *record_offset) {
+  size_t frame_size = kFrameHeaderSize + payload.size();
+  if (frame_size > config.ring_capacity) throw std::runtime_error("the record is larger than the ring of the txn log");
+  std::unique_lock<std::mutex> lock(latch);
+  if (appended_bytes - written_bytes + frame_size > config.ring_capacity) {
+    writer_cv.notify_one();
+    space_cv.wait(lock, [&] {
+      return !write_error.empty() || appended_bytes - written_bytes + frame_size <= config.ring_capacity;
+    });
+  }
+  if (!write_error.empty()) throw std::runtime_error(write_error);
+  uint64_t lsn = ++last_lsn;
+  if (record_offset != nullptr) *record_offset = base_offset + appended_bytes;
+  char header[kFrameHeaderSize];
+  PutLE(header, payload.size(), 4);
+  header[4] = type;
+  PutLE(header + 5, lsn, 8);
+  PutLE(header + 13, FrameChecksum(header, payload.data(), payload.size()), 4);
+  auto copy_in = [this](const char *src, size_t len) {
+    size_t pos = appended_bytes % config.ring_capacity;
+    size_t first = std::min(len, config.ring_capacity - pos);
+    memcpy(ring.data() + pos, src, first);
+    memcpy(ring.data(), src + first, len - first);
+    appended_bytes += len;
+  };
+  copy_in(header, kFrameHeaderSize);
+  copy_in(payload.data(), payload.size());
+  stats.records++;
+  stats.bytes += frame_size;
+  if (config.synchronous_commit) {
+    WaitDurableLocked(lock, lsn);
+  } else {
+    lock.unlock();
+    writer_cv.notify_one();
+  }
+  return lsn;
+}
+
+void TxnLogger::WaitDurableLocked(std::unique_lock<std::mutex> &lock, uint64_t lsn) {
+  if (durable_lsn >= lsn) return;
+  synchronous_waiters++;
+  writer_cv.notify_one();
+  durable_cv.wait(lock, [&] { return durable_lsn >= lsn || !write_error.empty(); });
+  synchronous_waiters--;
+  if (durable_lsn < lsn) throw std::runtime_error(write_error);
+}
+
+void TxnLogger::WaitDurable(uint64_t lsn) {
+  std::unique_lock<std::mutex> lock(latch);
+  WaitDurableLocked(lock, lsn);
+}
+
+uint64_t TxnLogger::LastLSN() {
+  std::lock_guard<std::mutex> guard(latch);
+  return last_lsn;
+}
+
+uint64_t TxnLogger::DurableLSN() {
+  std::lock_guard<std::mutex> guard(latch);
+  return durable_lsn;
+}
+
+TxnLogger::Stats TxnLogger::GetStats() {
+  std::lock_guard<std::mutex> guard(latch);
+  return stats;
+}
+
+void TxnLogger::WriterLoop() {
+  std::unique_lock<std::mutex> lock(latch);
+  while (true) {
+    writer_cv.wait(lock, [this] { return stop || appended_bytes > written_bytes; });
+    if (appended_bytes == written_bytes) return;  // stopping with nothing left
+    if (!stop && synchronous_waiters == 0 && config.group_commit_window.count() > 0) {
+      // let the batch grow, unless the ring is half full or someone is waiting for it
+      writer_cv.wait_for(lock, config.group_commit_window, [this] {
+        return stop || synchronous_waiters > 0 || (appended_bytes - written_bytes) * 2 >= config.ring_capacity;
+      });
+    }
+    uint64_t batch_begin = written_bytes, batch_end = appended_bytes, batch_lsn = last_lsn;
+    lock.unlock();
+    // [batch_begin, batch_end) is not touched by Append until written_bytes is advanced
+    size_t pos = batch_begin % config.ring_capacity, len = batch_end - batch_begin;
+    size_t first = std::min(len, config.ring_capacity - pos);
+    bool ok = true;
+    auto write_all = [this, &ok](const char *src, size_t count) {
+      while (ok && count > 0) {
+        ssize_t res = write(fd, src, count);
+        if (res < 0) {
+          ok = false;
+          break;
+        }
+        src += res;
+        count -= res;
+      }
+    };
+    write_all(ring.data() + pos, first);
+    write_all(ring.data(), len - first);
+    if (ok && fdatasync(fd) != 0) ok = false;
+    if (!ok) {
+      std::string error = "failed to write the txn log " + log_file_path + ": " + strerror(errno);
+      if (logger_ptr) logger_ptr->error("{}", error);
+      // the file may end with a torn frame now, anything written after it would be unreachable
+      lock.lock();
+      write_error = std::move(error);
+      space_cv.notify_all();
+      durable_cv.notify_all();
+      return;
+    }
+    lock.lock();
+    written_bytes = batch_end;
+    durable_lsn = batch_lsn;
+    stats.batches++;
+    space_cv.notify_all();
+    durable_cv.notify_all();
+  }
+}
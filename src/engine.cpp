@@ -1,4 +1,5 @@
 #include "engine.h"
+#include <chrono>
 #include <cstring>
 #include <sstream>
 #include <stdexcept>
@@ -46,28 +47,28 @@ std::string TicketSystemEngine::Execute(const std::string &command) {
   switch (command_name_hash) {
     case add_user_hash:
       LOG->debug("match add_user");
-      return std::move(AddUser(command));
+      return Logged(LoggedCommand::kAddUser, command, AddUser(command));
     case login_hash:
       LOG->debug("match login");
-      return std::move(LoginUser(command));
+      return Logged(LoggedCommand::kLogin, command, LoginUser(command));
     case logout_hash:
       LOG->debug("match logout");
-      return std::move(LogoutUser(command));
+      return Logged(LoggedCommand::kLogout, command, LogoutUser(command));
     case query_profile_hash:
       LOG->debug("match query_profile");
       return std::move(QueryProfile(command));
     case modify_profile_hash:
       LOG->debug("match modify_profile");
-      return std::move(ModifyProfile(command));
+      return Logged(LoggedCommand::kModifyProfile, command, ModifyProfile(command));
     case add_train_hash:
       LOG->debug("match add_train");
-      return std::move(AddTrain(command));
+      return Logged(LoggedCommand::kAddTrain, command, AddTrain(command));
     case delete_train_hash:
       LOG->debug("match delete_train");
-      return std::move(DeleteTrain(command));
+      return Logged(LoggedCommand::kDeleteTrain, command, DeleteTrain(command));
     case release_train_hash:
       LOG->debug("match release_train");
-      return std::move(ReleaseTrain(command));
+      return Logged(LoggedCommand::kReleaseTrain, command, ReleaseTrain(command));
     case query_train_hash:
       LOG->debug("match query_train");
       return std::move(QueryTrain(command));
@@ -79,13 +80,13 @@ std::string TicketSystemEngine::Execute(const std::string &command) {
       return std::move(QueryTransfer(command));
     case buy_ticket_hash:
       LOG->debug("match buy_ticket");
-      return std::move(BuyTicket(command));
+      return Logged(LoggedCommand::kBuyTicket, command, BuyTicket(command));
     case query_order_hash:
       LOG->debug("match query_order");
       return std::move(QueryOrder(command));
     case refund_ticket_hash:
       LOG->debug("match refund_ticket_hash");
-      return std::move(RefundTicket(command));
+      return Logged(LoggedCommand::kRefundTicket, command, RefundTicket(command));
     case clean_hash:
       LOG->debug("match clean");
       return std::move(Clean());
@@ -97,6 +98,26 @@ std::string TicketSystemEngine::Execute(const std::string &command) {
   throw std::invalid_argument("Invalid command.");
 }
 
+bool TicketSystemEngine::IsReadOnlyCommand(const std::string &command) {
+  return ClassifyCommand(command) != CommandClass::kWrite;
+}
+
+TicketSystemEngine::CommandClass TicketSystemEngine::ClassifyCommand(const std::string &command) {
+  char command_name[20];
+  if (sscanf(command.c_str(), "%*s %19s", command_name) != 1) return CommandClass::kWrite;
+  switch (SplitMix64Hash(std::string_view(command_name))) {
+    case query_profile_hash:
+    case query_train_hash:
+      return CommandClass::kPoint;
+    case query_ticket_hash:
+    case query_order_hash:
+      return CommandClass::kScan;
+    case query_transfer_hash:
+      return CommandClass::kTransfer;
+  }
+  return CommandClass::kWrite;
+}
+
 std::string TicketSystemEngine::Clean() { throw std::runtime_error("Command clean is not implemented"); }
 
 std::string TicketSystemEngine::Exit(const std::string &command) {
@@ -109,4 +130,215 @@ std::string TicketSystemEngine::Exit(const std::string &command) {
   return response_stream.str();
 }
 
-void TicketSystemEngine::PrepareExit() { LOG->info("Preparing exit"); }
\ No newline at end of file
+void TicketSystemEngine::PrepareExit() {
+  LOG->info("Preparing exit");
+  const TicketQueryCache::Stats &stats = ticket_query_cache.GetStats();
+  LOG->info("ticket query cache: {} hits, {} misses, {} evictions, {} invalidations, {} entries with {} candidates",
+            stats.hits, stats.misses, stats.evictions, stats.invalidations, ticket_query_cache.EntryCount(),
+            ticket_query_cache.CandidateCount());
+  TrainRouteCache::Stats route_stats = train_route_cache.GetStats();
+  LOG->info("train route cache: {} hits, {} misses, {} evictions, {} trains", route_stats.hits, route_stats.misses,
+            route_stats.evictions, train_route_cache.size());
+#ifdef ENABLE_ADVANCED_FEATURE
+  if (txn_logger) {
+    TxnLogger::Stats txn_log_stats = txn_logger->GetStats();
+    LOG->info("txn log: {} records, {} bytes, {} group commits", txn_log_stats.records, txn_log_stats.bytes,
+              txn_log_stats.batches);
+  }
+#endif
+}
+sjtu::vector<DataDriverBase *> TicketSystemEngine::DataDrivers() {
+  sjtu::vector<DataDriverBase *> drivers;
+  drivers.push_back(&user_data);
+  drivers.push_back(&station_dictionary);
+  drivers.push_back(&train_stations_storage);
+  drivers.push_back(&ticket_price_data_storage);
+  drivers.push_back(&core_train_data_storage);
+  drivers.push_back(&seats_data_storage);
+  drivers.push_back(&stop_register);
+  drivers.push_back(&transaction_manager);
+#ifdef ENABLE_STATION_PAIR_INDEX
+  drivers.push_back(&station_pair_index);
+#endif
+  return drivers;
+}
+
+std::string TicketSystemEngine::Logged(LoggedCommand kind, const std::string &command, std::string response) {
+#ifdef ENABLE_ADVANCED_FEATURE
+  if (!txn_logger || replaying) return response;
+  // the failed commands change nothing, so they are not recorded
+  size_t result_pos = response.find("] ");
+  if (result_pos == std::string::npos || response.compare(result_pos + 2, std::string::npos, "-1") == 0)
+    return response;
+  command_id_t timestamp = 0;
+  sscanf(command.c_str(), "[%llu]", &timestamp);
+  // skip the timestamp and the command name, the name is replaced by kind
+  size_t arguments_pos = command.find(' ');
+  if (arguments_pos != std::string::npos) arguments_pos = command.find(' ', arguments_pos + 1);
+  arguments_pos = arguments_pos == std::string::npos ? command.size() : arguments_pos + 1;
+  std::string payload;
+  payload.reserve(9 + command.size() - arguments_pos);
+  payload.push_back((char)kind);
+  for (int i = 0; i < 8; i++) payload.push_back((char)((timestamp >> (8 * i)) & 0xFF));
+  payload.append(command, arguments_pos, std::string::npos);
+  txn_logger->Append(TxnLogger::kCommand, payload);
+  if (checkpoint_interval != 0 && ++logged_since_checkpoint >= checkpoint_interval) Checkpoint();
+#endif
+  return response;
+}
+
+#ifdef ENABLE_ADVANCED_FEATURE
+// indexed by LoggedCommand
+const char *const logged_command_names[] = {
+    "", "add_user", "login", "logout", "modify_profile", "add_train", "delete_train", "release_train", "buy_ticket",
+    "refund_ticket"};
+
+std::string TicketSystemEngine::DecodeLoggedCommand(const std::string &payload) {
+  if (payload.size() < 9 || payload[0] <= 0 || payload[0] > (char)LoggedCommand::kRefundTicket)
+    throw std::runtime_error("invalid command record in the txn log");
+  command_id_t timestamp = 0;
+  for (int i = 0; i < 8; i++) timestamp |= (command_id_t)(uint8_t)payload[1 + i] << (8 * i);
+  std::string command = "[" + std::to_string(timestamp) + "] " + logged_command_names[(int)payload[0]];
+  if (payload.size() > 9) {
+    command.push_back(' ');
+    command.append(payload, 9, std::string::npos);
+  }
+  return command;
+}
+
+void TicketSystemEngine::ConnectSnapshotManager() {
+  if (snapshot_manager_connected) return;
+  snapshot_manager.Connect(DataDrivers());
+  snapshot_manager.SetStageMetaFile(data_directory + "/stage.meta");
+  snapshot_manager.SetLogger(logger_ptr);
+  snapshot_manager_connected = true;
+}
+
+void TicketSystemEngine::EnableTxnLog(const TxnLogger::Config &config, uint64_t checkpoint_interval_) {
+  ConnectSnapshotManager();
+  uint64_t staged_lsn = 0, log_offset = 0;
+  bool has_stage = snapshot_manager.HasStage(staged_lsn, &log_offset);
+  // the log before the staged checkpoint is never needed again, so it is not scanned
+  txn_logger = std::make_unique<TxnLogger>(data_directory + "/txn.log", config, log_offset);
+  txn_logger->SetLogger(logger_ptr);
+  checkpoint_interval = checkpoint_interval_;
+  logged_since_checkpoint = 0;
+  LOG->info("txn log enabled, last LSN {}, group commit window {}us, synchronous commit {}, checkpoint interval {}",
+            txn_logger->LastLSN(), config.group_commit_window.count(), config.synchronous_commit,
+            checkpoint_interval);
+  if (has_stage && staged_lsn == txn_logger->LastLSN()) return;
+  if (!has_stage && txn_logger->LastLSN() == 0) {
+    // the first time the log is enabled, the current files are the base of the recovery
+    Checkpoint();
+    return;
+  }
+  // a clean shutdown always ends with a staged checkpoint
+  txn_logger.reset();
+  throw std::runtime_error("the data directory was not shut down cleanly, run fsck first");
+}
+
+void TicketSystemEngine::Checkpoint() {
+  online_users.ForEachDirtyOrderCount([this](hash_t user_ID_hash, int32_t order_count) {
+    transaction_manager.SetOrderCount(user_ID_hash, order_count);
+  });
+  sjtu::vector<DataDriverBase *> drivers = DataDrivers();
+  for (size_t i = 0; i < drivers.size(); i++) drivers[i]->Flush();
+  std::string payload;
+  uint32_t session_count = online_users.size();
+  payload.reserve(4 + session_count * 9);
+  for (int i = 0; i < 4; i++) payload.push_back((char)((session_count >> (8 * i)) & 0xFF));
+  online_users.ForEachSession([&payload](hash_t user_ID_hash, uint8_t privilege) {
+    for (int i = 0; i < 8; i++) payload.push_back((char)((user_ID_hash >> (8 * i)) & 0xFF));
+    payload.push_back((char)privilege);
+  });
+  uint64_t log_offset;
+  uint64_t lsn = txn_logger->Append(TxnLogger::kCheckpoint, payload, &log_offset);
+  txn_logger->WaitDurable(lsn);
+  // staged only after the record is durable, a crash in between replays from the previous stage through this record
+  snapshot_manager.Stage(lsn, log_offset);
+  logged_since_checkpoint = 0;
+  LOG->info("checkpoint at LSN {} with {} online users", lsn, session_count);
+}
+
+void TicketSystemEngine::WaitForCheckpoint() { snapshot_manager.WaitForPendingSnapShot(); }
+
+void TicketSystemEngine::RestoreSessions(const std::string &payload) {
+  if (payload.size() < 4) throw std::runtime_error("invalid checkpoint record in the txn log");
+  uint32_t session_count = 0;
+  for (int i = 0; i < 4; i++) session_count |= (uint32_t)(uint8_t)payload[i] << (8 * i);
+  if (payload.size() < 4 + 9 * (uint64_t)session_count)
+    throw std::runtime_error("invalid checkpoint record in the txn log");
+  // Logout drops the dirty order counts, they are written back as Checkpoint does
+  online_users.ForEachDirtyOrderCount([this](hash_t user_ID_hash, int32_t order_count) {
+    transaction_manager.SetOrderCount(user_ID_hash, order_count);
+  });
+  sjtu::vector<hash_t> users;
+  online_users.ForEachSession([&users](hash_t user_ID_hash, uint8_t) { users.push_back(user_ID_hash); });
+  for (size_t i = 0; i < users.size(); i++) online_users.Logout(users[i]);
+  FullUserData profile;
+  for (uint32_t k = 0; k < session_count; k++) {
+    const char *entry = payload.data() + 4 + k * 9;
+    hash_t user_ID_hash = 0;
+    for (int i = 0; i < 8; i++) user_ID_hash |= (hash_t)(uint8_t)entry[i] << (8 * i);
+    user_data.Get(user_ID_hash, profile);
+    online_users.Login(user_ID_hash, profile, (uint8_t)entry[8]);
+  }
+  online_users.Reclaim();
+}
+
+uint64_t TicketSystemEngine::RestoreCheckpoint(uint64_t *log_offset) {
+  ConnectSnapshotManager();
+  return snapshot_manager.RestoreStage(log_offset);
+}
+
+uint64_t TicketSystemEngine::RestoreCheckpointFrom(const std::string &primary_directory, uint64_t *log_offset) {
+  ConnectSnapshotManager();
+  return snapshot_manager.RestoreStageFrom(primary_directory, log_offset);
+}
+
+void TicketSystemEngine::ApplyLogRecord(const TxnLogger::Record &record) {
+  if (record.type == TxnLogger::kCheckpoint) {
+    RestoreSessions(record.payload);
+    return;
+  }
+  Execute(DecodeLoggedCommand(record.payload));
+}
+
+TicketSystemEngine::ReplayStats TicketSystemEngine::ReplayTxnLog(uint64_t checkpoint_lsn,
+                                                                 const TxnLogger::Config &config, uint64_t log_offset) {
+  ConnectSnapshotManager();
+  std::string log_file_path = data_directory + "/txn.log";
+  // opening the logger cuts off the torn tail left by the crash
+  txn_logger = std::make_unique<TxnLogger>(log_file_path, config, log_offset);
+  txn_logger->SetLogger(logger_ptr);
+  checkpoint_interval = 0;
+  ReplayStats stats;
+  std::shared_ptr<spdlog::logger> saved_logger = std::move(logger_ptr);
+  replaying = true;
+  auto start = std::chrono::steady_clock::now();
+  try {
+    bool first = true;
+    TxnLogger::ReadLog(
+        log_file_path,
+        [&](const TxnLogger::Record &record) {
+          if (first && log_offset > 0 && (record.type != TxnLogger::kCheckpoint || record.lsn != checkpoint_lsn))
+            throw std::runtime_error("the txn log does not have the checkpoint at LSN " +
+                                     std::to_string(checkpoint_lsn) + " where the stage says");
+          first = false;
+          if (record.lsn < checkpoint_lsn) return;
+          ApplyLogRecord(record);
+          if (record.type == TxnLogger::kCommand) stats.commands++;
+        },
+        log_offset);
+  } catch (...) {
+    replaying = false;
+    logger_ptr = std::move(saved_logger);
+    throw;
+  }
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  replaying = false;
+  logger_ptr = std::move(saved_logger);
+  LOG->info("replayed {} commands after LSN {} in {:.3f}s", stats.commands, checkpoint_lsn, stats.seconds);
+  return stats;
+}
+#endif
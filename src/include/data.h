@@ -1,6 +1,7 @@
 #ifndef DATA_H
 #define DATA_H
 #include <cstdint>
+#include "seats_inventory.hpp"
 #include "storage/driver.h"
 #include "utils.h"
 struct FullUserData {
@@ -11,10 +12,12 @@ struct FullUserData {
   uint8_t privilege;
 };
 
-struct StationNameData {
-  char name[100][40];
+/**
+ * @brief the stations of a train, as ids of the StationDictionary
+ */
+struct TrainStationsData {
+  uint32_t station_id[100];
 };
-static_assert(sizeof(StationNameData) == 4000);
 struct TicketPriceData {
   char trainID[21];
   uint32_t price[99];
@@ -39,8 +42,9 @@ struct CoreTrainData {
   uint16_t stopoverTime[100];
 };
 
-struct SeatsData {
-  uint32_t seat[99];
-  uint32_t max_seats;
-};
+#ifdef ENABLE_BLOCKED_SEATS_INVENTORY
+typedef BlockedSeatsInventory SeatsData;
+#else
+typedef FlatSeatsInventory SeatsData;
+#endif
 #endif
\ No newline at end of file
@@ -1,15 +1,25 @@
 #ifndef ENGINE_H
 #define ENGINE_H
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #ifdef ENABLE_ADVANCED_FEATURE
 #include "dataguard/dataguard.h"
 #include "dataguard/snapshot.h"
+#include "storage/thread_pool.hpp"
 #endif
 #include <vector>
 #include "data.h"
+#ifdef ENABLE_STATION_PAIR_INDEX
+#include "station_pair_index.hpp"
+#endif
+#include "session_table.hpp"
+#include "station_dictionary.hpp"
 #include "stop_register.hpp"
 #include "storage/disk_map.hpp"
+#include "ticket_query_cache.hpp"
+#include "train_route_cache.hpp"
 #include "transaction_mainenance.hpp"
 #include "utils.h"
 class TicketSystemEngine {
@@ -18,7 +28,7 @@ class TicketSystemEngine {
 #endif
   bool its_time_to_exit = false;
   std::string data_directory;
-  sjtu::map<hash_t, uint8_t> online_users;
+  SessionTable online_users;
 
   /**
    * @brief user data system
@@ -29,7 +39,8 @@ class TicketSystemEngine {
   /**
    * @brief train data system
    */
-  DiskMap<hash_t, StationNameData> station_name_data_storage;
+  StationDictionary station_dictionary;
+  DiskMap<hash_t, TrainStationsData> train_stations_storage;
   DiskMap<hash_t, TicketPriceData> ticket_price_data_storage;
   DiskMap<hash_t, CoreTrainData> core_train_data_storage;
   typedef std::pair<hash_t, uint8_t> seats_index_t;
@@ -49,14 +60,107 @@ class TicketSystemEngine {
    */
   StopRegister stop_register;
   TransactionManager transaction_manager;
+#ifdef ENABLE_STATION_PAIR_INDEX
+  StationPairIndex station_pair_index;
+  void RebuildStationPairIndex();
+#endif
+
+  /**
+   * @brief in-memory caches
+   * @details ticket_query_cache keeps the static part of query_ticket results, it is invalidated in ReleaseTrain.
+   * train_route_cache keeps the prefix-summed routes of released trains, filled in ReleaseTrain and on demand.
+   */
+  TicketQueryCache ticket_query_cache;
+  std::mutex ticket_query_cache_latch;  // the read-only commands may run concurrently, see IsReadOnlyCommand
+  TrainRouteCache train_route_cache;
+  /**
+   * @brief build the route of a train from the disk, and cache it if the train is released
+   * @throws std::runtime_error if the train does not exist
+   */
+  void LoadTrainRoute(hash_t train_ID_hash, TrainRouteInfo &route);
+  /**
+   * @brief copy the route of a train into route, from train_route_cache if possible
+   */
+  inline void FetchTrainRoute(hash_t train_ID_hash, TrainRouteInfo &route) {
+    if (!train_route_cache.Fetch(train_ID_hash, route)) LoadTrainRoute(train_ID_hash, route);
+  }
+  /**
+   * @brief call fn(const TrainRouteView &) on the route of a train, without copying it on a cache hit
+   */
+  template <typename Fn>
+  void VisitTrainRoute(hash_t train_ID_hash, Fn &&fn) {
+    if (train_route_cache.Visit(train_ID_hash, fn)) return;
+    TrainRouteInfo route;
+    LoadTrainRoute(train_ID_hash, route);
+    fn(route.View());
+  }
+#ifdef ENABLE_ADVANCED_FEATURE
+  /**
+   * @brief worker threads for read-only parallel work inside a single query, such as query_transfer
+   */
+  WorkStealingThreadPool query_thread_pool{std::min(std::max(std::thread::hardware_concurrency(), 1u), 16u)};
+#endif
+
+  /**
+   * @brief the number of orders of an online user
+   * @details It is cached in online_users after the first read, buy_ticket then updates the cached count only, and
+   * the count is written back on logout and when the engine is destroyed.
+   */
+  inline uint32_t UserOrderCount(hash_t user_ID_hash) {
+    int32_t order_count = online_users.OrderCount(user_ID_hash);
+    if (order_count == SessionTable::kUnknownOrderCount) {
+      order_count = transaction_manager.OrderCount(user_ID_hash);
+      online_users.CacheOrderCount(user_ID_hash, order_count);
+    }
+    return order_count;
+  }
 
   void PrepareExit();
-  void CheckTransfer(hash_t train1_ID_hash, hash_t train2_ID_hash, const std::string &from_station,
-                     const std::string &to_station, int date, bool &has_solution, std::string &res_train1_id,
-                     std::string &res_train2_id, int &res_train1_leaving_time_stamp,
-                     int &res_train1_arriving_time_stamp, int &res_train2_leaving_time_stamp,
-                     int &res_train2_arriving_time_stamp, int &res_train1_price, int &res_train1_seat,
-                     int &res_train2_price, int &res_train2_seat, std::string &res_transfer_station_name, bool sort_by_time);
+  /**
+   * @brief all the data drivers of the engine, for flushing and snapshots
+   */
+  sjtu::vector<DataDriverBase *> DataDrivers();
+
+ public:
+  /**
+   * @brief the mutating commands recorded in the txn log, the value is the first byte of the payload
+   * @details A command record is [command: u8][timestamp: u64, little endian][the arguments as they are], a checkpoint
+   * record is [session count: u32] followed by [user hash: u64][privilege: u8] for every online user.
+   */
+  enum class LoggedCommand : uint8_t {
+    kAddUser = 1,
+    kLogin = 2,
+    kLogout = 3,
+    kModifyProfile = 4,
+    kAddTrain = 5,
+    kDeleteTrain = 6,
+    kReleaseTrain = 7,
+    kBuyTicket = 8,
+    kRefundTicket = 9
+  };
+
+ private:
+#ifdef ENABLE_ADVANCED_FEATURE
+  std::unique_ptr<TxnLogger> txn_logger;
+  uint64_t checkpoint_interval = 0;
+  uint64_t logged_since_checkpoint = 0;
+  bool replaying = false;  // the replayed commands are already in the log
+  bool snapshot_manager_connected = false;
+  void ConnectSnapshotManager();
+  /**
+   * @brief replace the online users with the ones recorded in a checkpoint payload
+   */
+  void RestoreSessions(const std::string &payload);
+  /**
+   * @brief turn a command record back into the command line it was recorded from
+   */
+  static std::string DecodeLoggedCommand(const std::string &payload);
+#endif
+  /**
+   * @brief record a command in the txn log if it succeeded and the log is enabled
+   * @return response, unchanged
+   */
+  std::string Logged(LoggedCommand kind, const std::string &command, std::string response);
 
  public:
   const bool *its_time_to_exit_ptr = &its_time_to_exit;
@@ -64,8 +168,11 @@ class TicketSystemEngine {
       : data_directory(data_directory),
         user_data("user_data.idx", data_directory + "/user_data.idx", "user_data.val",
                   data_directory + "/user_data.val"),
-        station_name_data_storage("station_name.idx", data_directory + "/station_name.idx", "station_name.val",
-                                  data_directory + "/station_name.val"),
+        station_dictionary("station_dict.idx", data_directory + "/station_dict.idx", "station_dict_names.idx",
+                           data_directory + "/station_dict_names.idx", "station_dict_names.val",
+                           data_directory + "/station_dict_names.val"),
+        train_stations_storage("train_stations.idx", data_directory + "/train_stations.idx", "train_stations.val",
+                               data_directory + "/train_stations.val"),
         ticket_price_data_storage("ticket_price.idx", data_directory + "/ticket_price.idx", "ticket_price.val",
                                   data_directory + "/ticket_price.val"),
         core_train_data_storage("core_train.idx", data_directory + "/core_train.idx", "core_train.val",
@@ -73,8 +180,111 @@ class TicketSystemEngine {
         seats_data_storage("seats.idx", data_directory + "/seats.idx", "seats.val", data_directory + "/seats.val"),
         stop_register("stop_register.idx", data_directory + "/stop_register.idx"),
         transaction_manager("txn.data", data_directory + "/txn.data", "queue.idx", data_directory + "/queue.idx",
-                            "order.idx", data_directory + "/order.idx") {}
+                            "order.idx", data_directory + "/order.idx")
+#ifdef ENABLE_STATION_PAIR_INDEX
+        ,
+        station_pair_index("station_pair.idx", data_directory + "/station_pair.idx")
+#endif
+  {
+#ifdef ENABLE_STATION_PAIR_INDEX
+    if (station_pair_index.size() == 0 && stop_register.size() != 0) RebuildStationPairIndex();
+#endif
+  }
+  inline ~TicketSystemEngine() {
+    online_users.ForEachDirtyOrderCount([this](hash_t user_ID_hash, int32_t order_count) {
+      transaction_manager.SetOrderCount(user_ID_hash, order_count);
+    });
+#ifdef ENABLE_ADVANCED_FEATURE
+    if (txn_logger) {
+      // the sessions end with the process, so a clean shutdown ends with a checkpoint without online users, and no
+      // command needs to be replayed after it
+      sjtu::vector<hash_t> users;
+      online_users.ForEachSession([&users](hash_t user_ID_hash, uint8_t) { users.push_back(user_ID_hash); });
+      for (size_t i = 0; i < users.size(); i++) online_users.Logout(users[i]);
+      online_users.Reclaim();
+      try {
+        Checkpoint();
+      } catch (const std::exception &e) {
+        // nothing is staged then, the next start asks for fsck
+        LOG->error("failed to take the checkpoint on shutdown: {}", e.what());
+      }
+      txn_logger.reset();
+    }
+    try {
+      // the background copies of the stage read the data files, which are closed after this
+      WaitForCheckpoint();
+    } catch (const std::exception &e) {
+      LOG->error("failed to stage the data files on shutdown: {}", e.what());
+    }
+#endif
+  }
+#ifdef ENABLE_ADVANCED_FEATURE
+  /**
+   * @brief start recording the successful mutating commands in <data directory>/txn.log
+   * @param checkpoint_interval take a checkpoint after every this many commands, 0 to only take one on shutdown
+   */
+  void EnableTxnLog(const TxnLogger::Config &config, uint64_t checkpoint_interval);
+  /**
+   * @brief write the cached state back, flush all the data files, record a checkpoint with the online users and stage
+   * the data files for recovery
+   * @details The data files are frozen and copied into the stage area in the background (see SnapShotManager::Stage),
+   * so the caller, the writer of the server included, only waits for the flush. The copy takes the time of reading
+   * and writing the whole data, and the next checkpoint waits for it if it is not done by then.
+   */
+  void Checkpoint();
+  /**
+   * @brief wait until the data files of the last checkpoint are staged
+   */
+  void WaitForCheckpoint();
+  struct ReplayStats {
+    uint64_t commands = 0;
+    double seconds = 0;
+  };
+  /**
+   * @brief overwrite the data files with the ones staged at the last checkpoint
+   * @warning the engine is unusable afterwards, a new one must be constructed to replay the log
+   * @return the LSN of the checkpoint, and the offset of its record in the txn log in log_offset if asked
+   */
+  uint64_t RestoreCheckpoint(uint64_t *log_offset = nullptr);
+  /**
+   * @brief replay the commands logged after the checkpoint checkpoint_lsn through Execute
+   * @details It must be called on a fresh engine over the restored data files. The commands are not logged again and
+   * no checkpoint is taken while replaying, and the program log is muted. The txn log stays enabled with config
+   * afterwards, so the engine ends with a checkpoint when destroyed.
+   * @param log_offset where the record of the checkpoint starts in the txn log, as returned by RestoreCheckpoint, the
+   * log before it is not read
+   */
+  ReplayStats ReplayTxnLog(uint64_t checkpoint_lsn, const TxnLogger::Config &config, uint64_t log_offset = 0);
+  /**
+   * @brief overwrite the data files with the checkpoint staged in the data directory of a primary, to start a replica
+   * @details The directory of the primary is only read, it may keep running meanwhile.
+   * @warning the engine is unusable afterwards, as after RestoreCheckpoint
+   * @return the LSN of the checkpoint, and the offset of its record in the txn log of the primary in log_offset if
+   * asked
+   */
+  uint64_t RestoreCheckpointFrom(const std::string &primary_directory, uint64_t *log_offset = nullptr);
+  /**
+   * @brief apply a record of a txn log as recovery does
+   * @warning the command would be logged again if the txn log is enabled and the engine is not replaying
+   */
+  void ApplyLogRecord(const TxnLogger::Record &record);
+#endif
   std::string Execute(const std::string &command);
+  /**
+   * @brief whether a command only reads the data
+   * @details The read-only commands may be executed concurrently with each other, but not with any other command.
+   * They still fill the caches, which are latched or atomic for that reason.
+   */
+  static bool IsReadOnlyCommand(const std::string &command);
+  /**
+   * @brief the classes of commands, by their cost and by whether they change data, the server schedules them apart
+   */
+  enum class CommandClass : uint8_t { kPoint = 0, kScan = 1, kTransfer = 2, kWrite = 3 };
+  const static size_t kCommandClassCount = 4;
+  /**
+   * @return the class of a command, kWrite for the commands that are not read-only, unknown ones included
+   */
+  static CommandClass ClassifyCommand(const std::string &command);
 
   // User system
   std::string AddUser(const std::string &command);
@@ -0,0 +1,71 @@
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+/**
+ * @brief An unbounded lock-free queue with many producers and a single consumer.
+ * @details It is the intrusive node queue of Vyukov: a producer swaps itself in as the new head with one atomic
+ * exchange and then links the previous head to it, the consumer follows the links from a stub node. Push never blocks
+ * or spins. Between the exchange and the link of a push the consumer may see the queue as empty, so the consumer
+ * should not rely on TryPop alone to wait for an element, WaitPop sleeps on a counter bumped after every push instead.
+ *
+ * Only one thread may call TryPop and WaitPop.
+ */
+template <typename T>
+class MpscQueue {
+  struct Node {
+    std::atomic<Node *> next{nullptr};
+    T value;
+  };
+  std::atomic<Node *> head;  // the last pushed node, swapped by the producers
+  Node *tail;                // the node before the first element, owned by the consumer
+  std::atomic<uint32_t> push_count{0};
+
+ public:
+  inline MpscQueue() {
+    tail = new Node;
+    head.store(tail, std::memory_order_relaxed);
+  }
+  inline ~MpscQueue() {
+    while (tail != nullptr) {
+      Node *next = tail->next.load(std::memory_order_relaxed);
+      delete tail;
+      tail = next;
+    }
+  }
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  inline void Push(T value) {
+    Node *node = new Node;
+    node->value = std::move(value);
+    Node *prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+    push_count.fetch_add(1, std::memory_order_release);
+    push_count.notify_one();
+  }
+  /**
+   * @return false if no element is ready
+   */
+  inline bool TryPop(T &value) {
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr) return false;
+    value = std::move(next->value);
+    delete tail;
+    tail = next;
+    return true;
+  }
+  /**
+   * @brief pop an element, sleeping until one is pushed if the queue is empty
+   */
+  inline void WaitPop(T &value) {
+    while (true) {
+      uint32_t seen = push_count.load(std::memory_order_acquire);
+      if (TryPop(value)) return;
+      push_count.wait(seen, std::memory_order_acquire);
+    }
+  }
+};
+#endif
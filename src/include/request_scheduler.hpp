@@ -0,0 +1,139 @@
+#ifndef REQUEST_SCHEDULER_HPP
+#define REQUEST_SCHEDULER_HPP
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+/**
+ * @brief how a class of requests is scheduled, see RequestScheduler
+ */
+struct RequestClassConfig {
+  int weight = 1;
+  size_t max_depth = 1024;
+  std::chrono::microseconds latency_budget{10000};
+};
+/**
+ * @brief the admissions of a class of requests and how long they waited
+ */
+struct RequestClassStats {
+  const static int kWaitBuckets = 32;  // bucket i counts the waits in [2^(i-1), 2^i) microseconds, bucket 0 is < 1us
+  uint64_t admitted = 0;
+  uint64_t rejected = 0;
+  uint64_t dispatched = 0;
+  uint64_t late = 0;  // dispatched after its deadline
+  uint64_t total_wait_us = 0;
+  uint64_t max_wait_us = 0;
+  uint64_t wait_buckets[kWaitBuckets] = {};
+  /**
+   * @return an upper bound of the q-quantile of the waits in microseconds, 0 if nothing is dispatched
+   */
+  inline uint64_t WaitQuantile(double q) const {
+    uint64_t rank = dispatched * q, seen = 0;
+    for (int i = 0; i < kWaitBuckets; i++) {
+      seen += wait_buckets[i];
+      if (seen > rank) return i == 0 ? 0 : std::min<uint64_t>(max_wait_us, (1ull << i) - 1);
+    }
+    return max_wait_us;
+  }
+};
+
+/**
+ * @brief Admission control and ordering of the requests of several classes competing for the same executors.
+ * @details Every class has a queue bounded by max_depth, a request beyond it is rejected at once instead of waiting
+ * behind a backlog it cannot catch up with. A request is due latency_budget after it is admitted. When an executor is
+ * free, the caller pops with the mask of the classes that executor takes:
+ * - if the head of an allowed queue is overdue, the one with the earliest deadline goes first;
+ * - otherwise the allowed non-empty queues share the executors by weight, with the smooth weighted round robin of
+ *   nginx, so a class of weight w gets w / (sum of the weights) of the pops while all of them are backlogged.
+ * The queues are FIFO, the requests of a class all have the same budget, so it is also the order of their deadlines.
+ *
+ * The time from admission to pop is recorded per class in a histogram of powers of two microseconds.
+ *
+ * It is not thread safe, the server calls it from its loop only.
+ */
+template <typename Job, size_t kClassCount>
+class RequestScheduler {
+ public:
+  typedef std::chrono::steady_clock::time_point time_point_t;
+  typedef RequestClassConfig ClassConfig;
+  typedef RequestClassStats ClassStats;
+
+ private:
+  struct Entry {
+    Job job;
+    time_point_t admitted;
+    time_point_t deadline;
+  };
+  ClassConfig configs[kClassCount];
+  std::deque<Entry> queues[kClassCount];
+  int64_t current_weights[kClassCount] = {};
+  ClassStats stats[kClassCount];
+
+  inline int PickDue(uint32_t class_mask, time_point_t now) {
+    int picked = -1;
+    for (size_t c = 0; c < kClassCount; c++) {
+      if (!(class_mask >> c & 1) || queues[c].empty() || queues[c].front().deadline > now) continue;
+      if (picked < 0 || queues[c].front().deadline < queues[picked].front().deadline) picked = c;
+    }
+    return picked;
+  }
+  inline int PickWeighted(uint32_t class_mask) {
+    int picked = -1;
+    int64_t total_weight = 0;
+    for (size_t c = 0; c < kClassCount; c++) {
+      if (!(class_mask >> c & 1) || queues[c].empty()) continue;
+      current_weights[c] += configs[c].weight;
+      total_weight += configs[c].weight;
+      if (picked < 0 || current_weights[c] > current_weights[picked]) picked = c;
+    }
+    if (picked >= 0) current_weights[picked] -= total_weight;
+    return picked;
+  }
+
+ public:
+  RequestScheduler() = default;
+  inline explicit RequestScheduler(const ClassConfig (&configs_)[kClassCount]) {
+    for (size_t c = 0; c < kClassCount; c++) configs[c] = configs_[c];
+  }
+  /**
+   * @return false if the queue of the class is full, then job is not moved from
+   */
+  inline bool Push(size_t job_class, Job &&job, time_point_t now) {
+    if (queues[job_class].size() >= configs[job_class].max_depth) {
+      stats[job_class].rejected++;
+      return false;
+    }
+    stats[job_class].admitted++;
+    queues[job_class].push_back({std::move(job), now, now + configs[job_class].latency_budget});
+    return true;
+  }
+  /**
+   * @brief pop the next job among the classes in class_mask, bit c for class c
+   * @return the class of the job, or -1 if all of those queues are empty
+   */
+  inline int Pop(uint32_t class_mask, Job &job, time_point_t now) {
+    int picked = PickDue(class_mask, now);
+    if (picked < 0) picked = PickWeighted(class_mask);
+    if (picked < 0) return -1;
+    Entry &entry = queues[picked].front();
+    ClassStats &class_stats = stats[picked];
+    uint64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(now - entry.admitted).count();
+    class_stats.dispatched++;
+    if (entry.deadline < now) class_stats.late++;
+    class_stats.total_wait_us += wait_us;
+    class_stats.max_wait_us = std::max(class_stats.max_wait_us, wait_us);
+    int bucket = 0;
+    while (bucket + 1 < ClassStats::kWaitBuckets && (wait_us >> bucket) != 0) bucket++;
+    class_stats.wait_buckets[bucket]++;
+    job = std::move(entry.job);
+    queues[picked].pop_front();
+    if (queues[picked].empty()) current_weights[picked] = 0;
+    return picked;
+  }
+  inline size_t Depth(size_t job_class) const { return queues[job_class].size(); }
+  inline const ClassStats &GetStats(size_t job_class) const { return stats[job_class]; }
+};
+#endif
@@ -0,0 +1,88 @@
+#ifndef SEATS_INVENTORY_HPP
+#define SEATS_INVENTORY_HPP
+#include <algorithm>
+#include <cstdint>
+
+/**
+ * @brief The remaining seats of a train on one day, seat i is the segment from stop i to stop i + 1.
+ * @details Every inventory provides the same interface, so SeatsData can be switched between them at compile time:
+ * - Init(segment_count, seats): fill every segment with `seats`
+ * - At(i): the remaining seats of segment i
+ * - RangeMin(l, r): the minimal remaining seats over segments [l, r), r > l
+ * - RangeAdd(l, r, delta): add delta to the segments [l, r)
+ * - max_seats: the seats of the train
+ * The records are stored as they are, so the two inventories use different file formats.
+ */
+struct FlatSeatsInventory {
+  uint32_t seat[99];
+  uint32_t max_seats;
+  inline void Init(int segment_count, uint32_t seats) {
+    for (int i = 0; i < segment_count; i++) seat[i] = seats;
+    max_seats = seats;
+  }
+  inline int At(int i) const { return seat[i]; }
+  inline int RangeMin(int l, int r) const {
+    int res = seat[l];
+    for (int i = l + 1; i < r; i++) res = std::min(res, (int)seat[i]);
+    return res;
+  }
+  inline void RangeAdd(int l, int r, int delta) {
+    for (int i = l; i < r; i++) seat[i] += delta;
+  }
+};
+static_assert(sizeof(FlatSeatsInventory) == 400);
+
+/**
+ * @brief Sqrt decomposition of the seats with lazy range add, packed into one fixed-size record.
+ * @details The 99 segments are cut into blocks of kBlockSize. A block keeps a pending delta for the whole block and the
+ * minimum of its stored values, so RangeMin and RangeAdd only touch the two partial blocks at the ends of the range
+ * plus one counter per full block in between, instead of every segment of a long-haul train.
+ */
+struct BlockedSeatsInventory {
+  const static int kBlockSize = 10;
+  const static int kBlockCount = (99 + kBlockSize - 1) / kBlockSize;
+  int32_t seat[99];  // the actual value is seat[i] + block_add[i / kBlockSize]
+  int32_t block_min[kBlockCount];
+  int32_t block_add[kBlockCount];
+  uint32_t max_seats;
+  inline void Init(int segment_count, uint32_t seats) {
+    for (int i = 0; i < 99; i++) seat[i] = i < segment_count ? seats : 0;
+    for (int b = 0; b < kBlockCount; b++) block_add[b] = 0;
+    for (int b = 0; b < kBlockCount; b++) RebuildBlock(b);
+    max_seats = seats;
+  }
+  inline int At(int i) const { return seat[i] + block_add[i / kBlockSize]; }
+  inline int RangeMin(int l, int r) const {
+    int block_l = l / kBlockSize, block_r = (r - 1) / kBlockSize;
+    int res = At(l);
+    if (block_l == block_r) {
+      for (int i = l + 1; i < r; i++) res = std::min(res, At(i));
+      return res;
+    }
+    for (int i = l + 1; i < (block_l + 1) * kBlockSize; i++) res = std::min(res, At(i));
+    for (int b = block_l + 1; b < block_r; b++) res = std::min(res, block_min[b] + block_add[b]);
+    for (int i = block_r * kBlockSize; i < r; i++) res = std::min(res, At(i));
+    return res;
+  }
+  inline void RangeAdd(int l, int r, int delta) {
+    int block_l = l / kBlockSize, block_r = (r - 1) / kBlockSize;
+    if (block_l == block_r) {
+      for (int i = l; i < r; i++) seat[i] += delta;
+      RebuildBlock(block_l);
+      return;
+    }
+    for (int i = l; i < (block_l + 1) * kBlockSize; i++) seat[i] += delta;
+    RebuildBlock(block_l);
+    for (int b = block_l + 1; b < block_r; b++) block_add[b] += delta;
+    for (int i = block_r * kBlockSize; i < r; i++) seat[i] += delta;
+    RebuildBlock(block_r);
+  }
+
+ private:
+  inline void RebuildBlock(int b) {
+    int end = std::min(99, (b + 1) * kBlockSize);
+    block_min[b] = seat[b * kBlockSize];
+    for (int i = b * kBlockSize + 1; i < end; i++) block_min[b] = std::min(block_min[b], seat[i]);
+  }
+};
+#endif
@@ -0,0 +1,243 @@
+#ifndef SESSION_TABLE_HPP
+#define SESSION_TABLE_HPP
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "data.h"
+#include "utils.h"
+#include "vector.hpp"
+
+/**
+ * @brief The users currently logged in, with the per-user data that is hot while they are online.
+ * @details An open-addressing hash table with linear probing, keyed by the user hash. Login and logout are O(1)
+ * expected. Every field of a slot is atomic and a grown table is published with a single pointer store, so lookups
+ * never take a lock and may run concurrently with one writer. The writer side (Login, Logout and the setters) must be
+ * serialized by the caller. The arrays replaced by growing are retired instead of freed, so a reader holding an old
+ * array stays valid, they are released by Reclaim once the caller knows no reader is in flight.
+ *
+ * The profile of an online user is cached as well. It is too large to be atomic, so it is copied on write: a new copy
+ * is published by a pointer store and the old one is retired like the arrays.
+ */
+class SessionTable {
+ public:
+  constexpr static int32_t kUnknownOrderCount = -1;
+
+ private:
+  enum SlotState : uint8_t { kEmpty = 0, kOccupied = 1, kDeleted = 2 };
+  struct Slot {
+    std::atomic<uint8_t> state{kEmpty};
+    std::atomic<uint8_t> privilege{0};
+    std::atomic<int32_t> order_count{kUnknownOrderCount};
+    std::atomic<bool> order_count_dirty{false};  // the cached order count is newer than the one on the disk
+    std::atomic<hash_t> user_ID_hash{0};
+    std::atomic<FullUserData *> profile{nullptr};
+  };
+  struct Table {
+    size_t capacity;  // always a power of 2
+    Slot *slots;
+  };
+  std::atomic<Table *> table;
+  sjtu::vector<Table *> retired;
+  sjtu::vector<FullUserData *> retired_profiles;
+  size_t occupied_count = 0;  // including the deleted slots, which still lengthen the probing
+  size_t online_count = 0;
+
+  inline static size_t Home(const Table *t, hash_t user_ID_hash) {
+    return (user_ID_hash ^ (user_ID_hash >> 29)) & (t->capacity - 1);
+  }
+  inline static Slot *Locate(const Table *t, hash_t user_ID_hash) {
+    for (size_t i = Home(t, user_ID_hash), step = 0; step < t->capacity; i = (i + 1) & (t->capacity - 1), step++) {
+      uint8_t state = t->slots[i].state.load(std::memory_order_acquire);
+      if (state == kEmpty) return nullptr;
+      if (state == kOccupied && t->slots[i].user_ID_hash.load(std::memory_order_relaxed) == user_ID_hash)
+        return &t->slots[i];
+    }
+    return nullptr;
+  }
+  inline static Table *NewTable(size_t capacity) { return new Table{capacity, new Slot[capacity]}; }
+  inline void Grow() {
+    Table *old_table = table.load(std::memory_order_relaxed);
+    size_t capacity = old_table->capacity;
+    while (online_count * 4 >= capacity) capacity *= 2;
+    Table *new_table = NewTable(capacity);
+    for (size_t i = 0; i < old_table->capacity; i++) {
+      Slot &from = old_table->slots[i];
+      if (from.state.load(std::memory_order_relaxed) != kOccupied) continue;
+      hash_t user_ID_hash = from.user_ID_hash.load(std::memory_order_relaxed);
+      size_t j = Home(new_table, user_ID_hash);
+      while (new_table->slots[j].state.load(std::memory_order_relaxed) != kEmpty) j = (j + 1) & (capacity - 1);
+      Slot &to = new_table->slots[j];
+      to.user_ID_hash.store(user_ID_hash, std::memory_order_relaxed);
+      to.privilege.store(from.privilege.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      to.order_count.store(from.order_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      to.order_count_dirty.store(from.order_count_dirty.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      to.profile.store(from.profile.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      to.state.store(kOccupied, std::memory_order_relaxed);
+    }
+    occupied_count = online_count;
+    table.store(new_table, std::memory_order_release);
+    retired.push_back(old_table);
+  }
+
+ public:
+  explicit inline SessionTable(size_t initial_capacity = 1024) {
+    size_t capacity = 16;
+    while (capacity < initial_capacity) capacity *= 2;
+    table.store(NewTable(capacity), std::memory_order_relaxed);
+  }
+  inline ~SessionTable() {
+    Table *t = table.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < t->capacity; i++)
+      if (t->slots[i].state.load(std::memory_order_relaxed) == kOccupied)
+        delete t->slots[i].profile.load(std::memory_order_relaxed);
+    delete[] t->slots;
+    delete t;
+    Reclaim();
+  }
+  SessionTable(const SessionTable &) = delete;
+  SessionTable &operator=(const SessionTable &) = delete;
+
+  inline bool Contains(hash_t user_ID_hash) const {
+    return Locate(table.load(std::memory_order_acquire), user_ID_hash) != nullptr;
+  }
+  /**
+   * @return the privilege the user logged in with, -1 if the user is not online
+   */
+  inline int Privilege(hash_t user_ID_hash) const {
+    Slot *slot = Locate(table.load(std::memory_order_acquire), user_ID_hash);
+    return slot == nullptr ? -1 : slot->privilege.load(std::memory_order_relaxed);
+  }
+  /**
+   * @brief log a user in, the privilege checks of the session use the privilege in the profile at this moment
+   * @return false if the user is already online
+   */
+  inline bool Login(hash_t user_ID_hash, const FullUserData &profile) {
+    return Login(user_ID_hash, profile, profile.privilege);
+  }
+  /**
+   * @brief log a user in with the given session privilege, used to restore the sessions of a checkpoint
+   * @return false if the user is already online
+   */
+  inline bool Login(hash_t user_ID_hash, const FullUserData &profile, uint8_t privilege) {
+    Table *t = table.load(std::memory_order_relaxed);
+    if (Locate(t, user_ID_hash) != nullptr) return false;
+    if ((occupied_count + 1) * 2 > t->capacity) {
+      Grow();
+      t = table.load(std::memory_order_relaxed);
+    }
+    size_t i = Home(t, user_ID_hash);
+    while (t->slots[i].state.load(std::memory_order_relaxed) == kOccupied) i = (i + 1) & (t->capacity - 1);
+    Slot &slot = t->slots[i];
+    if (slot.state.load(std::memory_order_relaxed) == kEmpty) occupied_count++;
+    slot.user_ID_hash.store(user_ID_hash, std::memory_order_relaxed);
+    slot.privilege.store(privilege, std::memory_order_relaxed);
+    slot.order_count.store(kUnknownOrderCount, std::memory_order_relaxed);
+    slot.order_count_dirty.store(false, std::memory_order_relaxed);
+    slot.profile.store(new FullUserData(profile), std::memory_order_relaxed);
+    slot.state.store(kOccupied, std::memory_order_release);
+    online_count++;
+    return true;
+  }
+  /**
+   * @return false if the user is not online
+   * @note a dirty order count is dropped, write it back with TakeDirtyOrderCount first
+   */
+  inline bool Logout(hash_t user_ID_hash) {
+    Slot *slot = Locate(table.load(std::memory_order_relaxed), user_ID_hash);
+    if (slot == nullptr) return false;
+    slot->state.store(kDeleted, std::memory_order_release);
+    retired_profiles.push_back(slot->profile.load(std::memory_order_relaxed));
+    online_count--;
+    return true;
+  }
+  /**
+   * @brief the cached number of orders of an online user, kUnknownOrderCount if not cached or not online
+   */
+  inline int32_t OrderCount(hash_t user_ID_hash) const {
+    Slot *slot = Locate(table.load(std::memory_order_acquire), user_ID_hash);
+    return slot == nullptr ? kUnknownOrderCount : slot->order_count.load(std::memory_order_relaxed);
+  }
+  /**
+   * @brief cache the order count of an online user as read from the disk
+   */
+  inline void CacheOrderCount(hash_t user_ID_hash, int32_t order_count) {
+    Slot *slot = Locate(table.load(std::memory_order_relaxed), user_ID_hash);
+    if (slot != nullptr) slot->order_count.store(order_count, std::memory_order_relaxed);
+  }
+  /**
+   * @brief change the order count of an online user, it is marked dirty until written back
+   */
+  inline void SetOrderCount(hash_t user_ID_hash, int32_t order_count) {
+    Slot *slot = Locate(table.load(std::memory_order_relaxed), user_ID_hash);
+    if (slot == nullptr) return;
+    slot->order_count.store(order_count, std::memory_order_relaxed);
+    slot->order_count_dirty.store(true, std::memory_order_relaxed);
+  }
+  /**
+   * @brief get the order count of an online user if it is dirty, and mark it clean
+   * @return false if the user is not online or the count is clean
+   */
+  inline bool TakeDirtyOrderCount(hash_t user_ID_hash, int32_t &order_count) {
+    Slot *slot = Locate(table.load(std::memory_order_relaxed), user_ID_hash);
+    if (slot == nullptr || !slot->order_count_dirty.exchange(false, std::memory_order_relaxed)) return false;
+    order_count = slot->order_count.load(std::memory_order_relaxed);
+    return true;
+  }
+  /**
+   * @brief call fn(user_ID_hash, order_count) on every dirty order count, and mark them clean
+   */
+  template <typename Fn>
+  inline void ForEachDirtyOrderCount(Fn &&fn) {
+    Table *t = table.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < t->capacity; i++) {
+      Slot &slot = t->slots[i];
+      if (slot.state.load(std::memory_order_relaxed) != kOccupied) continue;
+      if (!slot.order_count_dirty.exchange(false, std::memory_order_relaxed)) continue;
+      fn(slot.user_ID_hash.load(std::memory_order_relaxed), slot.order_count.load(std::memory_order_relaxed));
+    }
+  }
+  /**
+   * @brief copy the cached profile of an online user into profile
+   * @return false if the user is not online
+   */
+  inline bool GetProfile(hash_t user_ID_hash, FullUserData &profile) const {
+    Slot *slot = Locate(table.load(std::memory_order_acquire), user_ID_hash);
+    if (slot == nullptr) return false;
+    profile = *slot->profile.load(std::memory_order_acquire);
+    return true;
+  }
+  /**
+   * @brief replace the cached profile of a user if the user is online, the privilege of the session is not changed
+   */
+  inline void SetProfile(hash_t user_ID_hash, const FullUserData &profile) {
+    Slot *slot = Locate(table.load(std::memory_order_relaxed), user_ID_hash);
+    if (slot == nullptr) return;
+    retired_profiles.push_back(slot->profile.exchange(new FullUserData(profile), std::memory_order_acq_rel));
+  }
+  /**
+   * @brief call fn(user_ID_hash, privilege) on every online user, in no particular order
+   */
+  template <typename Fn>
+  inline void ForEachSession(Fn &&fn) const {
+    const Table *t = table.load(std::memory_order_acquire);
+    for (size_t i = 0; i < t->capacity; i++) {
+      const Slot &slot = t->slots[i];
+      if (slot.state.load(std::memory_order_acquire) != kOccupied) continue;
+      fn(slot.user_ID_hash.load(std::memory_order_relaxed), slot.privilege.load(std::memory_order_relaxed));
+    }
+  }
+  inline size_t size() const { return online_count; }
+  /**
+   * @brief free the retired arrays, only call it when no reader can be running concurrently
+   */
+  inline void Reclaim() {
+    for (size_t i = 0; i < retired.size(); i++) {
+      delete[] retired[i]->slots;
+      delete retired[i];
+    }
+    retired.clear();
+    for (size_t i = 0; i < retired_profiles.size(); i++) delete retired_profiles[i];
+    retired_profiles.clear();
+  }
+};
+#endif
@@ -0,0 +1,111 @@
+#ifndef STATION_DICTIONARY_HPP
+#define STATION_DICTIONARY_HPP
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "basic_defs.h"
+#include "storage/bpt.hpp"
+#include "storage/buffer_pool_manager.h"
+#include "storage/disk_map.hpp"
+#include "storage/driver.h"
+#include "utils.h"
+#include "vector.hpp"
+typedef uint32_t station_id_t;
+struct StationNameRecord {
+  char name[41];
+};
+
+/**
+ * @brief Persistent dictionary between station names and dense ids.
+ * @details Every station gets the next id the first time a train stopping there is added, and ids are never reused,
+ * so they can index arrays directly. The name -> id direction is a B+ tree on the name hash, the id -> name direction
+ * is a DiskMap, and all the names are also kept in memory since the number of stations is small. A different name
+ * with an already known hash is a hash collision, which is logged and rejected.
+ */
+class StationDictionary : public DataDriverBase {
+  std::string bpt_file_identifier;
+  std::string bpt_file_path;
+  DiskManager *bpt_disk_manager;
+  BufferPoolManager *bpt_bpm;
+  BPlusTreeIndexer<hash_t, std::less<hash_t>> *bpt_indexer;
+  DiskMap<station_id_t, StationNameRecord> names;
+  sjtu::vector<StationNameRecord> names_in_memory;
+
+ public:
+  const static station_id_t kInvalidStationID = -1;
+  // for satety, all the copy/move operations are deleted, please manage it using pointer
+  StationDictionary &operator=(const StationDictionary &) = delete;
+  StationDictionary(const StationDictionary &) = delete;
+  StationDictionary &operator=(StationDictionary &&) = delete;
+  StationDictionary(StationDictionary &&) = delete;
+  inline StationDictionary(std::string bpt_file_identifier_, std::string bpt_file_path_,
+                           std::string names_index_file_identifier, std::string names_index_file_path,
+                           std::string names_data_file_identifier, std::string names_data_file_path)
+      : bpt_file_identifier(std::move(bpt_file_identifier_)),
+        bpt_file_path(std::move(bpt_file_path_)),
+        names(std::move(names_index_file_identifier), std::move(names_index_file_path),
+              std::move(names_data_file_identifier), std::move(names_data_file_path)) {
+    bpt_disk_manager = new DiskManager(bpt_file_path);
+    bpt_bpm = new BufferPoolManager(100, 5, bpt_disk_manager);
+    bpt_indexer = new BPlusTreeIndexer<hash_t, std::less<hash_t>>(bpt_bpm);
+    size_t count = names.size();
+    names_in_memory.resize(count);
+    for (size_t i = 0; i < count; i++) names.Get(i, names_in_memory[i]);
+  }
+  inline ~StationDictionary() {
+    delete bpt_indexer;
+    delete bpt_bpm;
+    delete bpt_disk_manager;
+  }
+  inline virtual sjtu::vector<FileEntry> ListFiles() override {
+    sjtu::vector<FileEntry> res = names.ListFiles();
+    res.push_back({bpt_file_identifier, bpt_file_path, bpt_disk_manager});
+    return res;
+  }
+  inline virtual void LockDownForCheckOut() override {
+    names.LockDownForCheckOut();
+    delete bpt_indexer;
+    delete bpt_bpm;
+    delete bpt_disk_manager;
+    bpt_indexer = nullptr;
+    bpt_bpm = nullptr;
+    bpt_disk_manager = nullptr;
+  }
+  inline virtual void Flush() override {
+    if (bpt_indexer == nullptr) return;
+    names.Flush();
+    bpt_indexer->Flush();
+  }
+  inline size_t size() const { return names_in_memory.size(); }
+  /**
+   * @return the id of the station, kInvalidStationID if it is not known
+   */
+  inline station_id_t Find(hash_t station_hash) {
+    b_plus_tree_value_index_t id = bpt_indexer->Get(station_hash);
+    return id == kInvalidValueIndex ? kInvalidStationID : id;
+  }
+  /**
+   * @brief get the id of a station, assigning a new one if it is seen for the first time
+   * @return the id, or kInvalidStationID if the name collides with another station
+   */
+  inline station_id_t Intern(const std::string &name) {
+    hash_t station_hash = SplitMix64Hash(name);
+    station_id_t id = Find(station_hash);
+    if (id != kInvalidStationID) {
+      if (strcmp(names_in_memory[id].name, name.c_str()) != 0) {
+        LOG->error("station name hash collision: {} and {}", names_in_memory[id].name, name);
+        return kInvalidStationID;
+      }
+      return id;
+    }
+    id = names_in_memory.size();
+    StationNameRecord record;
+    strcpy(record.name, name.c_str());
+    names.Put(id, record);
+    bpt_indexer->Put(station_hash, id);
+    names_in_memory.push_back(record);
+    return id;
+  }
+  inline const char *Name(station_id_t id) const { return names_in_memory[id].name; }
+};
+#endif
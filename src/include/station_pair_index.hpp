@@ -0,0 +1,146 @@
+#ifndef STATION_PAIR_INDEX_HPP
+#define STATION_PAIR_INDEX_HPP
+#include <cstdint>
+#include "basic_defs.h"
+#include "stop_register.hpp"
+#include "storage/bpt.hpp"
+#include "storage/buffer_pool_manager.h"
+#include "storage/driver.h"
+#include "utils.h"
+struct station_pair_t {
+  hash_t from_station_ID_hash;
+  hash_t to_station_ID_hash;
+  hash_t train_ID_hash;
+  uint16_t leave_time_offset;
+  uint16_t arrive_time_offset;
+  uint8_t from_stop_id;
+  uint8_t to_stop_id;
+};
+inline bool operator<(const station_pair_t &A, const station_pair_t &B) {
+  if (A.from_station_ID_hash != B.from_station_ID_hash) return A.from_station_ID_hash < B.from_station_ID_hash;
+  if (A.to_station_ID_hash != B.to_station_ID_hash) return A.to_station_ID_hash < B.to_station_ID_hash;
+  if (A.train_ID_hash != B.train_ID_hash) return A.train_ID_hash < B.train_ID_hash;
+  if (A.from_stop_id != B.from_stop_id) return A.from_stop_id < B.from_stop_id;
+  return A.to_stop_id < B.to_stop_id;
+}
+struct StationPairRecord {
+  uint32_t saleDate_beg : 8, saleDate_end : 8, startTime : 11;
+};
+static_assert(sizeof(StationPairRecord) == sizeof(default_numeric_index_t));
+
+/**
+ * @brief Secondary index from (from station, to station) to the trains running directly between them.
+ * @details Every released train registers all of its (i, j) stop pairs with i < j, the key carries everything
+ * QueryDirectTrains needs, so a query is exactly one range scan over the matching trains. The price is
+ * O(stationNum^2) entries per train instead of O(stationNum), which is why it is only enabled with
+ * ENABLE_STATION_PAIR_INDEX.
+ */
+class StationPairIndex : public DataDriverBase {
+  std::string bpt_file_identifier;
+  std::string bpt_file_path;
+  DiskManager *bpt_disk_manager;
+  BufferPoolManager *bpt_bpm;
+  BPlusTreeIndexer<station_pair_t, std::less<station_pair_t>> *bpt_indexer;
+  const static int June_1st_2024 = 152;
+
+ public:
+  // for satety, all the copy/move operations are deleted, please manage it using pointer
+  StationPairIndex &operator=(const StationPairIndex &) = delete;
+  StationPairIndex(const StationPairIndex &) = delete;
+  StationPairIndex &operator=(StationPairIndex &&) = delete;
+  StationPairIndex(StationPairIndex &&) = delete;
+  inline StationPairIndex(std::string bpt_file_identifier_, std::string bpt_file_path_)
+      : bpt_file_identifier(std::move(bpt_file_identifier_)), bpt_file_path(std::move(bpt_file_path_)) {
+    bpt_disk_manager = new DiskManager(bpt_file_path);
+    bpt_bpm = new BufferPoolManager(100, 5, bpt_disk_manager);
+    bpt_indexer = new BPlusTreeIndexer<station_pair_t, std::less<station_pair_t>>(bpt_bpm);
+  }
+  inline ~StationPairIndex() {
+    delete bpt_indexer;
+    delete bpt_bpm;
+    delete bpt_disk_manager;
+  }
+  inline virtual sjtu::vector<FileEntry> ListFiles() override {
+    sjtu::vector<FileEntry> res;
+    res.push_back({bpt_file_identifier, bpt_file_path, bpt_disk_manager});
+    return res;
+  }
+  inline virtual void LockDownForCheckOut() override {
+    delete bpt_indexer;
+    delete bpt_bpm;
+    delete bpt_disk_manager;
+    bpt_indexer = nullptr;
+    bpt_bpm = nullptr;
+    bpt_disk_manager = nullptr;
+  }
+  inline virtual void Flush() override {
+    if (bpt_indexer == nullptr) return;
+    bpt_indexer->Flush();
+  }
+  inline size_t size() { return bpt_indexer->Size(); }
+  /**
+   * @brief register all the stop pairs of a released train
+   * @param arrive_time_offset/leave_time_offset the same offsets as StopRegister::AddStopInfo, the arriving offset of
+   * the first stop and the leaving offset of the last stop are never used
+   */
+  inline void AddTrain(hash_t train_hash, int station_num, const hash_t *stations_hash,
+                       const uint16_t *arrive_time_offset, const uint16_t *leave_time_offset,
+                       uint16_t true_saleDate_beg, uint16_t true_saleDate_end, uint16_t startTime) {
+    StationPairRecord record;
+    record.saleDate_beg = true_saleDate_beg - June_1st_2024;
+    record.saleDate_end = true_saleDate_end - June_1st_2024;
+    record.startTime = startTime;
+    for (int i = 0; i < station_num - 1; i++) {
+      for (int j = i + 1; j < station_num; j++) {
+        bpt_indexer->Put({stations_hash[i], stations_hash[j], train_hash, leave_time_offset[i], arrive_time_offset[j],
+                          (uint8_t)i, (uint8_t)j},
+                         *reinterpret_cast<default_numeric_index_t *>(&record));
+      }
+    }
+  }
+  inline void QueryDirectTrains(uint32_t date, hash_t from_station_ID, hash_t to_station_ID,
+                                sjtu::vector<StopRegister::DirectTrainInfo> &res) {
+    auto it = bpt_indexer->lower_bound_const({from_station_ID, to_station_ID, 0, 0, 0, 0, 0});
+    while (it != bpt_indexer->end_const()) {
+      const auto &key = it.GetKey();
+      if (key.from_station_ID_hash != from_station_ID || key.to_station_ID_hash != to_station_ID) break;
+      const auto &value = it.GetValue();
+      const StationPairRecord &record = *reinterpret_cast<const StationPairRecord *>(&value);
+      StopRegister::DirectTrainInfo entry;
+      if (Resolve(date, key, record, entry)) res.push_back(entry);
+      ++it;
+    }
+  }
+  inline void RequestSingleTrain(hash_t train_ID_hash, int date, hash_t from_station_hash, hash_t to_station_hash,
+                                 bool &success, StopRegister::DirectTrainInfo &entry) {
+    auto it = bpt_indexer->lower_bound_const({from_station_hash, to_station_hash, train_ID_hash, 0, 0, 0, 0});
+    success = false;
+    if (it == bpt_indexer->end_const()) return;
+    const auto &key = it.GetKey();
+    if (key.from_station_ID_hash != from_station_hash || key.to_station_ID_hash != to_station_hash ||
+        key.train_ID_hash != train_ID_hash)
+      return;
+    const auto &value = it.GetValue();
+    success = Resolve(date, key, *reinterpret_cast<const StationPairRecord *>(&value), entry);
+  }
+
+ private:
+  inline static bool Resolve(int date, const station_pair_t &key, const StationPairRecord &record,
+                             StopRegister::DirectTrainInfo &entry) {
+    int true_saleDate_beg = record.saleDate_beg + June_1st_2024;
+    int true_saleDate_end = record.saleDate_end + June_1st_2024;
+    int actual_time = record.startTime + key.leave_time_offset;
+    int delta_days = actual_time / 1440;
+    if (date - delta_days < true_saleDate_beg || date - delta_days > true_saleDate_end) return false;
+    entry.train_ID_hash = key.train_ID_hash;
+    entry.actual_start_date = date - delta_days;
+    entry.leave_time_stamp = entry.actual_start_date * 1440 + actual_time;
+    entry.arrive_time_stamp = entry.actual_start_date * 1440 + record.startTime + key.arrive_time_offset;
+    entry.from_stop_id = key.from_stop_id;
+    entry.to_stop_id = key.to_stop_id;
+    entry.saleDate_beg = true_saleDate_beg;
+    return true;
+  }
+};
+
+#endif
@@ -76,6 +76,17 @@ class StopRegister : public DataDriverBase {
     if (bpt_indexer == nullptr) return;
     bpt_indexer->Flush();
   }
+  inline size_t size() { return bpt_indexer->Size(); }
+  /**
+   * @brief dump every stop record, used to rebuild derived indexes such as StationPairIndex
+   */
+  inline void FetchAllStops(sjtu::vector<std::pair<stop_register_t, MinimalTrainRecord>> &res) {
+    res.clear();
+    for (auto it = bpt_indexer->lower_bound_const({0, 0}); it != bpt_indexer->end_const(); ++it) {
+      const auto &value = it.GetValue();
+      res.push_back(std::make_pair(it.GetKey(), *reinterpret_cast<const MinimalTrainRecord *>(&value)));
+    }
+  }
   inline void AddStopInfo(hash_t station_hash, hash_t train_hash, uint16_t true_saleDate_beg,
                           uint16_t true_saleDate_end, uint16_t startTime, uint16_t arrive_time_offset,
                           uint16_t leave_time_offset, uint8_t stop_id) {
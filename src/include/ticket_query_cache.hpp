@@ -0,0 +1,183 @@
+#ifndef TICKET_QUERY_CACHE_HPP
+#define TICKET_QUERY_CACHE_HPP
+#include <cstdint>
+#include <cstring>
+#include "basic_defs.h"
+#include "map.hpp"
+#include "stop_register.hpp"
+#include "utils.h"
+#include "vector.hpp"
+
+/**
+ * @brief LRU cache for the static part of query_ticket results.
+ * @details The candidate trains of a (from, to, date) query, together with their leaving/arriving time and segment
+ * price, never change once computed, unless a new train is released. So we cache them here, and only the live seat
+ * counts need to be fetched from the disk on a hit. The cache is bounded both by the number of entries and by the total
+ * number of cached candidates, whichever is reached first.
+ */
+class TicketQueryCache {
+ public:
+  struct Candidate {
+    StopRegister::DirectTrainInfo info;
+    char trainID[21];
+    int price;
+  };
+  struct Entry {
+    sjtu::vector<Candidate> candidates;
+    sjtu::vector<int> order_by_time;   // empty until first requested
+    sjtu::vector<int> order_by_price;  // empty until first requested
+  };
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;
+  };
+
+ private:
+  struct CacheKey {
+    hash_t from_hash;
+    hash_t to_hash;
+    int date;
+    inline bool operator<(const CacheKey &rhs) const {
+      if (from_hash != rhs.from_hash) return from_hash < rhs.from_hash;
+      if (to_hash != rhs.to_hash) return to_hash < rhs.to_hash;
+      return date < rhs.date;
+    }
+  };
+  struct Slot {
+    CacheKey key;
+    Entry entry;
+    int prev, next;  // the LRU chain, -1 means none
+  };
+  size_t max_entries;
+  size_t max_candidates;
+  size_t cur_candidates = 0;
+  sjtu::map<CacheKey, int> slot_of;
+  sjtu::vector<Slot> slots;
+  sjtu::vector<int> free_slots;
+  int lru_head = -1, lru_tail = -1;  // head is the most recently used one
+  Stats stats;
+
+  inline void Unlink(int id) {
+    Slot &s = slots[id];
+    if (s.prev != -1)
+      slots[s.prev].next = s.next;
+    else
+      lru_head = s.next;
+    if (s.next != -1)
+      slots[s.next].prev = s.prev;
+    else
+      lru_tail = s.prev;
+    s.prev = s.next = -1;
+  }
+  inline void PushFront(int id) {
+    slots[id].prev = -1;
+    slots[id].next = lru_head;
+    if (lru_head != -1) slots[lru_head].prev = id;
+    lru_head = id;
+    if (lru_tail == -1) lru_tail = id;
+  }
+  inline void Drop(int id) {
+    Unlink(id);
+    slot_of.erase(slots[id].key);
+    cur_candidates -= slots[id].entry.candidates.size();
+    slots[id].entry = Entry();
+    free_slots.push_back(id);
+  }
+
+ public:
+  inline TicketQueryCache(size_t max_entries_ = 4096, size_t max_candidates_ = 1 << 16)
+      : max_entries(max_entries_), max_candidates(max_candidates_) {}
+  TicketQueryCache(const TicketQueryCache &) = delete;
+  TicketQueryCache &operator=(const TicketQueryCache &) = delete;
+
+  /**
+   * @brief look up the cached candidates, nullptr on a miss. The returned pointer is valid until the next Insert or
+   * Invalidate.
+   */
+  inline Entry *Find(hash_t from_hash, hash_t to_hash, int date) {
+    auto it = slot_of.find({from_hash, to_hash, date});
+    if (it == slot_of.end()) {
+      ++stats.misses;
+      return nullptr;
+    }
+    ++stats.hits;
+    int id = it->second;
+    if (lru_head != id) {
+      Unlink(id);
+      PushFront(id);
+    }
+    return &slots[id].entry;
+  }
+
+  /**
+   * @brief insert the candidates of a query, evicting the least recently used entries if the cap is exceeded.
+   * @return the cached entry, or nullptr if the result alone does not fit into the cache.
+   */
+  inline Entry *Insert(hash_t from_hash, hash_t to_hash, int date, sjtu::vector<Candidate> &&candidates) {
+    if (candidates.size() > max_candidates || max_entries == 0) return nullptr;
+    CacheKey key{from_hash, to_hash, date};
+    auto it = slot_of.find(key);
+    if (it != slot_of.end()) Drop(it->second);
+    while (lru_tail != -1 && (slot_of.size() >= max_entries || cur_candidates + candidates.size() > max_candidates)) {
+      Drop(lru_tail);
+      ++stats.evictions;
+    }
+    int id;
+    if (free_slots.size() > 0) {
+      id = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      id = slots.size();
+      slots.push_back(Slot());
+    }
+    slots[id].key = key;
+    cur_candidates += candidates.size();
+    slots[id].entry.candidates = std::move(candidates);
+    slot_of[key] = id;
+    PushFront(id);
+    return &slots[id].entry;
+  }
+
+  /**
+   * @brief drop every entry that a newly released train would appear in.
+   * @details An entry (from, to, date) is affected iff the train leaves from `from` at stop i, arrives at `to` at some
+   * later stop j, and the train departing from stop i on `date` starts on a day within the sale window. This is exactly
+   * the condition StopRegister::QueryDirectTrains uses, so entries for other dates or directions stay valid.
+   * @param leave_time_offset the minutes from the starting time to leaving stop i
+   */
+  inline void InvalidateTrain(int station_num, const hash_t *stations_hash, const uint16_t *leave_time_offset,
+                              int start_time, int saleDate_beg, int saleDate_end) {
+    if (slot_of.size() == 0) return;
+    sjtu::map<hash_t, int> first_stop;
+    for (int i = station_num - 1; i >= 0; i--) first_stop[stations_hash[i]] = i;
+    sjtu::vector<int> victims;
+    for (int id = lru_head; id != -1; id = slots[id].next) {
+      const CacheKey &key = slots[id].key;
+      auto from_it = first_stop.find(key.from_hash);
+      if (from_it == first_stop.end()) continue;
+      for (int i = from_it->second; i < station_num - 1; i++) {
+        if (stations_hash[i] != key.from_hash) continue;
+        int start_date = key.date - (start_time + leave_time_offset[i]) / 1440;
+        if (start_date < saleDate_beg || start_date > saleDate_end) continue;
+        bool reaches = false;
+        for (int j = i + 1; j < station_num && !reaches; j++) reaches = stations_hash[j] == key.to_hash;
+        if (reaches) {
+          victims.push_back(id);
+          break;
+        }
+      }
+    }
+    for (size_t i = 0; i < victims.size(); i++) Drop(victims[i]);
+    stats.invalidations += victims.size();
+  }
+
+  inline void Clear() {
+    while (lru_tail != -1) Drop(lru_tail);
+  }
+  inline const Stats &GetStats() const { return stats; }
+  inline size_t EntryCount() const { return slot_of.size(); }
+  inline size_t CandidateCount() const { return cur_candidates; }
+};
+#endif
@@ -0,0 +1,167 @@
+#ifndef TICKET_SERVER_H
+#define TICKET_SERVER_H
+#ifdef ENABLE_ADVANCED_FEATURE
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include "engine.h"
+#include "map.hpp"
+#include "mpsc_queue.hpp"
+#include "request_scheduler.hpp"
+#include "storage/thread_pool.hpp"
+#include "wire_protocol.hpp"
+
+/**
+ * @brief The socket server of the engine.
+ * @details One thread runs an epoll loop over the listening socket and every connection. It splits the input into
+ * lines and hands the commands on, one at a time per connection, so the replies of a connection come back in the
+ * order of its requests while the next requests are already buffered (pipelining).
+ *
+ * The commands handed on wait in a RequestScheduler, in one queue per TicketSystemEngine::CommandClass, until an
+ * executor is free: a reader slot for the read-only classes, which share the slots by weight, or room in the batch of
+ * the writer for the others. A command whose queue is full is answered -1 at once (kRejected in the binary protocol).
+ * The queue waits are logged every stats_interval and when the server stops.
+ *
+ * The read-only commands (see TicketSystemEngine::IsReadOnlyCommand) are executed by a pool of reader threads under a
+ * shared lock of the engine. The others go through a lock-free queue to a single writer thread, which executes them
+ * in batches under the exclusive lock. A writer waiting for the lock holds a turnstile that new readers pass through,
+ * so a stream of queries cannot starve it. The replies come back to the loop through another lock-free queue and an
+ * eventfd.
+ *
+ * A connection speaks the text protocol unless it starts with WireProtocol::kMagic. As before, every text line is
+ * executed as "[0] <line>", the reply is written as it is, and a command that throws closes its connection. A binary
+ * connection gets a framed reply with the request id for every request instead, failures included. After `exit` the
+ * reply is flushed and Serve returns, the engine is left to its owner to destroy.
+ */
+class TicketServer {
+ public:
+  struct Config {
+    size_t reader_threads = 0;  // 0 for one per core
+    bool read_only = false;     // answer -1 to the commands that change data, except exit, as a replica does
+    // the scheduling of every TicketSystemEngine::CommandClass: weight, queue depth limit and latency budget
+    RequestClassConfig classes[TicketSystemEngine::kCommandClassCount] = {
+        {8, 4096, std::chrono::microseconds(2000)},   // kPoint
+        {4, 2048, std::chrono::microseconds(20000)},  // kScan
+        {1, 256, std::chrono::microseconds(200000)},  // kTransfer
+        {1, 4096, std::chrono::microseconds(5000)}};  // kWrite, its weight is unused as it has its own executor
+    std::chrono::seconds stats_interval{60};  // 0 to log the stats only when the server stops
+  };
+
+ private:
+  struct Request {
+    uint64_t connection_id = 0;
+    std::string command;
+    uint64_t request_id = 0;  // only for the binary protocol
+    bool malformed = false;   // a binary request that cannot be executed, it is answered with kMalformed
+    TicketSystemEngine::CommandClass command_class = TicketSystemEngine::CommandClass::kWrite;
+  };
+  struct Connection {
+    int fd;
+    bool protocol_known = false;
+    bool binary = false;
+    std::string input;
+    std::deque<Request> pending;  // complete requests not handed on yet
+    std::string output;
+    bool busy = false;            // a command of it is being executed
+    bool peer_closed = false;     // nothing more to read, it is closed once the pending lines are answered
+    uint32_t watched_events = 0;  // the events registered in epoll, 0 if it is not registered
+  };
+  struct Reply {
+    uint64_t connection_id = 0;
+    uint64_t request_id = 0;
+    TicketSystemEngine::CommandClass command_class = TicketSystemEngine::CommandClass::kWrite;
+    std::string response;
+    bool executed = false;  // false if it is answered without being executed, then it took no executor
+    bool failed = false;
+    bool rejected = false;  // its queue was full
+    bool exit = false;
+  };
+  typedef RequestScheduler<Request, TicketSystemEngine::kCommandClassCount> Scheduler;
+  const static uint64_t kListenerID = 0;
+  const static uint64_t kWakeID = 1;
+  const static uint64_t kStopWriter = 0;  // a Request to this connection stops the writer
+  const static size_t kMaxWriteBatch = 64;
+
+  TicketSystemEngine &engine;
+  Config config;
+  std::shared_mutex engine_latch;
+  std::mutex writer_turnstile;
+  std::atomic<bool> stopping{false};
+  MpscQueue<Request> write_queue;
+  MpscQueue<Reply> replies;
+  std::thread writer;
+  std::unique_ptr<WorkStealingThreadPool> reader_pool;
+  int epoll_fd = -1;
+  int wake_fd = -1;
+  sjtu::map<uint64_t, Connection> connections;
+  uint64_t next_connection_id = 2;
+  Scheduler scheduler;
+  size_t reader_slots;
+  size_t readers_in_flight = 0;
+  size_t writes_in_flight = 0;
+
+  void WriterLoop();
+  void ExecuteReadOnly(Request request);
+  /**
+   * @brief execute a command, the caller holds the lock of the engine
+   */
+  Reply Run(const Request &request);
+  /**
+   * @brief pass a reply back to the loop and wake it up
+   */
+  void PostReply(Reply reply);
+  void Accept(int listen_fd);
+  void ReadFrom(uint64_t connection_id);
+  /**
+   * @brief move the complete lines or frames of the input into the pending requests
+   * @return false if the input violates the binary protocol, then nothing more is read from the connection
+   */
+  bool ParseInput(uint64_t connection_id, Connection &connection);
+  /**
+   * @brief hand on the next pending command of a connection if it has none being executed
+   */
+  void Dispatch(uint64_t connection_id);
+  /**
+   * @brief answer a request without executing it
+   */
+  void Refuse(Request &request, bool rejected);
+  /**
+   * @brief hand the scheduled commands on to the free executors
+   */
+  void Schedule();
+  void LogStats();
+  /**
+   * @brief write as much of the output as the socket takes, and close the connection if it is done
+   * @return false if the connection is closed
+   */
+  bool Flush(uint64_t connection_id);
+  /**
+   * @brief watch the input while the peer may send more, and the output while some of it is not written
+   */
+  void UpdateEvents(uint64_t connection_id);
+  void Close(uint64_t connection_id);
+
+ public:
+  TicketServer(TicketSystemEngine &engine_, const Config &config_);
+  ~TicketServer();
+  TicketServer(const TicketServer &) = delete;
+  TicketServer &operator=(const TicketServer &) = delete;
+  /**
+   * @brief serve the connections of a listening socket until a client sends exit
+   */
+  void Serve(int listen_fd);
+  /**
+   * @brief run fn under the exclusive lock of the engine like a command of the writer, it is thread safe
+   * @return false if the server is stopping after exit, then fn is not run
+   */
+  bool RunExclusive(const std::function<void()> &fn);
+};
+#endif  // ENABLE_ADVANCED_FEATURE
+#endif  // TICKET_SERVER_H
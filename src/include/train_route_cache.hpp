@@ -0,0 +1,234 @@
+#ifndef TRAIN_ROUTE_CACHE_HPP
+#define TRAIN_ROUTE_CACHE_HPP
+#include <cstdint>
+#include <cstring>
+#ifdef ENABLE_ADVANCED_FEATURE
+#include <mutex>
+#endif
+#include "data.h"
+#include "map.hpp"
+#include "utils.h"
+#include "vector.hpp"
+
+/**
+ * @brief A read-only view of the route of a train, the pointers are only valid while the owner is alive and unchanged.
+ */
+struct TrainRouteView {
+  hash_t train_ID_hash;
+  const char *trainID;
+  int stationNum;
+  int startTime;
+  int saleDate_beg, saleDate_end;
+  int type;
+  const hash_t *stations_hash;
+  const int *arrive_time_offset;  // minutes from the starting time to arriving at stop i
+  const int *leave_time_offset;   // minutes from the starting time to leaving stop i
+  const int *price_sum;           // price from the first stop to stop i
+  inline int SegmentPrice(int from_stop, int to_stop) const { return price_sum[to_stop] - price_sum[from_stop]; }
+  inline int SegmentTime(int from_stop, int to_stop) const {
+    return arrive_time_offset[to_stop] - leave_time_offset[from_stop];
+  }
+};
+
+/**
+ * @brief Everything the queries need to know about the route of a train, derived from CoreTrainData and
+ * TicketPriceData once, with the travel times and prices prefix-summed.
+ */
+struct TrainRouteInfo {
+  hash_t train_ID_hash;
+  char trainID[21];
+  int stationNum;
+  int startTime;
+  int saleDate_beg, saleDate_end;
+  int type;
+  hash_t stations_hash[100];
+  int arrive_time_offset[100];  // minutes from the starting time to arriving at stop i
+  int leave_time_offset[100];   // minutes from the starting time to leaving stop i
+  int price_sum[100];           // price from the first stop to stop i
+  inline void Load(hash_t train_hash, const CoreTrainData &core_data, const TicketPriceData &price_data) {
+    train_ID_hash = train_hash;
+    strcpy(trainID, core_data.trainID);
+    stationNum = core_data.stationNum;
+    startTime = core_data.startTime;
+    saleDate_beg = core_data.saleDate_beg;
+    saleDate_end = core_data.saleDate_end;
+    type = core_data.type;
+    for (int i = 0; i < stationNum; i++) stations_hash[i] = core_data.stations_hash[i];
+    arrive_time_offset[0] = leave_time_offset[0] = price_sum[0] = 0;
+    for (int i = 1; i < stationNum; i++) {
+      arrive_time_offset[i] = leave_time_offset[i - 1] + core_data.travelTime[i - 1];
+      leave_time_offset[i] = arrive_time_offset[i] + core_data.stopoverTime[i];
+      price_sum[i] = price_sum[i - 1] + price_data.price[i - 1];
+    }
+  }
+  inline TrainRouteView View() const {
+    return {train_ID_hash,  trainID,           stationNum,         startTime,         saleDate_beg, saleDate_end,
+            type,           stations_hash,     arrive_time_offset, leave_time_offset, price_sum};
+  }
+};
+
+/**
+ * @brief In-memory cache of the routes of released trains.
+ * @details A released train never changes, so its route is computed once (at release, or lazily after a restart) and
+ * kept here in a columnar layout: the scalars of every train are in one array of row headers, and the station hashes,
+ * arriving/leaving offsets and price prefix sums are each in one contiguous column, with a fixed stride of 100 stops
+ * per train. The segment price and time of any (i, j) are then O(1) without touching the disk. The number of trains is
+ * bounded, and rows are recycled with the CLOCK algorithm.
+ *
+ * Under ENABLE_ADVANCED_FEATURE all the operations are protected by a latch, so it can be used from the query worker
+ * threads. A TrainRouteView handed out by Visit must not escape the callback.
+ */
+class TrainRouteCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+ private:
+  const static int kStride = 100;
+  struct RowHeader {
+    hash_t train_ID_hash;
+    char trainID[21];
+    uint8_t stationNum;
+    uint8_t type;
+    bool referenced;
+    uint16_t startTime;
+    uint16_t saleDate_beg, saleDate_end;
+  };
+  size_t capacity;
+  sjtu::vector<RowHeader> rows;
+  sjtu::vector<hash_t> stations_hash_column;
+  sjtu::vector<int> arrive_time_offset_column;
+  sjtu::vector<int> leave_time_offset_column;
+  sjtu::vector<int> price_sum_column;
+  sjtu::map<hash_t, int> row_of;
+  size_t clock_hand = 0;
+  Stats stats;
+#ifdef ENABLE_ADVANCED_FEATURE
+  std::mutex latch;
+#endif
+
+  inline TrainRouteView ViewOf(int row) const {
+    const RowHeader &header = rows[row];
+    size_t base = (size_t)row * kStride;
+    return {header.train_ID_hash,
+            header.trainID,
+            header.stationNum,
+            header.startTime,
+            header.saleDate_beg,
+            header.saleDate_end,
+            header.type,
+            &stations_hash_column[base],
+            &arrive_time_offset_column[base],
+            &leave_time_offset_column[base],
+            &price_sum_column[base]};
+  }
+  inline int AllocateRow() {
+    if (rows.size() < capacity) {
+      rows.push_back(RowHeader());
+      size_t column_size = rows.size() * kStride;
+      stations_hash_column.resize(column_size);
+      arrive_time_offset_column.resize(column_size);
+      leave_time_offset_column.resize(column_size);
+      price_sum_column.resize(column_size);
+      return rows.size() - 1;
+    }
+    while (rows[clock_hand].referenced) {
+      rows[clock_hand].referenced = false;
+      clock_hand = (clock_hand + 1) % rows.size();
+    }
+    int victim = clock_hand;
+    clock_hand = (clock_hand + 1) % rows.size();
+    row_of.erase(rows[victim].train_ID_hash);
+    ++stats.evictions;
+    return victim;
+  }
+
+ public:
+  explicit inline TrainRouteCache(size_t capacity_ = 2048) : capacity(capacity_) {}
+  TrainRouteCache(const TrainRouteCache &) = delete;
+  TrainRouteCache &operator=(const TrainRouteCache &) = delete;
+
+  /**
+   * @brief cache the route of a released train, replacing the old row if it is already cached
+   */
+  inline void Insert(const TrainRouteInfo &route) {
+    if (capacity == 0) return;
+#ifdef ENABLE_ADVANCED_FEATURE
+    std::lock_guard<std::mutex> guard(latch);
+#endif
+    auto it = row_of.find(route.train_ID_hash);
+    int row = it != row_of.end() ? it->second : AllocateRow();
+    RowHeader &header = rows[row];
+    header.train_ID_hash = route.train_ID_hash;
+    strcpy(header.trainID, route.trainID);
+    header.stationNum = route.stationNum;
+    header.type = route.type;
+    header.referenced = true;
+    header.startTime = route.startTime;
+    header.saleDate_beg = route.saleDate_beg;
+    header.saleDate_end = route.saleDate_end;
+    size_t base = (size_t)row * kStride;
+    memcpy(&stations_hash_column[base], route.stations_hash, sizeof(hash_t) * route.stationNum);
+    memcpy(&arrive_time_offset_column[base], route.arrive_time_offset, sizeof(int) * route.stationNum);
+    memcpy(&leave_time_offset_column[base], route.leave_time_offset, sizeof(int) * route.stationNum);
+    memcpy(&price_sum_column[base], route.price_sum, sizeof(int) * route.stationNum);
+    row_of[route.train_ID_hash] = row;
+  }
+
+  /**
+   * @brief call fn(const TrainRouteView &) on the cached route of a train
+   * @return false if the train is not cached, fn is not called then
+   */
+  template <typename Fn>
+  inline bool Visit(hash_t train_ID_hash, Fn &&fn) {
+#ifdef ENABLE_ADVANCED_FEATURE
+    std::lock_guard<std::mutex> guard(latch);
+#endif
+    auto it = row_of.find(train_ID_hash);
+    if (it == row_of.end()) {
+      ++stats.misses;
+      return false;
+    }
+    ++stats.hits;
+    rows[it->second].referenced = true;
+    fn(ViewOf(it->second));
+    return true;
+  }
+
+  /**
+   * @brief copy the cached route of a train into route
+   * @return false if the train is not cached
+   */
+  inline bool Fetch(hash_t train_ID_hash, TrainRouteInfo &route) {
+    return Visit(train_ID_hash, [&route](const TrainRouteView &view) {
+      route.train_ID_hash = view.train_ID_hash;
+      strcpy(route.trainID, view.trainID);
+      route.stationNum = view.stationNum;
+      route.startTime = view.startTime;
+      route.saleDate_beg = view.saleDate_beg;
+      route.saleDate_end = view.saleDate_end;
+      route.type = view.type;
+      memcpy(route.stations_hash, view.stations_hash, sizeof(hash_t) * view.stationNum);
+      memcpy(route.arrive_time_offset, view.arrive_time_offset, sizeof(int) * view.stationNum);
+      memcpy(route.leave_time_offset, view.leave_time_offset, sizeof(int) * view.stationNum);
+      memcpy(route.price_sum, view.price_sum, sizeof(int) * view.stationNum);
+    });
+  }
+
+  inline Stats GetStats() {
+#ifdef ENABLE_ADVANCED_FEATURE
+    std::lock_guard<std::mutex> guard(latch);
+#endif
+    return stats;
+  }
+  inline size_t size() {
+#ifdef ENABLE_ADVANCED_FEATURE
+    std::lock_guard<std::mutex> guard(latch);
+#endif
+    return row_of.size();
+  }
+};
+#endif
@@ -11,24 +11,37 @@
 #include "storage/driver.h"
 #include "storage/single_value_storage.hpp"
 #include "utils.h"
+/**
+ * @brief a fixed-width order record
+ * @details Only the train hash and the stop ids are kept, the trainID and the station names are resolved from the
+ * train data when the order is printed.
+ */
 struct TransactionData {
-  char trainID[21];
-  char from_station_name[41];
-  char to_station_name[41];
-  uint8_t status;  // 0: in queue, 1: success, 2: refunded
+  hash_t train_ID_hash;
   uint32_t leave_time_stamp;
   uint32_t arrive_time_stamp;
   uint32_t num;
   uint64_t total_price;
+  uint32_t queue_id;  // the id in the waiting queue, only meaningful if the order has ever been queued
+  uint8_t status;     // 0: in queue, 1: success, 2: refunded
   uint8_t running_date_offset;
   uint8_t from_stop_id;
   uint8_t to_stop_id;
 };
+static_assert(sizeof(TransactionData) == 40);
 class TransactionManager : public DataDriverBase {
+  /**
+   * @brief the key of the waiting queue, ordered by (train, running day, id)
+   * @details The segment and the number of tickets of the order are carried inline, they are not part of the ordering,
+   * so refunds can tell whether an order may be satisfied without reading its TransactionData.
+   */
   struct queue_index_t {
     hash_t train_ID_hash;
     uint8_t running_offset;
+    uint8_t from_stop_id;
+    uint8_t to_stop_id;
     uint32_t id;
+    uint32_t num;
     inline bool operator<(const queue_index_t &rhs) const {
       if (train_ID_hash != rhs.train_ID_hash) return train_ID_hash < rhs.train_ID_hash;
       if (running_offset != rhs.running_offset) return running_offset < rhs.running_offset;
@@ -62,6 +75,13 @@ class TransactionManager : public DataDriverBase {
   BPlusTreeIndexer<order_history_index_t, std::less<order_history_index_t>> *order_history_indexer;
 
  public:
+  struct QueuedOrder {
+    b_plus_tree_value_index_t txn_idx;
+    uint32_t id;
+    uint32_t num;
+    uint8_t from_stop_id;
+    uint8_t to_stop_id;
+  };
   // for satety, all the copy/move operations are deleted, please manage it using pointer
   inline TransactionManager(TransactionManager &&) = delete;
   inline TransactionManager &operator=(TransactionManager &&) = delete;
@@ -135,7 +155,9 @@ class TransactionManager : public DataDriverBase {
     queue_index_t queue_index_for_query;
     queue_index_for_query.train_ID_hash = train_ID_hash;
     queue_index_for_query.running_offset = 0;
+    queue_index_for_query.from_stop_id = queue_index_for_query.to_stop_id = 0;
     queue_index_for_query.id = queue_index_specai_id;
+    queue_index_for_query.num = 0;
     for (int i = 0; i < total_days; i++) {
       queue_index_for_query.running_offset = i;
       queue_indexer->Put(queue_index_for_query, 0);
@@ -147,28 +169,34 @@ class TransactionManager : public DataDriverBase {
     order_history_index_for_query.id = order_history_index_special_id;
     order_history_indexer->Put(order_history_index_for_query, 0);
   }
-  inline void AddOrder(std::string trainID, std::string from_station_name, std::string to_station_name, uint8_t status,
-                       uint32_t leave_time_stamp, uint32_t arrive_time_stamp, uint32_t num, uint64_t total_price,
-                       uint8_t running_date_offset, std::string username, uint8_t from_stop_id, uint8_t to_stop_id) {
-    TransactionData tmp;
-    strcpy(tmp.trainID, trainID.c_str());
-    strcpy(tmp.from_station_name, from_station_name.c_str());
-    strcpy(tmp.to_station_name, to_station_name.c_str());
-    tmp.status = status;
-    tmp.leave_time_stamp = leave_time_stamp;
-    tmp.arrive_time_stamp = arrive_time_stamp;
-    tmp.num = num;
-    tmp.total_price = total_price;
-    tmp.running_date_offset = running_date_offset;
-    tmp.from_stop_id = from_stop_id;
-    tmp.to_stop_id = to_stop_id;
-    b_plus_tree_value_index_t data_id = data_storage->write(tmp);
-    hash_t train_ID_hash = SplitMix64Hash(trainID);
-    hash_t user_ID_hash = SplitMix64Hash(username);
-    LOG->debug("adding order trainID {} from {} to {} status {} leave {} arrive {} num {} price {} date {} user {}",
-               trainID, from_station_name, to_station_name, status, leave_time_stamp, arrive_time_stamp, num,
-               total_price, running_date_offset, username);
-    LOG->debug("user_ID_hash: {}", user_ID_hash);
+  /**
+   * @brief the number of orders of a user as stored on the disk
+   * @details The counter is kept in the order history under the special id. The engine caches it for online users
+   * and writes it back with SetOrderCount, so it may be behind while the user is online.
+   */
+  inline uint32_t OrderCount(hash_t user_ID_hash) {
+    // warning: the validity of user_ID_hash is not checked
+    order_history_index_t order_history_index_for_query;
+    order_history_index_for_query.user_ID_hash = user_ID_hash;
+    order_history_index_for_query.id = order_history_index_special_id;
+    return order_history_indexer->Get(order_history_index_for_query);
+  }
+  inline void SetOrderCount(hash_t user_ID_hash, uint32_t order_count) {
+    // warning: the validity of user_ID_hash is not checked
+    order_history_index_t order_history_index_for_query;
+    order_history_index_for_query.user_ID_hash = user_ID_hash;
+    order_history_index_for_query.id = order_history_index_special_id;
+    auto it = order_history_indexer->lower_bound(order_history_index_for_query);
+    it.SetValue(order_count);
+  }
+  /**
+   * @brief add an order, it becomes the order_id-th order of the user
+   * @details order_id must be the order count of the user plus one, the counter itself is not updated here.
+   */
+  inline void AddOrder(hash_t train_ID_hash, uint8_t status, uint32_t leave_time_stamp, uint32_t arrive_time_stamp,
+                       uint32_t num, uint64_t total_price, uint8_t running_date_offset, hash_t user_ID_hash,
+                       uint8_t from_stop_id, uint8_t to_stop_id, uint32_t order_id) {
+    queue_index_t queue_index;
     if (status == 0) {
       queue_index_t queue_index_for_query;
       queue_index_for_query.train_ID_hash = train_ID_hash;
@@ -180,44 +208,54 @@ class TransactionManager : public DataDriverBase {
         new_id = it_queue_query.GetValue() + 1;
         it_queue_query.SetValue(new_id);
       }  // to release the lock
-      queue_index_t queue_index;
-      queue_index.train_ID_hash = queue_index_for_query.train_ID_hash;
+      queue_index.train_ID_hash = train_ID_hash;
       queue_index.running_offset = running_date_offset;
+      queue_index.from_stop_id = from_stop_id;
+      queue_index.to_stop_id = to_stop_id;
       queue_index.id = new_id;
-      queue_indexer->Put(queue_index, data_id);
+      queue_index.num = num;
     }
-    order_history_index_t order_history_index_for_query;
-    order_history_index_for_query.user_ID_hash = user_ID_hash;
-    order_history_index_for_query.id = order_history_index_special_id;
-    int new_id;
-    {
-      auto it_order_history_query = order_history_indexer->lower_bound(order_history_index_for_query);
-      new_id = it_order_history_query.GetValue() + 1;
-      it_order_history_query.SetValue(new_id);
-    }  // to release the lock
+    TransactionData tmp;
+    tmp.train_ID_hash = train_ID_hash;
+    tmp.status = status;
+    tmp.leave_time_stamp = leave_time_stamp;
+    tmp.arrive_time_stamp = arrive_time_stamp;
+    tmp.num = num;
+    tmp.total_price = total_price;
+    tmp.running_date_offset = running_date_offset;
+    tmp.from_stop_id = from_stop_id;
+    tmp.to_stop_id = to_stop_id;
+    tmp.queue_id = status == 0 ? queue_index.id : queue_index_specai_id;
+    b_plus_tree_value_index_t data_id = data_storage->write(tmp);
+    LOG->debug("adding order train {} from {} to {} status {} leave {} arrive {} num {} price {} date {} user {}",
+               train_ID_hash, from_stop_id, to_stop_id, status, leave_time_stamp, arrive_time_stamp, num, total_price,
+               running_date_offset, user_ID_hash);
+    if (status == 0) queue_indexer->Put(queue_index, data_id);
     order_history_index_t order_history_index;
     order_history_index.user_ID_hash = user_ID_hash;
-    order_history_index.id = new_id;
-    LOG->debug("new_id: {}", new_id);
+    order_history_index.id = order_id;
+    LOG->debug("order_id: {}", order_id);
     LOG->debug("data_id: {}", data_id);
     order_history_indexer->Put(order_history_index, data_id);
   }
-  inline void FetchQueue(hash_t train_ID_hash, uint8_t running_date_offset,
-                         sjtu::vector<std::pair<b_plus_tree_value_index_t, uint32_t>> &res) {
+  /**
+   * @brief fetch the orders still in the waiting queue, in the order they were queued
+   * @details The counter only grows, so the orders already removed leave holes, only the existing ones are returned.
+   */
+  inline void FetchQueue(hash_t train_ID_hash, uint8_t running_date_offset, sjtu::vector<QueuedOrder> &res) {
     // warning: the validity of train_ID_hash is not checked
     queue_index_t queue_index_for_query;
     queue_index_for_query.train_ID_hash = train_ID_hash;
     queue_index_for_query.running_offset = running_date_offset;
     queue_index_for_query.id = queue_index_specai_id;
     auto it = queue_indexer->lower_bound_const(queue_index_for_query);
-    int total_num = it.GetValue();
-    res.resize(total_num);
-    for (int i = 0; i < total_num; i++) {
+    res.clear();
+    while (true) {
       ++it;
       if (it == queue_indexer->end_const()) break;
-      if (it.GetKey().train_ID_hash != train_ID_hash || it.GetKey().running_offset != running_date_offset) break;
-      res[i].first = it.GetValue();
-      res[i].second = it.GetKey().id;
+      const queue_index_t &key = it.GetKey();
+      if (key.train_ID_hash != train_ID_hash || key.running_offset != running_date_offset) break;
+      res.push_back({it.GetValue(), key.id, key.num, key.from_stop_id, key.to_stop_id});
     }
   }
   inline void RemoveOrderFromQueue(hash_t train_ID_hash, uint8_t running_date_offset, uint32_t id) {
@@ -228,34 +266,31 @@ class TransactionManager : public DataDriverBase {
     queue_index_for_query.id = id;
     queue_indexer->Remove(queue_index_for_query);
   }
-  inline void FetchFullUserOrderHistory(hash_t user_ID_hash, sjtu::vector<b_plus_tree_value_index_t> &res) {
+  /**
+   * @brief fetch all the orders of a user who has total_num orders, the newest first
+   */
+  inline void FetchFullUserOrderHistory(hash_t user_ID_hash, uint32_t total_num,
+                                        sjtu::vector<b_plus_tree_value_index_t> &res) {
     // warning: the validity of user_ID_hash is not checked
+    res.resize(total_num);
+    if (total_num == 0) return;
+    // the ids are ordered descendingly, so the newest order comes first
     order_history_index_t order_history_index_for_query;
     order_history_index_for_query.user_ID_hash = user_ID_hash;
-    order_history_index_for_query.id = order_history_index_special_id;
+    order_history_index_for_query.id = total_num;
     auto it = order_history_indexer->lower_bound_const(order_history_index_for_query);
-    int total_num = it.GetValue();
-    res.resize(total_num);
-    for (int i = 0; i < total_num; i++) {
-      ++it;
-      res[i] = it.GetValue();
-    }
+    for (uint32_t i = 0; i < total_num; i++, ++it) res[i] = it.GetValue();
   }
-  inline b_plus_tree_value_index_t FetchSingleUserOrderHistory(hash_t user_ID_hash, int n, bool &success) {
+  /**
+   * @brief fetch the order_id-th order of a user, the ids of the orders of a user are dense from 1
+   * @return the index of its TransactionData, kInvalidValueIndex if there is no such order
+   */
+  inline b_plus_tree_value_index_t FetchUserOrder(hash_t user_ID_hash, uint32_t order_id) {
     // warning: the validity of user_ID_hash is not checked
     order_history_index_t order_history_index_for_query;
     order_history_index_for_query.user_ID_hash = user_ID_hash;
-    order_history_index_for_query.id = order_history_index_special_id;
-    auto it = order_history_indexer->lower_bound_const(order_history_index_for_query);
-    int total_num = it.GetValue();
-    if (n > total_num) {
-      success = false;
-      return 0;
-    }
-    order_history_index_for_query.id = total_num - n + 1;
-    auto dat_it = order_history_indexer->lower_bound_const(order_history_index_for_query);
-    success = true;
-    return dat_it.GetValue();
+    order_history_index_for_query.id = order_id;
+    return order_history_indexer->Get(order_history_index_for_query);
   }
   inline void FetchTransactionData(b_plus_tree_value_index_t idx, TransactionData &data) {
     // warning: the validity of idx is not checked
@@ -0,0 +1,237 @@
+#ifndef TRANSFER_ENGINE_HPP
+#define TRANSFER_ENGINE_HPP
+#include <cstdint>
+#include <cstring>
+#ifdef ENABLE_ADVANCED_FEATURE
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "storage/thread_pool.hpp"
+#endif
+#include "data.h"
+#include "map.hpp"
+#include "train_route_cache.hpp"
+#include "utils.h"
+#include "vector.hpp"
+
+/**
+ * @brief A candidate (or the best) plan of query_transfer, all indexes refer to the route table of the planner.
+ */
+struct TransferSolution {
+  bool valid = false;
+  int train1, train2;
+  int from_stop, transfer_stop1, transfer_stop2, dest_stop;
+  int train1_leaving_time_stamp, train1_arriving_time_stamp;
+  int train2_leaving_time_stamp, train2_arriving_time_stamp;
+  int train1_price, train2_price;
+  int train1_start_date;  // the day train1 leaves its first stop
+  int train2_day_delta;   // the day train2 leaves its first stop, relative to its saleDate_beg
+};
+
+/**
+ * @brief The join of query_transfer.
+ * @details All the trains leaving `from` are inserted as first legs, grouped by the station they can transfer at.
+ * Every train arriving at `to` then probes the groups of its earlier stops. A group also records the minimal time and
+ * price of its first legs, which gives a lower bound of any plan through it, so groups and legs that cannot beat the
+ * best-so-far solution are skipped without evaluation.
+ *
+ * The ordering is (time, price) or (price, time), then the IDs of train1 and train2, and finally the smaller transfer
+ * stop index of train2, so the result does not depend on the probing order.
+ */
+class TransferPlanner {
+  struct FirstLeg {
+    int train1;
+    int from_stop;
+    int transfer_stop;
+    int start_date;
+    int leaving_time_stamp;
+    int arriving_time_stamp;
+    int price;
+  };
+  struct Bucket {
+    sjtu::vector<FirstLeg> legs;
+    int min_time = 0x3f3f3f3f;
+    int min_price = 0x3f3f3f3f;
+  };
+  const sjtu::vector<TrainRouteInfo> &routes;
+  sjtu::map<hash_t, Bucket> buckets;
+  bool sort_by_time;
+
+ public:
+  inline TransferPlanner(const sjtu::vector<TrainRouteInfo> &routes_, bool sort_by_time_)
+      : routes(routes_), sort_by_time(sort_by_time_) {}
+
+  /**
+   * @return true if a is strictly better than b
+   */
+  inline bool Better(const TransferSolution &a, const TransferSolution &b) const {
+    if (!b.valid) return true;
+    int time_a = a.train2_arriving_time_stamp - a.train1_leaving_time_stamp;
+    int time_b = b.train2_arriving_time_stamp - b.train1_leaving_time_stamp;
+    int price_a = a.train1_price + a.train2_price, price_b = b.train1_price + b.train2_price;
+    if (sort_by_time) {
+      if (time_a != time_b) return time_a < time_b;
+      if (price_a != price_b) return price_a < price_b;
+    } else {
+      if (price_a != price_b) return price_a < price_b;
+      if (time_a != time_b) return time_a < time_b;
+    }
+    int status = strcmp(routes[a.train1].trainID, routes[b.train1].trainID);
+    if (status != 0) return status < 0;
+    status = strcmp(routes[a.train2].trainID, routes[b.train2].trainID);
+    if (status != 0) return status < 0;
+    return a.transfer_stop2 < b.transfer_stop2;
+  }
+
+  /**
+   * @brief register a train leaving `from` on `date` as the first leg
+   */
+  inline void AddFirstLeg(int train1, hash_t from_station_hash, int date) {
+    const TrainRouteInfo &route = routes[train1];
+    int from_stop = -1;
+    for (int i = 0; i < route.stationNum; i++) {
+      if (route.stations_hash[i] == from_station_hash) {
+        from_stop = i;
+        break;
+      }
+    }
+    if (from_stop == -1) return;
+    int actual_time = route.startTime + route.leave_time_offset[from_stop];
+    int start_date = date - actual_time / 1440;
+    if (start_date < route.saleDate_beg || start_date > route.saleDate_end) return;
+    FirstLeg leg;
+    leg.train1 = train1;
+    leg.from_stop = from_stop;
+    leg.start_date = start_date;
+    leg.leaving_time_stamp = start_date * 1440 + actual_time;
+    for (int i = from_stop + 1; i < route.stationNum; i++) {
+      leg.transfer_stop = i;
+      leg.arriving_time_stamp = start_date * 1440 + route.startTime + route.arrive_time_offset[i];
+      leg.price = route.price_sum[i] - route.price_sum[from_stop];
+      Bucket &bucket = buckets[route.stations_hash[i]];
+      bucket.legs.push_back(leg);
+      if (leg.arriving_time_stamp - leg.leaving_time_stamp < bucket.min_time)
+        bucket.min_time = leg.arriving_time_stamp - leg.leaving_time_stamp;
+      if (leg.price < bucket.min_price) bucket.min_price = leg.price;
+    }
+  }
+
+  /**
+   * @brief join a train arriving at `to` against the first legs, updating best if a better plan is found
+   */
+  inline void ProbeSecondLeg(int train2, hash_t to_station_hash, TransferSolution &best) const {
+    const TrainRouteInfo &route = routes[train2];
+    int dest_stop = -1;
+    for (int i = route.stationNum - 1; i >= 0; i--) {
+      if (route.stations_hash[i] == to_station_hash) {
+        dest_stop = i;
+        break;
+      }
+    }
+    for (int i = 0; i < dest_stop; i++) {
+      auto it = buckets.find(route.stations_hash[i]);
+      if (it == buckets.end()) continue;
+      const Bucket &bucket = it->second;
+      int ride_time = route.arrive_time_offset[dest_stop] - route.leave_time_offset[i];
+      int ride_price = route.price_sum[dest_stop] - route.price_sum[i];
+      if (best.valid && !MayBeat(bucket.min_time + ride_time, bucket.min_price + ride_price, best)) continue;
+      int earliest_leaving_time_stamp = route.saleDate_beg * 1440 + route.startTime + route.leave_time_offset[i];
+      int latest_leaving_time_stamp = route.saleDate_end * 1440 + route.startTime + route.leave_time_offset[i];
+      for (size_t k = 0; k < bucket.legs.size(); k++) {
+        const FirstLeg &leg = bucket.legs[k];
+        if (leg.train1 == train2 || routes[leg.train1].train_ID_hash == route.train_ID_hash) continue;
+        if (leg.arriving_time_stamp > latest_leaving_time_stamp) continue;
+        if (best.valid &&
+            !MayBeat(leg.arriving_time_stamp - leg.leaving_time_stamp + ride_time, leg.price + ride_price, best))
+          continue;
+        TransferSolution cur;
+        cur.valid = true;
+        cur.train1 = leg.train1;
+        cur.train2 = train2;
+        cur.from_stop = leg.from_stop;
+        cur.transfer_stop1 = leg.transfer_stop;
+        cur.transfer_stop2 = i;
+        cur.dest_stop = dest_stop;
+        cur.train1_start_date = leg.start_date;
+        cur.train1_leaving_time_stamp = leg.leaving_time_stamp;
+        cur.train1_arriving_time_stamp = leg.arriving_time_stamp;
+        cur.train1_price = leg.price;
+        cur.train2_day_delta = 0;
+        cur.train2_leaving_time_stamp = earliest_leaving_time_stamp;
+        if (cur.train2_leaving_time_stamp < leg.arriving_time_stamp) {
+          cur.train2_day_delta = (leg.arriving_time_stamp - earliest_leaving_time_stamp + 1440 - 1) / 1440;
+          cur.train2_leaving_time_stamp += cur.train2_day_delta * 1440;
+        }
+        cur.train2_arriving_time_stamp = cur.train2_leaving_time_stamp + ride_time;
+        cur.train2_price = ride_price;
+        if (Better(cur, best)) best = cur;
+      }
+    }
+  }
+
+ private:
+  /**
+   * @return false if a plan with at least this time and price can never beat best
+   */
+  inline bool MayBeat(int min_time, int min_price, const TransferSolution &best) const {
+    int best_time = best.train2_arriving_time_stamp - best.train1_leaving_time_stamp;
+    int best_price = best.train1_price + best.train2_price;
+    if (sort_by_time) return min_time <= best_time;
+    return min_price <= best_price;
+  }
+};
+
+/**
+ * @brief the best plan of query_transfer with train1 from train1_route_ids and train2 from train2_route_ids
+ */
+inline TransferSolution PlanTransfer(const sjtu::vector<TrainRouteInfo> &routes,
+                                     const sjtu::vector<int> &train1_route_ids,
+                                     const sjtu::vector<int> &train2_route_ids, hash_t from_station_hash,
+                                     hash_t to_station_hash, int date, bool sort_by_time) {
+  TransferPlanner planner(routes, sort_by_time);
+  for (size_t i = 0; i < train1_route_ids.size(); i++)
+    planner.AddFirstLeg(train1_route_ids[i], from_station_hash, date);
+  TransferSolution best;
+  for (size_t i = 0; i < train2_route_ids.size(); i++)
+    planner.ProbeSecondLeg(train2_route_ids[i], to_station_hash, best);
+  return best;
+}
+
+#ifdef ENABLE_ADVANCED_FEATURE
+/**
+ * @brief PlanTransfer on a thread pool
+ * @details The candidate matrix is cut into tiles of tile_size train1 x tile_size train2. Each block of train1 gets its
+ * own planner, every tile is probed with its own best, and the tile results are reduced in order. As
+ * TransferPlanner::Better is a total order, the answer is the same as the serial one.
+ */
+inline TransferSolution PlanTransferInTiles(const sjtu::vector<TrainRouteInfo> &routes,
+                                            const sjtu::vector<int> &train1_route_ids,
+                                            const sjtu::vector<int> &train2_route_ids, hash_t from_station_hash,
+                                            hash_t to_station_hash, int date, bool sort_by_time,
+                                            WorkStealingThreadPool &pool, size_t tile_size) {
+  const size_t len_1 = train1_route_ids.size(), len_2 = train2_route_ids.size();
+  size_t block_count_1 = (len_1 + tile_size - 1) / tile_size;
+  size_t block_count_2 = (len_2 + tile_size - 1) / tile_size;
+  std::vector<std::unique_ptr<TransferPlanner>> planners(block_count_1);
+  pool.ParallelFor(0, block_count_1, 1, [&](size_t block) {
+    planners[block] = std::make_unique<TransferPlanner>(routes, sort_by_time);
+    size_t end = std::min(len_1, (block + 1) * tile_size);
+    for (size_t i = block * tile_size; i < end; i++)
+      planners[block]->AddFirstLeg(train1_route_ids[i], from_station_hash, date);
+  });
+  sjtu::vector<TransferSolution> tile_best(block_count_1 * block_count_2);
+  pool.ParallelFor(0, block_count_1 * block_count_2, 1, [&](size_t tile) {
+    const TransferPlanner &planner = *planners[tile / block_count_2];
+    size_t block_2 = tile % block_count_2;
+    size_t end = std::min(len_2, (block_2 + 1) * tile_size);
+    for (size_t j = block_2 * tile_size; j < end; j++)
+      planner.ProbeSecondLeg(train2_route_ids[j], to_station_hash, tile_best[tile]);
+  });
+  TransferSolution best;
+  for (size_t tile = 0; tile < tile_best.size(); tile++) {
+    if (tile_best[tile].valid && planners[0]->Better(tile_best[tile], best)) best = tile_best[tile];
+  }
+  return best;
+}
+#endif
+#endif
@@ -0,0 +1,63 @@
+#ifndef TXN_LOG_FOLLOWER_H
+#define TXN_LOG_FOLLOWER_H
+#ifdef ENABLE_ADVANCED_FEATURE
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "dataguard/txn_logger.h"
+#include "engine.h"
+#include "ticket_server.h"
+
+/**
+ * @brief TxnLogFollower keeps a replica up to date with the txn log of its primary.
+ * @details The replica starts from the checkpoint staged by the primary (TicketSystemEngine::RestoreCheckpointFrom).
+ * A thread then polls the log of the primary, reads the records appended since the last poll without holding any lock,
+ * and applies them in one go through TicketServer::RunExclusive, so the queries see the state between two polls and
+ * are only blocked while the new records are applied. A record still being written by the primary fails its checksum
+ * and is picked up by a later poll.
+ *
+ * Following stops with an error in the log if the log of the primary shrinks or skips an LSN, which means it is not
+ * the log the replica started from any more. The replica keeps serving the last state in that case.
+ */
+class TxnLogFollower {
+ public:
+  struct Config {
+    std::chrono::milliseconds poll_interval{5};
+  };
+
+ private:
+  TicketSystemEngine &engine;
+  TicketServer &server;
+  std::string log_file_path;
+  Config config;
+  size_t log_offset;     // the end of the last record read
+  uint64_t applied_lsn;  // the records up to it are in the state of the replica
+  bool stop = false;
+  std::mutex latch;
+  std::condition_variable stop_cv;
+  std::thread follower;
+
+  void FollowerLoop();
+  /**
+   * @brief read and apply the records appended since the last poll
+   * @return false if following has to stop
+   */
+  bool Poll();
+
+ public:
+  /**
+   * @param checkpoint_lsn the LSN of the checkpoint the state of the replica was restored from
+   * @param checkpoint_offset where the record of that checkpoint starts in the log, the log is read from there
+   */
+  TxnLogFollower(TicketSystemEngine &engine_, TicketServer &server_, std::string log_file_path_,
+                 uint64_t checkpoint_lsn, size_t checkpoint_offset, Config config_);
+  ~TxnLogFollower();
+  TxnLogFollower(const TxnLogFollower &) = delete;
+  TxnLogFollower &operator=(const TxnLogFollower &) = delete;
+};
+#endif  // ENABLE_ADVANCED_FEATURE
+#endif  // TXN_LOG_FOLLOWER_H
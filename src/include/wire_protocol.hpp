@@ -0,0 +1,218 @@
+#ifndef WIRE_PROTOCOL_HPP
+#define WIRE_PROTOCOL_HPP
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "vector.hpp"
+
+/**
+ * @brief the commands of the binary protocol, the value is the command byte of a request
+ */
+enum class WireCommand : uint8_t {
+  kAddUser = 1,
+  kLogin = 2,
+  kLogout = 3,
+  kQueryProfile = 4,
+  kModifyProfile = 5,
+  kAddTrain = 6,
+  kDeleteTrain = 7,
+  kReleaseTrain = 8,
+  kQueryTrain = 9,
+  kQueryTicket = 10,
+  kQueryTransfer = 11,
+  kBuyTicket = 12,
+  kQueryOrder = 13,
+  kRefundTicket = 14,
+  kClean = 15,
+  kExit = 16
+};
+enum class WireStatus : uint8_t {
+  kOk = 0,         // the rows are the response, "-1" included
+  kFailed = 1,     // the command threw, there is no row
+  kMalformed = 2,  // the request could not be decoded, there is no row
+  kRejected = 3,   // the server is saturated with requests of its class, there is no row
+};
+struct WireRequest {
+  uint64_t request_id = 0;
+  WireCommand command = WireCommand::kExit;
+  uint64_t timestamp = 0;
+  sjtu::vector<std::pair<char, std::string>> args;  // the key of every `-<key> <value>` argument and its value
+};
+struct WireReply {
+  uint64_t request_id = 0;
+  WireStatus status = WireStatus::kOk;
+  sjtu::vector<std::string> rows;
+};
+
+/**
+ * @brief The length-prefixed binary protocol of the socket server.
+ * @details A connection speaks it if it starts with the four bytes of kMagic, which no text command starts with.
+ * Every frame is [size of the rest: u32] followed by the body, all the integers are little endian.
+ * - request body: [request id: u64][command: u8][timestamp: u64][arg count: u8] and [key: u8][size: u16][value] for
+ *   every argument
+ * - reply body: [request id: u64][status: u8][row count: u32] and [size: u32][row] for every row
+ *
+ * A reply carries the id of its request, its rows are the lines of the text response without the "[timestamp] "
+ * prefix, so the end of a multi-line response needs no parsing. The replies of a connection come in the order of its
+ * requests, so any number of requests may be sent ahead.
+ */
+class WireProtocol {
+  inline static void PutInt(std::string &out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) out.push_back((char)((value >> (8 * i)) & 0xFF));
+  }
+  /**
+   * @return false if fewer than bytes bytes are left
+   */
+  inline static bool GetInt(std::string_view &in, uint64_t &value, int bytes) {
+    if (in.size() < (size_t)bytes) return false;
+    value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t)(uint8_t)in[i] << (8 * i);
+    in.remove_prefix(bytes);
+    return true;
+  }
+  inline static bool GetBytes(std::string_view &in, size_t size, std::string &value) {
+    if (in.size() < size) return false;
+    value.assign(in.data(), size);
+    in.remove_prefix(size);
+    return true;
+  }
+
+ public:
+  constexpr static char kMagic[5] = "ZTB1";
+  const static size_t kMagicSize = 4;
+  const static uint32_t kMaxFrameSize = 1 << 24;
+
+  /**
+   * @return the name of a command in the text protocol, nullptr if command is unknown
+   */
+  inline static const char *CommandName(WireCommand command) {
+    static const char *const names[] = {
+        nullptr,       "add_user",     "login",          "logout",     "query_profile", "modify_profile",
+        "add_train",   "delete_train", "release_train",  "query_train", "query_ticket", "query_transfer",
+        "buy_ticket",  "query_order",  "refund_ticket",  "clean",       "exit"};
+    uint8_t index = (uint8_t)command;
+    return index < sizeof(names) / sizeof(names[0]) ? names[index] : nullptr;
+  }
+  /**
+   * @brief the size of the first frame in buffer, the size prefix included
+   * @return 0 if the frame is not complete yet, or -1 if its size exceeds kMaxFrameSize
+   */
+  inline static int64_t FrameSize(std::string_view buffer) {
+    uint64_t size;
+    if (!GetInt(buffer, size, 4)) return 0;
+    if (size > kMaxFrameSize) return -1;
+    return buffer.size() < size ? 0 : (int64_t)size + 4;
+  }
+
+  inline static void AppendRequest(std::string &out, const WireRequest &request) {
+    size_t size_pos = out.size();
+    PutInt(out, 0, 4);
+    PutInt(out, request.request_id, 8);
+    PutInt(out, (uint8_t)request.command, 1);
+    PutInt(out, request.timestamp, 8);
+    PutInt(out, request.args.size(), 1);
+    for (size_t i = 0; i < request.args.size(); i++) {
+      PutInt(out, (uint8_t)request.args[i].first, 1);
+      PutInt(out, request.args[i].second.size(), 2);
+      out += request.args[i].second;
+    }
+    std::string size;
+    PutInt(size, out.size() - size_pos - 4, 4);
+    out.replace(size_pos, 4, size);
+  }
+  /**
+   * @param frame a whole frame, see FrameSize
+   * @return false if the frame is malformed, the request id is still set if the frame holds one
+   */
+  inline static bool DecodeRequest(std::string_view frame, WireRequest &request) {
+    uint64_t size, command, arg_count;
+    request.args.clear();
+    if (!GetInt(frame, size, 4) || frame.size() != size || !GetInt(frame, request.request_id, 8)) return false;
+    if (!GetInt(frame, command, 1) || !GetInt(frame, request.timestamp, 8) || !GetInt(frame, arg_count, 1)) {
+      return false;
+    }
+    request.command = (WireCommand)command;
+    if (CommandName(request.command) == nullptr) return false;
+    for (uint64_t i = 0; i < arg_count; i++) {
+      uint64_t key, value_size;
+      std::string value;
+      if (!GetInt(frame, key, 1) || !GetInt(frame, value_size, 2) || !GetBytes(frame, value_size, value)) return false;
+      request.args.push_back(std::make_pair((char)key, std::move(value)));
+    }
+    return frame.empty();
+  }
+  /**
+   * @brief the text command a request stands for, which is what the engine executes
+   * @return false if a key is not a letter or a value is empty or holds whitespace, which cannot be written as text
+   */
+  inline static bool CommandLine(const WireRequest &request, std::string &command) {
+    command = "[" + std::to_string(request.timestamp) + "] " + CommandName(request.command);
+    for (size_t i = 0; i < request.args.size(); i++) {
+      char key = request.args[i].first;
+      const std::string &value = request.args[i].second;
+      if (!((key >= 'a' && key <= 'z') || (key >= 'A' && key <= 'Z')) || value.empty()) return false;
+      if (value.find_first_of(" \t\r\n") != std::string::npos) return false;
+      command += " -";
+      command += key;
+      command += ' ';
+      command += value;
+    }
+    return true;
+  }
+
+  /**
+   * @brief append the reply to a request, the rows are split from the text response of the engine
+   */
+  inline static void AppendReply(std::string &out, uint64_t request_id, WireStatus status,
+                                 std::string_view response) {
+    size_t size_pos = out.size();
+    PutInt(out, 0, 4);
+    PutInt(out, request_id, 8);
+    PutInt(out, (uint8_t)status, 1);
+    size_t count_pos = out.size();
+    PutInt(out, 0, 4);
+    uint64_t row_count = 0;
+    if (status == WireStatus::kOk) {
+      if (response.size() > 0 && response[0] == '[') {
+        size_t prefix_end = response.find("] ");
+        if (prefix_end != std::string_view::npos) response.remove_prefix(prefix_end + 2);
+      }
+      while (true) {
+        size_t row_end = response.find('\n');
+        std::string_view row = response.substr(0, row_end);
+        PutInt(out, row.size(), 4);
+        out.append(row.data(), row.size());
+        row_count++;
+        if (row_end == std::string_view::npos) break;
+        response.remove_prefix(row_end + 1);
+      }
+    }
+    std::string header;
+    PutInt(header, out.size() - size_pos - 4, 4);
+    out.replace(size_pos, 4, header);
+    header.clear();
+    PutInt(header, row_count, 4);
+    out.replace(count_pos, 4, header);
+  }
+  /**
+   * @param frame a whole frame, see FrameSize
+   * @return false if the frame is malformed
+   */
+  inline static bool DecodeReply(std::string_view frame, WireReply &reply) {
+    uint64_t size, status, row_count;
+    reply.rows.clear();
+    if (!GetInt(frame, size, 4) || frame.size() != size || !GetInt(frame, reply.request_id, 8)) return false;
+    if (!GetInt(frame, status, 1) || !GetInt(frame, row_count, 4)) return false;
+    reply.status = (WireStatus)status;
+    for (uint64_t i = 0; i < row_count; i++) {
+      uint64_t row_size;
+      std::string row;
+      if (!GetInt(frame, row_size, 4) || !GetBytes(frame, row_size, row)) return false;
+      reply.rows.push_back(std::move(row));
+    }
+    return frame.empty();
+  }
+};
+#endif
@@ -3,8 +3,10 @@
 #include "basic_defs.h"
 #ifdef ENABLE_ADVANCED_FEATURE
 #include <sockpp/tcp_acceptor.h>
-#include <thread>
+#include <sys/stat.h>
 #include "dataguard/dataguard.h"
+#include "ticket_server.h"
+#include "txn_log_follower.h"
 #endif
 #include "engine.h"
 #include "storage/bpt.hpp"
@@ -22,64 +24,51 @@ const bool optimize_enabled = false;
 // const bool global_log_enabled = true;
 // #endif
 
-#ifdef ENABLE_ADVANCED_FEATURE
-
-// 处理每个连接的函数
-void handle_client(sockpp::tcp_socket client, TicketSystemEngine &engine) {
-  try {
-    std::string line;
-    std::string buffer;
-
-    // 读取客户端发送的数据
-    while (true) {
-      char data[1024];
-      ssize_t n = client.read(data, sizeof(data));
-      if (n <= 0) {
-        break;  // 连接关闭或出现错误
-      }
-      buffer.append(data, n);
-
-      // 检查是否收到完整的一行
-      size_t pos;
-      while ((pos = buffer.find('\n')) != std::string::npos) {
-        line = buffer.substr(0, pos);
-        buffer.erase(0, pos + 1);
-        line = "[0] " + line;
-
-        // 调用 TicketSystemEngine 的 Execute 方法处理命令
-        std::string response = engine.Execute(line);
-
-        // 发送响应给客户端
-        client.write(response);
-
-        // 检查是否需要退出
-        if (*engine.its_time_to_exit_ptr) {
-          (&engine)->~TicketSystemEngine();
-          exit(0);
-          return;
-        }
-      }
-    }
-  } catch (const std::exception &e) {
-    LOG->error("Exception handling client: {}", e.what());
-  }
-}
-
-#endif  // ENABLE_ADVANCED_FEATURE
-
 int main(int argc, char *argv[]) {
   argparse::ArgumentParser program("zts-core", main_version + "-" + build_version);
   argparse::ArgumentParser fsck_command("fsck");
   fsck_command.add_description("Check and fix data");
   program.add_subparser(fsck_command);
+  auto add_socket_arguments = [](argparse::ArgumentParser &command, int default_port) {
+    command.add_argument("-p", "--port")
+        .help("Port to listen")
+        .default_value(default_port)
+        .nargs(1, 1)
+        .scan<'i', int>();
+    command.add_argument("-a", "--address")
+        .help("Address to bind")
+        .default_value(std::string("127.0.0.1"))
+        .nargs(1, 1);
+    command.add_argument("--reader-threads")
+        .help("Threads executing the read-only commands, 0 for one per core")
+        .default_value(0)
+        .nargs(1, 1)
+        .scan<'i', int>();
+    command.add_argument("--stats-interval")
+        .help("Seconds between two logs of the queue waits, 0 to only log them on exit")
+        .default_value(60)
+        .nargs(1, 1)
+        .scan<'i', int>();
+  };
   argparse::ArgumentParser server_command("server");
   server_command.add_description("Start a socket server");
-  server_command.add_argument("-p", "--port").help("Port to listen").default_value(8085).nargs(1, 1).scan<'i', int>();
-  server_command.add_argument("-a", "--address")
-      .help("Address to bind")
-      .default_value(std::string("127.0.0.1"))
-      .nargs(1, 1);
+  add_socket_arguments(server_command, 8085);
   program.add_subparser(server_command);
+  argparse::ArgumentParser replica_command("replica");
+  replica_command.add_description(
+      "Start a read-only socket server over a copy of the data of a primary running with --txn-log, which follows its "
+      "txn log");
+  add_socket_arguments(replica_command, 8086);
+  replica_command.add_argument("--primary")
+      .help("Data directory of the primary, it is only read")
+      .required()
+      .nargs(1, 1);
+  replica_command.add_argument("--poll-interval")
+      .help("Milliseconds between two polls of the txn log of the primary")
+      .default_value(5)
+      .nargs(1, 1)
+      .scan<'i', int>();
+  program.add_subparser(replica_command);
   argparse::ArgumentParser snapshot_command("snapshot");
   snapshot_command.add_description("Manage snapshots");
   program.add_subparser(snapshot_command);
@@ -92,6 +81,26 @@ int main(int argc, char *argv[]) {
       .default_value(std::string("info"))
       .nargs(1, 1)
       .choices("debug", "info", "warn", "error");
+#ifdef ENABLE_ADVANCED_FEATURE
+  program.add_argument("--txn-log")
+      .help("Record the successful mutating commands in a write-ahead log")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--group-commit-window")
+      .help("Microseconds a batch of the txn log may wait for more records before fdatasync")
+      .default_value(2000)
+      .nargs(1, 1)
+      .scan<'i', int>();
+  program.add_argument("--synchronous-commit")
+      .help("Reply only after the command is durable in the txn log")
+      .default_value(false)
+      .implicit_value(true);
+  program.add_argument("--checkpoint-interval")
+      .help("Take a checkpoint after every this many logged commands, 0 to only take one on shutdown")
+      .default_value(10000)
+      .nargs(1, 1)
+      .scan<'i', int>();
+#endif
   try {
     program.parse_args(argc, argv);
   } catch (const std::exception &err) {
@@ -134,12 +143,37 @@ int main(int argc, char *argv[]) {
   LOG->info("Compile optimization enabled: {}", optimize_enabled);
   LOG->info("Data directory: {}", data_directory);
   bool is_server = program.is_subcommand_used("server");
+  bool is_replica = program.is_subcommand_used("replica");
   LOG->info("Server mode: {}", is_server);
+#ifdef ENABLE_ADVANCED_FEATURE
+  TxnLogger::Config txn_log_config;
+  txn_log_config.group_commit_window = std::chrono::microseconds(program.get<int>("--group-commit-window"));
+  txn_log_config.synchronous_commit = program.get<bool>("--synchronous-commit");
+  auto setup_txn_log = [&program, &txn_log_config](TicketSystemEngine &engine) {
+    if (!program.get<bool>("--txn-log")) return;
+    engine.EnableTxnLog(txn_log_config, program.get<int>("--checkpoint-interval"));
+  };
+#endif
   try {
 #ifdef ENABLE_ADVANCED_FEATURE
-    if (is_server) {
-      auto port = server_command.get<int>("--port");
-      auto address = server_command.get<std::string>("--address");
+    if (program.is_subcommand_used("fsck")) {
+      // restore the files staged at the last checkpoint, then replay the txn log after it
+      uint64_t checkpoint_lsn, log_offset;
+      {
+        TicketSystemEngine engine(data_directory);
+        checkpoint_lsn = engine.RestoreCheckpoint(&log_offset);
+      }
+      TicketSystemEngine engine(data_directory);
+      TicketSystemEngine::ReplayStats stats = engine.ReplayTxnLog(checkpoint_lsn, txn_log_config, log_offset);
+      double throughput = stats.seconds > 0 ? stats.commands / stats.seconds : 0;
+      std::cout << "restored the checkpoint at LSN " << checkpoint_lsn << ", replayed " << stats.commands
+                << " commands in " << stats.seconds << "s (" << (uint64_t)throughput << " commands/s)" << std::endl;
+      return 0;
+    }
+    if (is_server || is_replica) {
+      argparse::ArgumentParser &socket_command = is_server ? server_command : replica_command;
+      auto port = socket_command.get<int>("--port");
+      auto address = socket_command.get<std::string>("--address");
       LOG->info("Server port: {}", port);
       LOG->info("Server address: {}", address);
       LOG->info("Starting server");
@@ -150,25 +184,49 @@ int main(int argc, char *argv[]) {
       } else
         LOG->info("successfully bind to address {} port {}", address, port);
       // throw std::runtime_error("Server mode not implemented");
-      TicketSystemEngine engine(data_directory);
-      while (true) {
-        // 接受新的客户端连接
-        sockpp::tcp_socket client = acceptor.accept();
-        if (!client) {
-          LOG->error("Error accepting incoming connection: {}", acceptor.last_error_str());
-        } else {
-          LOG->info("New client connected from {}", client.peer_address().to_string());
-
-          // 创建一个线程来处理客户端连接
-          std::thread(handle_client, std::move(client), std::ref(engine)).detach();
+      TicketServer::Config server_config;
+      server_config.reader_threads = socket_command.get<int>("--reader-threads");
+      server_config.stats_interval = std::chrono::seconds(socket_command.get<int>("--stats-interval"));
+      if (is_replica) {
+        auto primary_directory = replica_command.get<std::string>("--primary");
+        struct stat primary_stat, replica_stat;
+        if (stat(primary_directory.c_str(), &primary_stat) != 0 || stat(data_directory.c_str(), &replica_stat) != 0) {
+          LOG->error("the data directory of the primary or of the replica does not exist");
+          return 1;
+        }
+        if (primary_stat.st_dev == replica_stat.st_dev && primary_stat.st_ino == replica_stat.st_ino) {
+          LOG->error("a replica needs a data directory of its own");
+          return 1;
         }
+        uint64_t checkpoint_lsn, log_offset;
+        {
+          TicketSystemEngine engine(data_directory);
+          checkpoint_lsn = engine.RestoreCheckpointFrom(primary_directory, &log_offset);
+        }
+        TicketSystemEngine engine(data_directory);
+        server_config.read_only = true;
+        TicketServer server(engine, server_config);
+        TxnLogFollower::Config follower_config;
+        follower_config.poll_interval = std::chrono::milliseconds(replica_command.get<int>("--poll-interval"));
+        TxnLogFollower follower(engine, server, primary_directory + "/txn.log", checkpoint_lsn, log_offset,
+                                 follower_config);
+        LOG->info("replica of {} started from the checkpoint at LSN {}", primary_directory, checkpoint_lsn);
+        server.Serve(acceptor.handle());
+        return 0;
       }
+      TicketSystemEngine engine(data_directory);
+      setup_txn_log(engine);
+      TicketServer server(engine, server_config);
+      server.Serve(acceptor.handle());
     } else {
 #endif
       std::ios::sync_with_stdio(false);
       std::cin.tie(nullptr);
       std::cout.tie(nullptr);
       TicketSystemEngine engine(data_directory);
+#ifdef ENABLE_ADVANCED_FEATURE
+      setup_txn_log(engine);
+#endif
       std::string cmd;
       while (std::getline(std::cin, cmd)) {
         std::cout << engine.Execute(cmd) << '\n';
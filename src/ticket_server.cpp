@@ -0,0 +1,392 @@
+#ifdef ENABLE_ADVANCED_FEATURE
+#include "ticket_server.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include "basic_defs.h"
+
+namespace {
+bool IsExitCommand(const std::string &command) {
+  char command_name[20];
+  return sscanf(command.c_str(), "%*s %19s", command_name) == 1 && strcmp(command_name, "exit") == 0;
+}
+}  // namespace
+
+TicketServer::TicketServer(TicketSystemEngine &engine_, const Config &config_)
+    : engine(engine_), config(config_), scheduler(config.classes) {
+  size_t reader_threads = config.reader_threads > 0 ? config.reader_threads : std::thread::hardware_concurrency();
+  reader_pool = std::make_unique<WorkStealingThreadPool>(reader_threads);
+  reader_slots = std::max<size_t>(reader_threads, 1);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || wake_fd < 0) throw std::runtime_error("failed to create the epoll loop of the server");
+  writer = std::thread(&TicketServer::WriterLoop, this);
+}
+
+TicketServer::~TicketServer() {
+  if (writer.joinable()) {
+    write_queue.Push({kStopWriter, ""});
+    writer.join();
+  }
+  // the readers still running post their replies through wake_fd
+  reader_pool.reset();
+  for (auto it = connections.begin(); it != connections.end(); ++it) {
+    if (it->second.fd >= 0) close(it->second.fd);
+  }
+  close(wake_fd);
+  close(epoll_fd);
+}
+
+TicketServer::Reply TicketServer::Run(const Request &request) {
+  Reply reply;
+  reply.connection_id = request.connection_id;
+  reply.request_id = request.request_id;
+  reply.command_class = request.command_class;
+  reply.executed = true;
+  try {
+    reply.response = engine.Execute(request.command);
+  } catch (const std::exception &e) {
+    LOG->error("Exception handling client: {}", e.what());
+    reply.failed = true;
+  }
+  return reply;
+}
+
+void TicketServer::PostReply(Reply reply) {
+  replies.Push(std::move(reply));
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) LOG->error("failed to wake the server loop");
+}
+
+void TicketServer::WriterLoop() {
+  Request request;
+  while (true) {
+    write_queue.WaitPop(request);
+    if (request.connection_id == kStopWriter) return;
+    std::lock_guard<std::mutex> turnstile(writer_turnstile);
+    std::unique_lock<std::shared_mutex> lock(engine_latch);
+    // the commands queued meanwhile are executed in the same batch, the readers wait for the lock only once
+    for (size_t batch = 1;; batch++) {
+      Reply reply = Run(request);
+      if (*engine.its_time_to_exit_ptr) {
+        // the commands after exit are never answered
+        reply.exit = true;
+        stopping.store(true);
+        PostReply(std::move(reply));
+        return;
+      }
+      PostReply(std::move(reply));
+      if (batch == kMaxWriteBatch || !write_queue.TryPop(request)) break;
+      if (request.connection_id == kStopWriter) return;
+    }
+  }
+}
+
+bool TicketServer::RunExclusive(const std::function<void()> &fn) {
+  std::lock_guard<std::mutex> turnstile(writer_turnstile);
+  std::unique_lock<std::shared_mutex> lock(engine_latch);
+  if (stopping.load()) return false;
+  fn();
+  return true;
+}
+
+void TicketServer::ExecuteReadOnly(Request request) {
+  // wait behind a writer that is waiting for the lock
+  { std::lock_guard<std::mutex> turnstile(writer_turnstile); }
+  std::shared_lock<std::shared_mutex> lock(engine_latch);
+  if (stopping.load()) return;
+  PostReply(Run(request));
+}
+
+void TicketServer::Accept(int listen_fd) {
+  while (true) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG->error("Error accepting incoming connection: {}", strerror(errno));
+      }
+      if (errno == EINTR) continue;
+      return;
+    }
+    uint64_t connection_id = next_connection_id++;
+    connections[connection_id].fd = fd;
+    UpdateEvents(connection_id);
+    LOG->info("New client connected, {} connections", connections.size());
+  }
+}
+
+void TicketServer::ReadFrom(uint64_t connection_id) {
+  auto it = connections.find(connection_id);
+  if (it == connections.end() || it->second.fd < 0) return;
+  Connection &connection = it->second;
+  char data[1 << 14];
+  while (true) {
+    ssize_t n = read(connection.fd, data, sizeof(data));
+    if (n > 0) {
+      connection.input.append(data, n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    // the pending lines are still answered after the peer stops sending
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) connection.peer_closed = true;
+    break;
+  }
+  if (!ParseInput(connection_id, connection)) {
+    LOG->error("a client violates the binary protocol");
+    connection.input.clear();
+    connection.peer_closed = true;
+  }
+  Dispatch(connection_id);
+  // the malformed requests are answered by Dispatch at once
+  if (connection.peer_closed || !connection.output.empty()) Flush(connection_id);
+}
+
+bool TicketServer::ParseInput(uint64_t connection_id, Connection &connection) {
+  if (!connection.protocol_known) {
+    size_t compared = std::min(connection.input.size(), WireProtocol::kMagicSize);
+    if (connection.input.compare(0, compared, WireProtocol::kMagic, compared) != 0) {
+      connection.protocol_known = true;
+    } else if (compared == WireProtocol::kMagicSize) {
+      connection.protocol_known = connection.binary = true;
+      connection.input.erase(0, compared);
+    } else {
+      return true;
+    }
+  }
+  size_t begin = 0;
+  if (!connection.binary) {
+    size_t pos;
+    while ((pos = connection.input.find('\n', begin)) != std::string::npos) {
+      connection.pending.push_back({connection_id, "[0] " + connection.input.substr(begin, pos - begin)});
+      begin = pos + 1;
+    }
+    connection.input.erase(0, begin);
+    return true;
+  }
+  while (true) {
+    std::string_view rest = std::string_view(connection.input).substr(begin);
+    int64_t frame_size = WireProtocol::FrameSize(rest);
+    if (frame_size < 0) return false;
+    if (frame_size == 0) break;
+    WireRequest wire_request;
+    Request request;
+    request.connection_id = connection_id;
+    request.malformed = !WireProtocol::DecodeRequest(rest.substr(0, frame_size), wire_request) ||
+                        !WireProtocol::CommandLine(wire_request, request.command);
+    request.request_id = wire_request.request_id;
+    connection.pending.push_back(std::move(request));
+    begin += frame_size;
+  }
+  connection.input.erase(0, begin);
+  return true;
+}
+
+void TicketServer::UpdateEvents(uint64_t connection_id) {
+  Connection &connection = connections[connection_id];
+  uint32_t events = (connection.peer_closed ? 0u : static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP)) |
+                    (connection.output.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+  if (events == connection.watched_events) return;
+  epoll_event event;
+  event.events = events;
+  event.data.u64 = connection_id;
+  int op = events == 0 ? EPOLL_CTL_DEL : (connection.watched_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+  if (epoll_ctl(epoll_fd, op, connection.fd, &event) != 0) {
+    LOG->error("failed to watch a connection: {}", strerror(errno));
+  }
+  connection.watched_events = events;
+}
+
+void TicketServer::Dispatch(uint64_t connection_id) {
+  Connection &connection = connections[connection_id];
+  while (!connection.busy && !connection.pending.empty() && connection.pending.front().malformed) {
+    WireProtocol::AppendReply(connection.output, connection.pending.front().request_id, WireStatus::kMalformed, "");
+    connection.pending.pop_front();
+  }
+  if (connection.busy || connection.pending.empty()) return;
+  connection.busy = true;
+  Request request = std::move(connection.pending.front());
+  connection.pending.pop_front();
+  request.command_class = TicketSystemEngine::ClassifyCommand(request.command);
+  if (config.read_only && request.command_class == TicketSystemEngine::CommandClass::kWrite &&
+      !IsExitCommand(request.command)) {
+    Refuse(request, false);
+    return;
+  }
+  if (!scheduler.Push((size_t)request.command_class, std::move(request), std::chrono::steady_clock::now())) {
+    Refuse(request, true);
+    return;
+  }
+  Schedule();
+}
+
+void TicketServer::Refuse(Request &request, bool rejected) {
+  Reply reply;
+  reply.connection_id = request.connection_id;
+  reply.request_id = request.request_id;
+  reply.command_class = request.command_class;
+  reply.response = request.command.substr(0, request.command.find(' ')) + " -1";
+  reply.rejected = rejected;
+  // through the queue like the others, so the connection stays busy until it is written
+  PostReply(std::move(reply));
+}
+
+void TicketServer::Schedule() {
+  const uint32_t kWriteMask = 1u << (int)TicketSystemEngine::CommandClass::kWrite;
+  const uint32_t kReadMask = ((1u << TicketSystemEngine::kCommandClassCount) - 1) & ~kWriteMask;
+  auto now = std::chrono::steady_clock::now();
+  Request request;
+  while (true) {
+    uint32_t mask = (readers_in_flight < reader_slots ? kReadMask : 0) |
+                    (writes_in_flight < kMaxWriteBatch ? kWriteMask : 0);
+    if (mask == 0 || scheduler.Pop(mask, request, now) < 0) return;
+    if (request.command_class == TicketSystemEngine::CommandClass::kWrite) {
+      writes_in_flight++;
+      write_queue.Push(std::move(request));
+    } else {
+      readers_in_flight++;
+      reader_pool->Submit([this, request = std::move(request)]() mutable { ExecuteReadOnly(std::move(request)); });
+    }
+  }
+}
+
+void TicketServer::LogStats() {
+  const char *const class_names[] = {"point", "scan", "transfer", "write"};
+  for (size_t c = 0; c < TicketSystemEngine::kCommandClassCount; c++) {
+    const RequestClassStats &stats = scheduler.GetStats(c);
+    if (stats.admitted == 0 && stats.rejected == 0) continue;
+    LOG->info("{} queue: {} admitted, {} rejected, {} queued, wait p50 <= {}us, p99 <= {}us, max {}us, {} late",
+              class_names[c], stats.admitted, stats.rejected, scheduler.Depth(c), stats.WaitQuantile(0.5),
+              stats.WaitQuantile(0.99), stats.max_wait_us, stats.late);
+  }
+}
+
+bool TicketServer::Flush(uint64_t connection_id) {
+  Connection &connection = connections[connection_id];
+  size_t written = 0;
+  while (written < connection.output.size()) {
+    ssize_t n = send(connection.fd, connection.output.data() + written, connection.output.size() - written,
+                     MSG_NOSIGNAL);
+    if (n > 0) {
+      written += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    // the peer is gone, nothing can be answered any more
+    connection.output.clear();
+    connection.pending.clear();
+    connection.peer_closed = true;
+    written = 0;
+    break;
+  }
+  connection.output.erase(0, written);
+  if (!connection.busy && connection.pending.empty() && connection.output.empty() && connection.peer_closed) {
+    Close(connection_id);
+    return false;
+  }
+  UpdateEvents(connection_id);
+  return true;
+}
+
+void TicketServer::Close(uint64_t connection_id) {
+  auto it = connections.find(connection_id);
+  if (it == connections.end()) return;
+  if (it->second.watched_events != 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+  close(it->second.fd);
+  connections.erase(it);
+  LOG->info("Client disconnected, {} connections", connections.size());
+}
+
+void TicketServer::Serve(int listen_fd) {
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = kListenerID;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) throw std::runtime_error("epoll_ctl failed");
+  event.data.u64 = kWakeID;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) throw std::runtime_error("epoll_ctl failed");
+  const int kMaxEvents = 256;
+  epoll_event events[kMaxEvents];
+  auto next_stats = std::chrono::steady_clock::now() + config.stats_interval;
+  while (true) {
+    int timeout = -1;
+    if (config.stats_interval.count() > 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next_stats) {
+        LogStats();
+        next_stats = now + config.stats_interval;
+      }
+      timeout = std::chrono::ceil<std::chrono::milliseconds>(next_stats - now).count();
+    }
+    int count = epoll_wait(epoll_fd, events, kMaxEvents, timeout);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error("epoll_wait failed");
+    }
+    for (int i = 0; i < count; i++) {
+      uint64_t id = events[i].data.u64;
+      if (id == kListenerID) {
+        Accept(listen_fd);
+      } else if (id == kWakeID) {
+        uint64_t value;
+        while (read(wake_fd, &value, sizeof(value)) > 0) continue;
+        Reply reply;
+        while (replies.TryPop(reply)) {
+          if (reply.executed) {
+            if (reply.command_class == TicketSystemEngine::CommandClass::kWrite) {
+              writes_in_flight--;
+            } else {
+              readers_in_flight--;
+            }
+          }
+          auto it = connections.find(reply.connection_id);
+          if (it == connections.end()) continue;
+          Connection &connection = it->second;
+          connection.busy = false;
+          if (connection.binary) {
+            WireStatus status = reply.failed     ? WireStatus::kFailed
+                                : reply.rejected ? WireStatus::kRejected
+                                                 : WireStatus::kOk;
+            WireProtocol::AppendReply(connection.output, reply.request_id, status, reply.response);
+          } else {
+            if (reply.failed) {
+              // as before, a command that throws ends its connection
+              connection.pending.clear();
+              connection.peer_closed = true;
+            }
+            connection.output += reply.response;
+          }
+          if (reply.exit) {
+            // flush the farewell synchronously, then stop serving
+            fcntl(connection.fd, F_SETFL, fcntl(connection.fd, F_GETFL) & ~O_NONBLOCK);
+            connection.pending.clear();
+            connection.peer_closed = true;
+            Flush(reply.connection_id);
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, nullptr);
+            LogStats();
+            return;
+          }
+          Dispatch(reply.connection_id);
+          Flush(reply.connection_id);
+        }
+        Schedule();
+      } else {
+        auto it = connections.find(id);
+        if (it == connections.end()) continue;
+        if (!it->second.peer_closed && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+          ReadFrom(id);
+        } else {
+          Flush(id);
+        }
+      }
+    }
+  }
+}
+#endif  // ENABLE_ADVANCED_FEATURE
@@ -136,6 +136,14 @@ std::string TicketSystemEngine::AddTrain(const std::string &command) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
+  TrainStationsData train_stations_data;
+  for (int i = 0; i < stationNum; i++) {
+    train_stations_data.station_id[i] = station_dictionary.Intern(stations[i]);
+    if (train_stations_data.station_id[i] == StationDictionary::kInvalidStationID) {
+      response_stream << '[' << command_id << "] -1";
+      return response_stream.str();
+    }
+  }
   TicketPriceData ticket_price_data;
   for (int i = 0; i < stationNum - 1; i++) ticket_price_data.price[i] = prices[i];
   strcpy(ticket_price_data.trainID, trainID.c_str());
@@ -160,18 +168,9 @@ std::string TicketSystemEngine::AddTrain(const std::string &command) {
   core_train_data.saleDate_end = saleDate_end;
   core_train_data.type = type[0] - 'A';
   core_train_data_storage.Put(train_id_hash, core_train_data);
-  StationNameData station_name_data;
-  for (int i = 0; i < stationNum; i++) {
-    size_t len = stations[i].length();
-    for (int j = 0; j < len; j++) station_name_data.name[i][j] = stations[i][j];
-    if (len < 40) station_name_data.name[i][len] = '\0';
-  }
-  station_name_data_storage.Put(train_id_hash, station_name_data);
+  train_stations_storage.Put(train_id_hash, train_stations_data);
   SeatsData seats_data;
-  for (int i = 0; i < core_train_data.stationNum - 1; i++) {
-    seats_data.seat[i] = core_train_data.seatNum;
-  }
-  seats_data.max_seats = core_train_data.seatNum;
+  seats_data.Init(core_train_data.stationNum - 1, core_train_data.seatNum);
   int day_count = core_train_data.saleDate_end - core_train_data.saleDate_beg + 1;
   for (int i = 0; i < day_count; i++) {
     seats_data_storage.Put(std::make_pair(train_id_hash, i), seats_data);
@@ -210,7 +209,7 @@ std::string TicketSystemEngine::DeleteTrain(const std::string &command) {
   }
   core_train_data_storage.Remove(train_id_hash);
   ticket_price_data_storage.Remove(train_id_hash);
-  station_name_data_storage.Remove(train_id_hash);
+  train_stations_storage.Remove(train_id_hash);
   int day_count = core_train_data.saleDate_end - core_train_data.saleDate_beg + 1;
   for (int i = 0; i < day_count; i++) {
     seats_data_storage.Remove(std::make_pair(train_id_hash, i));
@@ -252,6 +251,10 @@ std::string TicketSystemEngine::ReleaseTrain(const std::string &command) {
   core_train_data_storage.Put(train_id_hash, core_train_data);
   // TODO: update data to transaction system
   int vis_time_offset = 0;
+  uint16_t leave_time_offsets[100];
+#ifdef ENABLE_STATION_PAIR_INDEX
+  uint16_t arrive_time_offsets[100];
+#endif
   for (int i = 0; i < core_train_data.stationNum; i++) {
     uint16_t arrive_time_offset = -1;
     uint16_t leave_time_offset = -1;
@@ -270,11 +273,28 @@ std::string TicketSystemEngine::ReleaseTrain(const std::string &command) {
       leave_time_offset = vis_time_offset;
       LOG->debug("set leave_time_offset={}", leave_time_offset);
     }
+#ifdef ENABLE_STATION_PAIR_INDEX
+    arrive_time_offsets[i] = arrive_time_offset;
+#endif
+    leave_time_offsets[i] = leave_time_offset;
     stop_register.AddStopInfo(core_train_data.stations_hash[i], train_id_hash, core_train_data.saleDate_beg,
                               core_train_data.saleDate_end, core_train_data.startTime, arrive_time_offset,
                               leave_time_offset, i);
   }
   transaction_manager.PrepareTrainInfo(train_id_hash, core_train_data.saleDate_end - core_train_data.saleDate_beg + 1);
+#ifdef ENABLE_STATION_PAIR_INDEX
+  station_pair_index.AddTrain(train_id_hash, core_train_data.stationNum, core_train_data.stations_hash,
+                              arrive_time_offsets, leave_time_offsets, core_train_data.saleDate_beg,
+                              core_train_data.saleDate_end, core_train_data.startTime);
+#endif
+  ticket_query_cache.InvalidateTrain(core_train_data.stationNum, core_train_data.stations_hash, leave_time_offsets,
+                                     core_train_data.startTime, core_train_data.saleDate_beg,
+                                     core_train_data.saleDate_end);
+  TicketPriceData ticket_price_data;
+  ticket_price_data_storage.Get(train_id_hash, ticket_price_data);
+  TrainRouteInfo route;
+  route.Load(train_id_hash, core_train_data, ticket_price_data);
+  train_route_cache.Insert(route);
   response_stream << '[' << command_id << "] 0";
   return response_stream.str();
 }
@@ -307,65 +327,89 @@ std::string TicketSystemEngine::QueryTrain(const std::string &command) {
   LOG->debug("trainID: {}", trainID);
   LOG->debug("date: {}={}-{}", date, RetrieveReadableDate(date).first, RetrieveReadableDate(date).second);
   hash_t train_id_hash = SplitMix64Hash(trainID);
-  CoreTrainData core_train_data;
+  TrainRouteInfo route;
   try {
-    core_train_data_storage.Get(train_id_hash, core_train_data);
+    FetchTrainRoute(train_id_hash, route);
   } catch (std::runtime_error &e) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
-  if (date < core_train_data.saleDate_beg || date > core_train_data.saleDate_end) {
+  if (date < route.saleDate_beg || date > route.saleDate_end) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
-  StationNameData station_name_data;
-  station_name_data_storage.Get(train_id_hash, station_name_data);
-  LOG->debug("successfully retrieved station name data");
-  TicketPriceData ticket_price_data;
-  ticket_price_data_storage.Get(train_id_hash, ticket_price_data);
-  LOG->debug("successfully retrieved ticket price data");
+  TrainStationsData train_stations_data;
+  train_stations_storage.Get(train_id_hash, train_stations_data);
+  LOG->debug("successfully retrieved station data");
   SeatsData seats_data;
-  seats_data_storage.Get(std::make_pair(train_id_hash, date - core_train_data.saleDate_beg), seats_data);
+  seats_data_storage.Get(std::make_pair(train_id_hash, date - route.saleDate_beg), seats_data);
   LOG->debug("successfully retrieved seats data");
-  response_stream << '[' << command_id << "] " << trainID << ' ' << char(core_train_data.type + 'A') << '\n';
-  int cur_time = date * 1440 + core_train_data.startTime;
-  int total_price = 0;
-  for (int i = 0; i < core_train_data.stationNum; i++) {
-    for (int j = 0; j < 40 && station_name_data.name[i][j] != '\0'; j++)
-      response_stream << station_name_data.name[i][j];
+  response_stream << '[' << command_id << "] " << trainID << ' ' << char(route.type + 'A') << '\n';
+  int start_time = date * 1440 + route.startTime;
+  for (int i = 0; i < route.stationNum; i++) {
+    response_stream << station_dictionary.Name(train_stations_data.station_id[i]);
+    int month, day, hour, minute;
     if (i == 0) {
       response_stream << " xx-xx xx:xx -> ";
-      int month, day, hour, minute;
-      RetrieveReadableTimeStamp(cur_time, month, day, hour, minute);
-      response_stream << std::setw(2) << std::setfill('0') << month << '-' << std::setw(2) << std::setfill('0') << day
-                      << ' ' << std::setw(2) << std::setfill('0') << hour << ':' << std::setw(2) << std::setfill('0')
-                      << minute << ' ';
-      response_stream << total_price << ' ' << seats_data.seat[i];
-    } else if (i < core_train_data.stationNum - 1) {
-      int month, day, hour, minute;
-      RetrieveReadableTimeStamp(cur_time, month, day, hour, minute);
+    } else {
+      RetrieveReadableTimeStamp(start_time + route.arrive_time_offset[i], month, day, hour, minute);
       response_stream << ' ' << std::setw(2) << std::setfill('0') << month << '-' << std::setw(2) << std::setfill('0')
                       << day << ' ' << std::setw(2) << std::setfill('0') << hour << ':' << std::setw(2)
                       << std::setfill('0') << minute << " -> ";
-      cur_time += core_train_data.stopoverTime[i];
-      RetrieveReadableTimeStamp(cur_time, month, day, hour, minute);
+    }
+    if (i < route.stationNum - 1) {
+      RetrieveReadableTimeStamp(start_time + route.leave_time_offset[i], month, day, hour, minute);
       response_stream << std::setw(2) << std::setfill('0') << month << '-' << std::setw(2) << std::setfill('0') << day
                       << ' ' << std::setw(2) << std::setfill('0') << hour << ':' << std::setw(2) << std::setfill('0')
                       << minute << ' ';
-      response_stream << total_price << ' ' << seats_data.seat[i];
+      response_stream << route.price_sum[i] << ' ' << seats_data.At(i) << '\n';
     } else {
-      int month, day, hour, minute;
-      RetrieveReadableTimeStamp(cur_time, month, day, hour, minute);
-      response_stream << ' ' << std::setw(2) << std::setfill('0') << month << '-' << std::setw(2) << std::setfill('0')
-                      << day << ' ' << std::setw(2) << std::setfill('0') << hour << ':' << std::setw(2)
-                      << std::setfill('0') << minute << " -> xx-xx xx:xx ";
-      response_stream << total_price << " x";
-    }
-    if (i != core_train_data.stationNum - 1) {
-      total_price += ticket_price_data.price[i];
-      response_stream << '\n';
+      response_stream << "xx-xx xx:xx " << route.price_sum[i] << " x";
     }
-    cur_time += core_train_data.travelTime[i];
   }
   return response_stream.str();
-}
\ No newline at end of file
+}
+
+void TicketSystemEngine::LoadTrainRoute(hash_t train_ID_hash, TrainRouteInfo &route) {
+  CoreTrainData core_train_data;
+  TicketPriceData ticket_price_data;
+  core_train_data_storage.Get(train_ID_hash, core_train_data);
+  ticket_price_data_storage.Get(train_ID_hash, ticket_price_data);
+  route.Load(train_ID_hash, core_train_data, ticket_price_data);
+  // an unreleased train may still be deleted, so only released ones are cached
+  if (core_train_data.is_released) train_route_cache.Insert(route);
+}
+#ifdef ENABLE_STATION_PAIR_INDEX
+void TicketSystemEngine::RebuildStationPairIndex() {
+  LOG->info("rebuilding station pair index from the stop register");
+  const static int June_1st_2024 = 152;
+  sjtu::vector<std::pair<stop_register_t, MinimalTrainRecord>> stops;
+  stop_register.FetchAllStops(stops);
+  // group the stops by train, every train has at most 100 stops
+  sjtu::map<hash_t, sjtu::vector<int>> stops_of_train;
+  for (size_t i = 0; i < stops.size(); i++) stops_of_train[stops[i].first.train_ID_hash].push_back(i);
+  for (auto it = stops_of_train.begin(); it != stops_of_train.end(); ++it) {
+    hash_t stations_hash[100];
+    uint16_t arrive_time_offsets[100], leave_time_offsets[100];
+    int station_num = 0;
+    const MinimalTrainRecord *record = nullptr;
+    uint16_t start_time = 0;
+    for (size_t k = 0; k < it->second.size(); k++) {
+      const auto &stop = stops[it->second[k]];
+      int id = stop.first.stop_id;
+      if (id + 1 > station_num) station_num = id + 1;
+      stations_hash[id] = stop.first.station_ID_hash;
+      if (stop.first.type == 0)
+        arrive_time_offsets[id] = stop.second.vis_time_offset;
+      else
+        leave_time_offsets[id] = stop.second.vis_time_offset;
+      record = &stop.second;
+      start_time = stop.first.startTime;
+    }
+    station_pair_index.AddTrain(it->first, station_num, stations_hash, arrive_time_offsets, leave_time_offsets,
+                                record->saleDate_beg + June_1st_2024, record->saleDate_end + June_1st_2024,
+                                start_time);
+  }
+  LOG->info("station pair index rebuilt, {} trains, {} pairs", stops_of_train.size(), station_pair_index.size());
+}
+#endif
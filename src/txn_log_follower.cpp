@@ -0,0 +1,83 @@
+#ifdef ENABLE_ADVANCED_FEATURE
+#include "txn_log_follower.h"
+#include <sys/stat.h>
+#include <exception>
+#include <utility>
+#include "basic_defs.h"
+#include "vector.hpp"
+
+TxnLogFollower::TxnLogFollower(TicketSystemEngine &engine_, TicketServer &server_, std::string log_file_path_,
+                               uint64_t checkpoint_lsn, size_t checkpoint_offset, Config config_)
+    : engine(engine_),
+      server(server_),
+      log_file_path(std::move(log_file_path_)),
+      config(config_),
+      log_offset(checkpoint_offset),
+      // the checkpoint record itself is applied too, it restores the online users
+      applied_lsn(checkpoint_lsn - 1) {
+  follower = std::thread(&TxnLogFollower::FollowerLoop, this);
+}
+
+TxnLogFollower::~TxnLogFollower() {
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    stop = true;
+  }
+  stop_cv.notify_all();
+  follower.join();
+}
+
+void TxnLogFollower::FollowerLoop() {
+  std::unique_lock<std::mutex> lock(latch);
+  while (!stop) {
+    lock.unlock();
+    bool keep_following = Poll();
+    lock.lock();
+    if (!keep_following) return;
+    stop_cv.wait_for(lock, config.poll_interval, [this] { return stop; });
+  }
+}
+
+bool TxnLogFollower::Poll() {
+  struct stat stat_buf;
+  if (stat(log_file_path.c_str(), &stat_buf) != 0 || (size_t)stat_buf.st_size < log_offset) {
+    LOG->error("the txn log {} of the primary is gone or shrunk, stop following it", log_file_path);
+    return false;
+  }
+  if ((size_t)stat_buf.st_size == log_offset) return true;
+  sjtu::vector<TxnLogger::Record> records;
+  bool continuous = true;
+  log_offset = TxnLogger::ReadLog(
+      log_file_path,
+      [&](const TxnLogger::Record &record) {
+        if (record.lsn <= applied_lsn || !continuous) return;
+        if (record.lsn != applied_lsn + records.size() + 1) {
+          continuous = false;
+          return;
+        }
+        records.push_back(record);
+      },
+      log_offset);
+  if (!records.empty()) {
+    bool applied = server.RunExclusive([&] {
+      try {
+        for (size_t i = 0; i < records.size(); i++) {
+          engine.ApplyLogRecord(records[i]);
+          applied_lsn = records[i].lsn;
+        }
+      } catch (const std::exception &e) {
+        LOG->error("failed to apply LSN {} of the primary: {}", applied_lsn + 1, e.what());
+        continuous = false;
+      }
+    });
+    if (!applied) return false;
+    LOG->debug("applied the txn log of the primary up to LSN {}", applied_lsn);
+  }
+  if (!continuous) {
+    LOG->error("the txn log {} of the primary does not continue from LSN {}, stop following it", log_file_path,
+               applied_lsn);
+    return false;
+  }
+  return true;
+}
+#endif  // ENABLE_ADVANCED_FEATURE
@@ -69,11 +69,11 @@ std::string TicketSystemEngine::AddUser(const std::string &command) {
     return response_stream.str();
   }
   hash_t current_user_username_hash = SplitMix64Hash(cur_username);
-  if (online_users.find(current_user_username_hash) == online_users.end()) {
+  if (!online_users.Contains(current_user_username_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
-  if (privilege >= online_users[current_user_username_hash]) {
+  if (privilege >= online_users.Privilege(current_user_username_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
@@ -123,7 +123,7 @@ std::string TicketSystemEngine::LoginUser(const std::string &command) {
   }
   hash_t user_name_hash = SplitMix64Hash(user_name);
   hash_t password_hash = SplitMix64Hash(password);
-  if (online_users.find(user_name_hash) != online_users.end()) {
+  if (online_users.Contains(user_name_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
@@ -138,7 +138,9 @@ std::string TicketSystemEngine::LoginUser(const std::string &command) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
-  online_users[user_name_hash] = dat.privilege;
+  online_users.Login(user_name_hash, dat);
+  // nobody reads the table concurrently here, the retired arrays and profiles can be freed at once
+  online_users.Reclaim();
   response_stream << '[' << command_id << "] 0";
   return response_stream.str();
 }
@@ -161,11 +163,15 @@ std::string TicketSystemEngine::LogoutUser(const std::string &command) {
     }
   }
   hash_t user_name_hash = SplitMix64Hash(user_name);
-  if (online_users.find(user_name_hash) == online_users.end()) {
+  if (!online_users.Contains(user_name_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
-  online_users.erase(user_name_hash);
+  int32_t order_count;
+  if (online_users.TakeDirtyOrderCount(user_name_hash, order_count))
+    transaction_manager.SetOrderCount(user_name_hash, order_count);
+  online_users.Logout(user_name_hash);
+  online_users.Reclaim();
   response_stream << '[' << command_id << "] 0";
   return response_stream.str();
 }
@@ -193,17 +199,18 @@ std::string TicketSystemEngine::QueryProfile(const std::string &command) {
   }
   hash_t current_user_name_hash = SplitMix64Hash(current_user_name);
   hash_t user_name_hash = SplitMix64Hash(user_name);
-  if (online_users.find(current_user_name_hash) == online_users.end()) {
+  if (!online_users.Contains(current_user_name_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
   FullUserData dat;
   LOG->debug("user_name_hash: {}", user_name_hash);
   LOG->debug("mailAddr: {}", dat.mailAddr);
+  // the profiles of online users are cached in the session table, only offline ones are read from the disk
   if (current_user_name_hash != user_name_hash) {
     try {
-      user_data.Get(user_name_hash, dat);
-      if (online_users[current_user_name_hash] <= dat.privilege) {
+      if (!online_users.GetProfile(user_name_hash, dat)) user_data.Get(user_name_hash, dat);
+      if (online_users.Privilege(current_user_name_hash) <= dat.privilege) {
         response_stream << '[' << command_id << "] -1";
         return response_stream.str();
       }
@@ -212,7 +219,7 @@ std::string TicketSystemEngine::QueryProfile(const std::string &command) {
       return response_stream.str();
     }
   } else {
-    user_data.Get(user_name_hash, dat);
+    online_users.GetProfile(user_name_hash, dat);
   }
   LOG->debug("mailAddr: {}", dat.mailAddr);
   response_stream << '[' << command_id << "] " << dat.username << ' ' << dat.name << ' ' << dat.mailAddr << ' '
@@ -262,15 +269,15 @@ std::string TicketSystemEngine::ModifyProfile(const std::string &command) {
   }
   hash_t current_user_name_hash = SplitMix64Hash(current_user_name);
   hash_t user_name_hash = SplitMix64Hash(user_name);
-  if (online_users.find(current_user_name_hash) == online_users.end()) {
+  if (!online_users.Contains(current_user_name_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
   FullUserData dat;
   if (current_user_name_hash != user_name_hash) {
     try {
-      user_data.Get(user_name_hash, dat);
-      if (online_users[current_user_name_hash] <= dat.privilege) {
+      if (!online_users.GetProfile(user_name_hash, dat)) user_data.Get(user_name_hash, dat);
+      if (online_users.Privilege(current_user_name_hash) <= dat.privilege) {
         response_stream << '[' << command_id << "] -1";
         return response_stream.str();
       }
@@ -279,9 +286,9 @@ std::string TicketSystemEngine::ModifyProfile(const std::string &command) {
       return response_stream.str();
     }
   } else {
-    user_data.Get(user_name_hash, dat);
+    online_users.GetProfile(user_name_hash, dat);
   }
-  if (privilege != 11 && privilege >= online_users[current_user_name_hash]) {
+  if (privilege != 11 && privilege >= online_users.Privilege(current_user_name_hash)) {
     response_stream << '[' << command_id << "] -1";
     return response_stream.str();
   }
@@ -297,7 +304,10 @@ std::string TicketSystemEngine::ModifyProfile(const std::string &command) {
   if (mailAddr != "") {
     strcpy(dat.mailAddr, mailAddr.c_str());
   }
+  // write through, the privilege of an online session stays the one it logged in with
   user_data.Put(user_name_hash, dat);
+  online_users.SetProfile(user_name_hash, dat);
+  online_users.Reclaim();
   response_stream << '[' << command_id << "] " << dat.username << ' ' << dat.name << ' ' << dat.mailAddr << ' '
                   << static_cast<int>(dat.privilege);
   return response_stream.str();
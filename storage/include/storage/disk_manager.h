@@ -1,8 +1,14 @@
 #ifndef DISK_MANAGER_H
 #define DISK_MANAGER_H
+#include <cstdint>
 #include <cstdio>
 #include <string>
 #include "storage/config.h"
+#include "vector.hpp"
+#ifdef ENABLE_ADVANCED_FEATURE
+#include <mutex>
+#include "map.hpp"
+#endif
 class DiskManager {
   /**
    * The Data Structure on Disk:
@@ -31,6 +37,41 @@ class DiskManager {
   void DeallocatePage(page_id_t page_id);
   size_t CurrentTotalPageCount();
   size_t CurrentNoneEmptyPageCount();
+#ifdef ENABLE_ADVANCED_FEATURE
+  /**
+   * @brief get the ids of the pages written since the dirty page tracking was last reset, in ascending order
+   * @details The internal page is page 0. The set is kept in a sidecar file <path>.dirty across runs. It is only
+   * trusted if the previous run closed the file properly, since the pages written after the last close are not in the
+   * sidecar. A file without a sidecar is untracked, unless it is created by this DiskManager.
+   * @return false if the tracking is not reliable, then the whole file has to be compared
+   */
+  bool DirtyPages(sjtu::vector<page_id_t> &pages);
+  /**
+   * @brief forget the dirty pages, call it when the file is known to match its last snapshot
+   * @param reliable false to mark the tracking unreliable instead, until the next reset
+   */
+  void ResetDirtyPages(bool reliable = true);
+  /**
+   * @brief reset the tracking of a closed file by rewriting (or, if unreliable, removing) its sidecar
+   */
+  static void ResetDirtyPages(const std::string &file_path, bool reliable);
+  /**
+   * @brief freeze the current content of the file for a snapshot, it only costs O(1)
+   * @details From now on, the first write to a page existing at this moment saves the old content of the page (its
+   * pre-image) into <path>.cow before overwriting it. So ReadFrozenPage keeps reading the file as of the freeze, even
+   * from another thread, while the file keeps being modified. At most one freeze is active at a time.
+   * @return the size of the file as of the freeze, in bytes
+   */
+  size_t FreezeForSnapShot();
+  /**
+   * @brief read a page as of the freeze, it is thread safe
+   */
+  void ReadFrozenPage(page_id_t page_id, char *page_data_ptr);
+  /**
+   * @brief end the freeze and drop the pre-images, it is thread safe
+   */
+  void ReleaseFrozen();
+#endif
 
  private:
   std::string file_path;
@@ -42,5 +83,24 @@ class DiskManager {
   FILE *fp;
   bool is_new;
   char *page_buf;
+#ifdef ENABLE_ADVANCED_FEATURE
+  sjtu::vector<uint64_t> dirty_bitmap;
+  bool dirty_tracking_reliable;
+  inline void MarkDirty(page_id_t page_id) {
+    if (page_id / 64 >= dirty_bitmap.size()) dirty_bitmap.resize(page_id / 64 + 1);
+    dirty_bitmap[page_id / 64] |= 1ull << (page_id % 64);
+  }
+  void LoadDirtyPages();
+  void SaveDirtyPages(bool reliable);
+  std::mutex io_latch;  // guards fp and the pre-images, since the frozen pages are read by another thread
+  FILE *cow_fp = nullptr;
+  size_t frozen_page_count = 0;
+  sjtu::map<page_id_t, size_t> preserved_pages;  // page id -> index of its pre-image in <path>.cow
+  char *preserve_buf;  // the pre-image being saved, apart from page_buf which may hold the data being written
+  /**
+   * @brief save the pre-image of a frozen page before its first overwrite, io_latch must be held
+   */
+  void PreservePageLocked(page_id_t page_id);
+#endif
 };
 #endif
\ No newline at end of file
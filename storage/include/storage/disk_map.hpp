@@ -71,6 +71,20 @@ class DiskMap : public DataDriverBase {
     data_bpm = nullptr;
     data_disk_manager = nullptr;
   }
+  /**
+   * @brief A record pinned and write latched in the buffer pool.
+   * @details Reading it through Get() leaves the page clean, Mut() marks the page dirty and changes are made directly
+   * on the page, no Put is needed. The page is released when the reference is destroyed.
+   */
+  class MutableRef {
+    WritePageGuard guard;
+    size_t offset;
+    friend class DiskMap;
+
+   public:
+    inline const Value &Get() { return *reinterpret_cast<const Value *>(guard.GetData() + offset); }
+    inline Value &Mut() { return *reinterpret_cast<Value *>(guard.GetDataMut() + offset); }
+  };
   bool HasKey(const Key &key) { return indexer->Get(key) != kInvalidValueIndex; }
   Value Get(const Key &key) {
     size_t data_id;
@@ -84,6 +98,30 @@ class DiskMap : public DataDriverBase {
     if ((data_id = indexer->Get(key)) == kInvalidValueIndex) throw std::runtime_error("Key not found");
     data_storage->read(res, data_id);
   }
+  /**
+   * @brief locate a record with a single index lookup and pin it for in-place access
+   * @throws std::runtime_error if the key does not exist
+   */
+  MutableRef GetMut(const Key &key) {
+    size_t data_id;
+    if ((data_id = indexer->Get(key)) == kInvalidValueIndex) throw std::runtime_error("Key not found");
+    MutableRef res;
+    res.offset = data_storage->fetch_mut(data_id, res.guard);
+    return res;
+  }
+  /**
+   * @brief call fn(Value &) on the record in place
+   * @return false if the key does not exist
+   */
+  template <typename Fn>
+  bool Modify(const Key &key, Fn &&fn) {
+    size_t data_id;
+    if ((data_id = indexer->Get(key)) == kInvalidValueIndex) return false;
+    WritePageGuard guard;
+    size_t offset = data_storage->fetch_mut(data_id, guard);
+    fn(*reinterpret_cast<Value *>(guard.GetDataMut() + offset));
+    return true;
+  }
   size_t size() { return indexer->Size(); }
   bool Remove(const Key &key) {
     b_plus_tree_value_index_t data_id;
@@ -1,5 +1,6 @@
 #ifndef SINGLE_VALUE_STORAGE_HPP
 #define SINGLE_VALUE_STORAGE_HPP
+#include <cstddef>
 #include <string>
 #include "storage/buffer_pool_manager.h"
 #include "storage/config.h"
@@ -108,6 +109,14 @@ class SingleValueStorage {
     guard.AsMut<Page>()->dat.elements[index % max_element_in_page].data = t;
   }
 
+  //以写锁取出位置索引index对应的T对象所在的页，返回该对象在页内的偏移，保证调用的index都是由write函数产生
+  size_t fetch_mut(const int index, WritePageGuard &guard) {
+    size_t frame_id = index / max_element_in_page;
+    guard = bpm->FetchPageWrite(frame_id);
+    return offsetof(DataType, elements) + (index % max_element_in_page) * sizeof(ElementPair) +
+           offsetof(ElementPair, data);
+  }
+
   //读出位置索引index对应的T对象的值并赋值给t，保证调用的index都是由write函数产生
   void read(T &t, const int index) {
     size_t frame_id = index / max_element_in_page;
@@ -0,0 +1,147 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A small work-stealing thread pool.
+ * @details Every worker owns a deque, it pops tasks from the back of its own deque and, when it runs dry, steals from
+ * the front of the others. Tasks submitted from outside the pool are spread round-robin. ParallelFor lets the calling
+ * thread help executing tasks while waiting, so it may be called from inside a task as well.
+ */
+class WorkStealingThreadPool {
+  struct WorkerQueue {
+    std::mutex latch;
+    std::deque<std::function<void()>> tasks;
+  };
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> queued_count{0};
+  std::atomic<size_t> next_queue{0};
+  std::mutex sleep_latch;
+  std::condition_variable sleep_cv;
+  bool stop = false;
+
+  inline static thread_local WorkStealingThreadPool *current_pool = nullptr;
+  inline static thread_local size_t current_worker = 0;
+
+  bool TryPop(size_t self, std::function<void()> &task) {
+    {
+      WorkerQueue &own = *queues[self];
+      std::lock_guard<std::mutex> guard(own.latch);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        queued_count--;
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+      WorkerQueue &victim = *queues[(self + i) % queues.size()];
+      std::lock_guard<std::mutex> guard(victim.latch);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        queued_count--;
+        return true;
+      }
+    }
+    return false;
+  }
+  void WorkerLoop(size_t self) {
+    current_pool = this;
+    current_worker = self;
+    std::function<void()> task;
+    while (true) {
+      if (TryPop(self, task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_latch);
+      sleep_cv.wait(lock, [this] { return stop || queued_count.load() > 0; });
+      if (stop && queued_count.load() == 0) return;
+    }
+  }
+
+ public:
+  explicit WorkStealingThreadPool(size_t worker_count = std::thread::hardware_concurrency()) {
+    worker_count = std::max<size_t>(worker_count, 1);
+    for (size_t i = 0; i < worker_count; i++) queues.emplace_back(new WorkerQueue);
+    for (size_t i = 0; i < worker_count; i++) workers.emplace_back(&WorkStealingThreadPool::WorkerLoop, this, i);
+  }
+  ~WorkStealingThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_latch);
+      stop = true;
+    }
+    sleep_cv.notify_all();
+    for (auto &worker : workers) worker.join();
+  }
+  WorkStealingThreadPool(const WorkStealingThreadPool &) = delete;
+  WorkStealingThreadPool &operator=(const WorkStealingThreadPool &) = delete;
+  inline size_t WorkerCount() const { return workers.size(); }
+
+  void Submit(std::function<void()> task) {
+    size_t target = current_pool == this ? current_worker : next_queue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> guard(queues[target]->latch);
+      queues[target]->tasks.push_back(std::move(task));
+      queued_count++;
+    }
+    { std::lock_guard<std::mutex> lock(sleep_latch); }
+    sleep_cv.notify_one();
+  }
+
+  /**
+   * @brief run fn(i) for every i in [begin, end), in chunks of `grain` indexes, and wait for all of them.
+   * @details The caller executes pending tasks itself while waiting, so there is no deadlock even if every worker is
+   * blocked in a nested ParallelFor. If fn throws, the rest of that chunk is skipped, the other chunks still run and
+   * the first exception is rethrown once all of them end, as the tasks refer to the stack of the caller.
+   */
+  template <typename Fn>
+  void ParallelFor(size_t begin, size_t end, size_t grain, Fn &&fn) {
+    if (begin >= end) return;
+    grain = std::max<size_t>(grain, 1);
+    if (end - begin <= grain) {
+      for (size_t i = begin; i < end; i++) fn(i);
+      return;
+    }
+    std::atomic<size_t> remaining{(end - begin + grain - 1) / grain};
+    std::mutex error_latch;
+    std::exception_ptr error;
+    for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += grain) {
+      size_t chunk_end = std::min(end, chunk_begin + grain);
+      Submit([&fn, &remaining, &error_latch, &error, chunk_begin, chunk_end] {
+        try {
+          for (size_t i = chunk_begin; i < chunk_end; i++) fn(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(error_latch);
+          if (!error) error = std::current_exception();
+        }
+        remaining--;
+      });
+    }
+    size_t self = current_pool == this ? current_worker : 0;
+    std::function<void()> task;
+    while (remaining.load() > 0) {
+      if (TryPop(self, task)) {
+        task();
+        task = nullptr;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    if (error) std::rethrow_exception(error);
+  }
+};
+#endif  // THREAD_POOL_HPP
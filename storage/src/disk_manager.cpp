@@ -21,6 +21,10 @@ DiskManager::DiskManager(const std::string &file_path_, bool renew)
     current_none_empty_page_count = 0;
     raw_data_memory = new char[kPageSize - meta_data_size];
     memset(raw_data_memory, 0, kPageSize - meta_data_size);
+#ifdef ENABLE_ADVANCED_FEATURE
+    // everything in a new file is written by this DiskManager, so it is tracked from the start
+    dirty_tracking_reliable = true;
+#endif
     FullyFlush();
     is_new = true;
   } else {
@@ -32,14 +36,25 @@ DiskManager::DiskManager(const std::string &file_path_, bool renew)
     raw_data_memory = new char[kPageSize - meta_data_size];
     fread(raw_data_memory, kPageSize - meta_data_size, 1, fp);
     is_new = false;
+#ifdef ENABLE_ADVANCED_FEATURE
+    LoadDirtyPages();
+#endif
   }
   page_buf = new char[kPageSize];
+#ifdef ENABLE_ADVANCED_FEATURE
+  preserve_buf = new char[kPageSize];
+  // until the file is closed properly, the sidecar on the disk misses the pages written from now on
+  SaveDirtyPages(false);
+#endif
 }
 
 DiskManager::~DiskManager() {
   Close();
   delete[] raw_data_memory;
   delete[] page_buf;
+#ifdef ENABLE_ADVANCED_FEATURE
+  delete[] preserve_buf;
+#endif
 }
 
 char *DiskManager::RawDataMemory() { return raw_data_memory; }
@@ -48,32 +63,55 @@ size_t DiskManager::RawDatMemorySize() { return kPageSize - meta_data_size; }
 
 void DiskManager::FullyFlush() {
   if (fp == nullptr) return;
+#ifdef ENABLE_ADVANCED_FEATURE
+  std::lock_guard<std::mutex> guard(io_latch);
+  PreservePageLocked(0);
+#endif
   fseek(fp, 0, SEEK_SET);
   fwrite(&first_empty_page_id, sizeof(page_id_t), 1, fp);
   fwrite(&current_total_page_count, sizeof(size_t), 1, fp);
   fwrite(&current_none_empty_page_count, sizeof(size_t), 1, fp);
   fwrite(raw_data_memory, kPageSize - meta_data_size, 1, fp);
   fflush(fp);
+#ifdef ENABLE_ADVANCED_FEATURE
+  MarkDirty(0);
+#endif
 }
 
 void DiskManager::Close() {
   if (fp != nullptr) {
     FullyFlush();
+#ifdef ENABLE_ADVANCED_FEATURE
+    ReleaseFrozen();
+#endif
     fclose(fp);
     fp = nullptr;
+#ifdef ENABLE_ADVANCED_FEATURE
+    SaveDirtyPages(dirty_tracking_reliable);
+#endif
   }
 }
 
 void DiskManager::ReadPage(page_id_t page_id, char *page_data_ptr) {
   if (fp == nullptr) return;
+#ifdef ENABLE_ADVANCED_FEATURE
+  std::lock_guard<std::mutex> guard(io_latch);
+#endif
   fseek(fp, page_id * kPageSize, SEEK_SET);
   fread(page_data_ptr, kPageSize, 1, fp);
 }
 
 void DiskManager::WritePage(page_id_t page_id, const char *page_data_ptr) {
   if (fp == nullptr) return;
+#ifdef ENABLE_ADVANCED_FEATURE
+  std::lock_guard<std::mutex> guard(io_latch);
+  PreservePageLocked(page_id);
+#endif
   fseek(fp, page_id * kPageSize, SEEK_SET);
   fwrite(page_data_ptr, kPageSize, 1, fp);
+#ifdef ENABLE_ADVANCED_FEATURE
+  MarkDirty(page_id);
+#endif
 }
 
 bool DiskManager::CurrentFileIsNew() { return is_new; }
@@ -84,8 +122,14 @@ page_id_t DiskManager::AllocNewEmptyPageId() {
     // No empty page available, append a new page
     current_total_page_count++;
     new_page_id = current_total_page_count;
+#ifdef ENABLE_ADVANCED_FEATURE
+    std::lock_guard<std::mutex> guard(io_latch);
+#endif
     fseek(fp, 0, SEEK_END);
     fwrite(page_buf, kPageSize, 1, fp);
+#ifdef ENABLE_ADVANCED_FEATURE
+    MarkDirty(new_page_id);
+#endif
   } else {
     new_page_id = first_empty_page_id;
     ReadPage(new_page_id, page_buf);
@@ -105,4 +149,116 @@ void DiskManager::DeallocatePage(page_id_t page_id) {
 
 size_t DiskManager::CurrentTotalPageCount() { return current_total_page_count; }
 
-size_t DiskManager::CurrentNoneEmptyPageCount() { return current_none_empty_page_count; }
\ No newline at end of file
+size_t DiskManager::CurrentNoneEmptyPageCount() { return current_none_empty_page_count; }
+#ifdef ENABLE_ADVANCED_FEATURE
+/**
+ * The sidecar <path>.dirty is [reliable: u8][word count: u64][bitmap words: u64 ...].
+ */
+void DiskManager::LoadDirtyPages() {
+  dirty_tracking_reliable = false;
+  dirty_bitmap.clear();
+  FILE *f = fopen((file_path + ".dirty").c_str(), "rb");
+  if (f == nullptr) return;
+  uint8_t reliable = 0;
+  uint64_t word_count = 0;
+  if (fread(&reliable, sizeof(reliable), 1, f) == 1 && fread(&word_count, sizeof(word_count), 1, f) == 1 &&
+      reliable == 1) {
+    dirty_bitmap.resize(word_count);
+    if (fread(dirty_bitmap.data(), sizeof(uint64_t), word_count, f) == word_count) {
+      dirty_tracking_reliable = true;
+    } else {
+      dirty_bitmap.clear();
+    }
+  }
+  fclose(f);
+}
+
+void DiskManager::SaveDirtyPages(bool reliable) {
+  FILE *f = fopen((file_path + ".dirty").c_str(), "wb");
+  if (f == nullptr) return;
+  uint8_t reliable_flag = reliable ? 1 : 0;
+  uint64_t word_count = reliable ? dirty_bitmap.size() : 0;
+  fwrite(&reliable_flag, sizeof(reliable_flag), 1, f);
+  fwrite(&word_count, sizeof(word_count), 1, f);
+  if (word_count > 0) fwrite(dirty_bitmap.data(), sizeof(uint64_t), word_count, f);
+  fclose(f);
+}
+
+bool DiskManager::DirtyPages(sjtu::vector<page_id_t> &pages) {
+  pages.clear();
+  if (!dirty_tracking_reliable) return false;
+  for (size_t i = 0; i < dirty_bitmap.size(); i++) {
+    for (uint64_t word = dirty_bitmap[i]; word != 0; word &= word - 1) {
+      pages.push_back(i * 64 + __builtin_ctzll(word));
+    }
+  }
+  return true;
+}
+
+void DiskManager::ResetDirtyPages(bool reliable) {
+  dirty_bitmap.clear();
+  dirty_tracking_reliable = reliable;
+}
+
+void DiskManager::ResetDirtyPages(const std::string &file_path, bool reliable) {
+  std::string sidecar = file_path + ".dirty";
+  if (!reliable) {
+    remove(sidecar.c_str());
+    return;
+  }
+  FILE *f = fopen(sidecar.c_str(), "wb");
+  if (f == nullptr) return;
+  uint8_t reliable_flag = 1;
+  uint64_t word_count = 0;
+  fwrite(&reliable_flag, sizeof(reliable_flag), 1, f);
+  fwrite(&word_count, sizeof(word_count), 1, f);
+  fclose(f);
+}
+
+size_t DiskManager::FreezeForSnapShot() {
+  std::lock_guard<std::mutex> guard(io_latch);
+  if (cow_fp != nullptr) throw std::runtime_error("the file is already frozen");
+  cow_fp = fopen((file_path + ".cow").c_str(), "w+b");
+  if (cow_fp == nullptr) throw std::runtime_error("failed to create " + file_path + ".cow");
+  fseek(fp, 0, SEEK_END);
+  size_t frozen_size = ftell(fp);
+  frozen_page_count = (frozen_size + kPageSize - 1) / kPageSize;
+  return frozen_size;
+}
+
+void DiskManager::PreservePageLocked(page_id_t page_id) {
+  if (cow_fp == nullptr || page_id >= frozen_page_count) return;
+  if (preserved_pages.find(page_id) != preserved_pages.end()) return;
+  memset(preserve_buf, 0, kPageSize);
+  fseek(fp, page_id * kPageSize, SEEK_SET);
+  fread(preserve_buf, 1, kPageSize, fp);
+  size_t index = preserved_pages.size();
+  fseek(cow_fp, index * kPageSize, SEEK_SET);
+  fwrite(preserve_buf, kPageSize, 1, cow_fp);
+  preserved_pages[page_id] = index;
+}
+
+void DiskManager::ReadFrozenPage(page_id_t page_id, char *page_data_ptr) {
+  std::lock_guard<std::mutex> guard(io_latch);
+  if (cow_fp == nullptr) throw std::runtime_error("the file is not frozen");
+  auto it = preserved_pages.find(page_id);
+  if (it != preserved_pages.end()) {
+    fseek(cow_fp, it->second * kPageSize, SEEK_SET);
+    fread(page_data_ptr, kPageSize, 1, cow_fp);
+    return;
+  }
+  memset(page_data_ptr, 0, kPageSize);
+  fseek(fp, page_id * kPageSize, SEEK_SET);
+  fread(page_data_ptr, 1, kPageSize, fp);
+}
+
+void DiskManager::ReleaseFrozen() {
+  std::lock_guard<std::mutex> guard(io_latch);
+  if (cow_fp == nullptr) return;
+  fclose(cow_fp);
+  cow_fp = nullptr;
+  remove((file_path + ".cow").c_str());
+  preserved_pages.clear();
+  frozen_page_count = 0;
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "storage/disk_map.hpp"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace disk_map_test {
+struct Record {
+  int id;
+  int value[50];
+};
+}  // namespace disk_map_test
+
+TEST(DiskMapTest, InPlaceModification) {
+  using disk_map_test::Record;
+  remove("/tmp/disk_map_test.idx");
+  remove("/tmp/disk_map_test.val");
+  const int n = 2000;
+  std::mt19937 rnd(20240601);
+  std::vector<int> expected(n);
+  {
+    DiskMap<int, Record> map("disk_map_test.idx", "/tmp/disk_map_test.idx", "disk_map_test.val",
+                             "/tmp/disk_map_test.val");
+    for (int i = 0; i < n; i++) {
+      Record record;
+      record.id = i;
+      for (int j = 0; j < 50; j++) record.value[j] = i;
+      expected[i] = i;
+      map.Put(i, record);
+    }
+    for (int round = 0; round < 10000; round++) {
+      int key = rnd() % n;
+      int delta = rnd() % 100;
+      if (round % 2 == 0) {
+        ASSERT_TRUE(map.Modify(key, [delta](Record &record) {
+          for (int j = 0; j < 50; j++) record.value[j] += delta;
+        }));
+      } else {
+        auto ref = map.GetMut(key);
+        ASSERT_EQ(ref.Get().id, key);
+        ASSERT_EQ(ref.Get().value[49], expected[key]);
+        for (int j = 0; j < 50; j++) ref.Mut().value[j] += delta;
+      }
+      expected[key] += delta;
+    }
+    ASSERT_FALSE(map.Modify(n, [](Record &) {}));
+    ASSERT_THROW(map.GetMut(n), std::runtime_error);
+  }
+  // the changes must survive reopening the files
+  DiskMap<int, Record> map("disk_map_test.idx", "/tmp/disk_map_test.idx", "disk_map_test.val",
+                           "/tmp/disk_map_test.val");
+  for (int i = 0; i < n; i++) {
+    Record record;
+    map.Get(i, record);
+    ASSERT_EQ(record.id, i);
+    for (int j = 0; j < 50; j++) ASSERT_EQ(record.value[j], expected[i]);
+  }
+}
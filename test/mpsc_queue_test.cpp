@@ -0,0 +1,38 @@
+#include "../src/include/mpsc_queue.hpp"
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(MpscQueueTest, SingleThreadFifo) {
+  MpscQueue<std::string> queue;
+  std::string value;
+  EXPECT_FALSE(queue.TryPop(value));
+  for (int i = 0; i < 100; i++) queue.Push(std::to_string(i));
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(queue.TryPop(value));
+    EXPECT_EQ(value, std::to_string(i));
+  }
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(MpscQueueTest, ManyProducers) {
+  const int kProducers = 8, kPerProducer = 50000;
+  MpscQueue<std::pair<int, int>> queue;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; p++) {
+    producers.emplace_back([&queue, p]() {
+      for (int i = 0; i < kPerProducer; i++) queue.Push({p, i});
+    });
+  }
+  // every element arrives once, and those of a producer arrive in its order
+  std::vector<int> next(kProducers, 0);
+  std::pair<int, int> value;
+  for (int received = 0; received < kProducers * kPerProducer; received++) {
+    queue.WaitPop(value);
+    ASSERT_EQ(value.second, next[value.first]);
+    next[value.first]++;
+  }
+  for (auto &producer : producers) producer.join();
+  EXPECT_FALSE(queue.TryPop(value));
+}
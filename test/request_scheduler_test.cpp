@@ -0,0 +1,74 @@
+#include "../src/include/request_scheduler.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+
+namespace {
+typedef RequestScheduler<int, 3> Scheduler;
+const std::chrono::steady_clock::time_point kStart;
+}  // namespace
+
+TEST(RequestSchedulerTest, WeightedShare) {
+  Scheduler::ClassConfig configs[3] = {{6, 1000, std::chrono::seconds(100)},
+                                      {3, 1000, std::chrono::seconds(100)},
+                                      {1, 1000, std::chrono::seconds(100)}};
+  Scheduler scheduler(configs);
+  for (int i = 0; i < 1000; i++) {
+    for (int c = 0; c < 3; c++) ASSERT_TRUE(scheduler.Push(c, c * 1000 + i, kStart));
+  }
+  int popped[3] = {0, 0, 0};
+  int job;
+  for (int i = 0; i < 1000; i++) {
+    int c = scheduler.Pop(0b111, job, kStart);
+    ASSERT_GE(c, 0);
+    // FIFO inside a class
+    ASSERT_EQ(job, c * 1000 + popped[c]);
+    popped[c]++;
+  }
+  EXPECT_EQ(popped[0], 600);
+  EXPECT_EQ(popped[1], 300);
+  EXPECT_EQ(popped[2], 100);
+  // a class outside the mask is never popped
+  while (scheduler.Pop(0b001, job, kStart) >= 0) continue;
+  EXPECT_EQ(scheduler.Depth(0), 0u);
+  EXPECT_EQ(scheduler.Depth(1), 700u);
+  EXPECT_EQ(scheduler.Pop(0b001, job, kStart), -1);
+}
+
+TEST(RequestSchedulerTest, RejectsBeyondDepth) {
+  Scheduler::ClassConfig configs[3] = {{1, 2, std::chrono::seconds(1)}, {1, 2, std::chrono::seconds(1)}, {}};
+  Scheduler scheduler(configs);
+  int job = 1;
+  EXPECT_TRUE(scheduler.Push(0, std::move(job), kStart));
+  job = 2;
+  EXPECT_TRUE(scheduler.Push(0, std::move(job), kStart));
+  job = 3;
+  EXPECT_FALSE(scheduler.Push(0, std::move(job), kStart));
+  EXPECT_EQ(job, 3);
+  EXPECT_TRUE(scheduler.Push(1, 4, kStart));
+  EXPECT_EQ(scheduler.GetStats(0).admitted, 2u);
+  EXPECT_EQ(scheduler.GetStats(0).rejected, 1u);
+}
+
+TEST(RequestSchedulerTest, OverdueFirst) {
+  Scheduler::ClassConfig configs[3] = {{100, 100, std::chrono::milliseconds(1)},
+                                      {1, 100, std::chrono::milliseconds(50)},
+                                      {1, 100, std::chrono::milliseconds(1000)}};
+  Scheduler scheduler(configs);
+  for (int i = 0; i < 10; i++) ASSERT_TRUE(scheduler.Push(0, int(i), kStart));
+  ASSERT_TRUE(scheduler.Push(1, 100, kStart));
+  ASSERT_TRUE(scheduler.Push(2, 200, kStart + std::chrono::milliseconds(10)));
+  int job;
+  // nothing is due yet, the weights favour class 0
+  EXPECT_EQ(scheduler.Pop(0b111, job, kStart), 0);
+  // class 1 is overdue although its weight is tiny, and it goes before the later deadlines of class 0
+  auto later = kStart + std::chrono::milliseconds(60);
+  EXPECT_EQ(scheduler.Pop(0b111, job, later), 0);
+  EXPECT_EQ(scheduler.Pop(0b110, job, later), 1);
+  EXPECT_EQ(job, 100);
+  const RequestClassStats &stats = scheduler.GetStats(1);
+  EXPECT_EQ(stats.dispatched, 1u);
+  EXPECT_EQ(stats.late, 1u);
+  EXPECT_EQ(stats.max_wait_us, 60000u);
+  EXPECT_GE(stats.WaitQuantile(0.99), 32768u);
+  EXPECT_LE(stats.WaitQuantile(0.99), 60000u);
+}
@@ -0,0 +1,53 @@
+#include "../src/include/seats_inventory.hpp"
+#include <gtest/gtest.h>
+#include <random>
+
+template <typename Inventory>
+void RandomRangeOperations(unsigned seed) {
+  std::mt19937 rnd(seed);
+  for (int round = 0; round < 200; round++) {
+    int segment_count = rnd() % 99 + 1;
+    int max_seats = rnd() % 100000 + 1;
+    Inventory inventory;
+    inventory.Init(segment_count, max_seats);
+    int expected[99];
+    for (int i = 0; i < segment_count; i++) expected[i] = max_seats;
+    ASSERT_EQ(inventory.max_seats, max_seats);
+    for (int op = 0; op < 500; op++) {
+      int l = rnd() % segment_count;
+      int r = l + 1 + rnd() % (segment_count - l);
+      int cur_min = expected[l];
+      for (int i = l + 1; i < r; i++) cur_min = std::min(cur_min, expected[i]);
+      ASSERT_EQ(inventory.RangeMin(l, r), cur_min);
+      // buy some seats, or give back some of the sold ones
+      int delta = rnd() % 2 == 0 ? -(int)(rnd() % (cur_min + 1)) : (int)(rnd() % (max_seats - cur_min + 1));
+      if (delta > 0) {
+        int cur_max = expected[l];
+        for (int i = l + 1; i < r; i++) cur_max = std::max(cur_max, expected[i]);
+        delta = std::min(delta, max_seats - cur_max);
+      }
+      inventory.RangeAdd(l, r, delta);
+      for (int i = l; i < r; i++) expected[i] += delta;
+    }
+    for (int i = 0; i < segment_count; i++) ASSERT_EQ(inventory.At(i), expected[i]);
+  }
+}
+
+TEST(SeatsInventoryTest, FlatMatchesNaive) { RandomRangeOperations<FlatSeatsInventory>(20240601); }
+
+TEST(SeatsInventoryTest, BlockedMatchesNaive) { RandomRangeOperations<BlockedSeatsInventory>(20240601); }
+
+TEST(SeatsInventoryTest, BlockedBoundaries) {
+  BlockedSeatsInventory inventory;
+  inventory.Init(99, 50);
+  inventory.RangeAdd(0, 99, -1);
+  inventory.RangeAdd(9, 11, -10);
+  inventory.RangeAdd(20, 30, -5);
+  EXPECT_EQ(inventory.RangeMin(0, 99), 39);
+  EXPECT_EQ(inventory.RangeMin(0, 9), 49);
+  EXPECT_EQ(inventory.RangeMin(11, 20), 49);
+  EXPECT_EQ(inventory.RangeMin(20, 30), 44);
+  EXPECT_EQ(inventory.RangeMin(98, 99), 49);
+  EXPECT_EQ(inventory.At(10), 39);
+  EXPECT_EQ(inventory.At(25), 44);
+}
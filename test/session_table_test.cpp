@@ -0,0 +1,121 @@
+#include "../src/include/session_table.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+TEST(SessionTableTest, MatchesStdMap) {
+  SessionTable table(16);
+  std::map<hash_t, int> expected;
+  std::mt19937_64 rnd(20240601);
+  std::vector<hash_t> users;
+  for (int i = 0; i < 5000; i++) users.push_back(rnd());
+  for (int round = 0; round < 200000; round++) {
+    hash_t user = users[rnd() % users.size()];
+    int op = rnd() % 4;
+    if (op == 0) {
+      FullUserData profile;
+      profile.privilege = rnd() % 11;
+      uint8_t privilege = profile.privilege;
+      bool online = expected.count(user) > 0;
+      ASSERT_EQ(table.Login(user, profile), !online);
+      if (!online) expected[user] = privilege;
+    } else if (op == 1) {
+      ASSERT_EQ(table.Logout(user), expected.erase(user) > 0);
+    } else if (op == 2) {
+      auto it = expected.find(user);
+      ASSERT_EQ(table.Privilege(user), it == expected.end() ? -1 : it->second);
+      ASSERT_EQ(table.Contains(user), it != expected.end());
+    } else {
+      int32_t order_count = rnd() % 1000;
+      table.SetOrderCount(user, order_count);
+      ASSERT_EQ(table.OrderCount(user),
+                expected.count(user) > 0 ? order_count : SessionTable::kUnknownOrderCount);
+    }
+    ASSERT_EQ(table.size(), expected.size());
+    if (round % 1000 == 0) table.Reclaim();
+  }
+}
+
+TEST(SessionTableTest, ReadersDuringGrowth) {
+  SessionTable table(16);
+  const int kPermanentUsers = 100;
+  FullUserData profile;
+  for (int i = 1; i <= kPermanentUsers; i++) {
+    profile.privilege = i % 11;
+    table.Login(i, profile);
+  }
+  std::atomic<bool> stop{false};
+  std::atomic<int> missing{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.emplace_back([&] {
+      while (!stop.load()) {
+        for (int i = 1; i <= kPermanentUsers; i++)
+          if (table.Privilege(i) != i % 11) missing++;
+      }
+    });
+  }
+  // the writer keeps growing the table while the readers look up users that never log out
+  profile.privilege = 0;
+  for (hash_t user = 1000; user < 200000; user++) table.Login(user, profile);
+  stop = true;
+  for (auto &reader : readers) reader.join();
+  EXPECT_EQ(missing.load(), 0);
+}
+
+TEST(SessionTableTest, ProfileWriteThrough) {
+  SessionTable table(16);
+  FullUserData profile;
+  strcpy(profile.username, "alice");
+  strcpy(profile.name, "Alice");
+  strcpy(profile.mailAddr, "alice@example.com");
+  profile.privilege = 5;
+  ASSERT_TRUE(table.Login(1, profile));
+  FullUserData cached;
+  ASSERT_TRUE(table.GetProfile(1, cached));
+  EXPECT_STREQ(cached.mailAddr, "alice@example.com");
+  // the session keeps the privilege it logged in with
+  profile.privilege = 9;
+  strcpy(profile.mailAddr, "alice@example.org");
+  table.SetProfile(1, profile);
+  ASSERT_TRUE(table.GetProfile(1, cached));
+  EXPECT_STREQ(cached.mailAddr, "alice@example.org");
+  EXPECT_EQ(cached.privilege, 9);
+  EXPECT_EQ(table.Privilege(1), 5);
+  // offline users are not cached
+  table.SetProfile(2, profile);
+  EXPECT_FALSE(table.GetProfile(2, cached));
+  ASSERT_TRUE(table.Logout(1));
+  EXPECT_FALSE(table.GetProfile(1, cached));
+  table.Reclaim();
+}
+
+TEST(SessionTableTest, DirtyOrderCounts) {
+  SessionTable table(16);
+  FullUserData profile;
+  profile.privilege = 1;
+  for (hash_t user = 1; user <= 100; user++) table.Login(user, profile);
+  table.CacheOrderCount(1, 7);
+  int32_t order_count;
+  EXPECT_EQ(table.OrderCount(1), 7);
+  EXPECT_FALSE(table.TakeDirtyOrderCount(1, order_count));
+  table.SetOrderCount(1, 8);
+  ASSERT_TRUE(table.TakeDirtyOrderCount(1, order_count));
+  EXPECT_EQ(order_count, 8);
+  EXPECT_FALSE(table.TakeDirtyOrderCount(1, order_count));
+  for (hash_t user = 2; user <= 100; user += 2) table.SetOrderCount(user, user * 3);
+  // the dirty flags survive growing
+  for (hash_t user = 101; user <= 1000; user++) table.Login(user, profile);
+  std::map<hash_t, int32_t> written_back;
+  table.ForEachDirtyOrderCount([&](hash_t user, int32_t count) { written_back[user] = count; });
+  ASSERT_EQ(written_back.size(), 50);
+  for (auto &entry : written_back) EXPECT_EQ(entry.second, entry.first * 3);
+  written_back.clear();
+  table.ForEachDirtyOrderCount([&](hash_t user, int32_t count) { written_back[user] = count; });
+  EXPECT_TRUE(written_back.empty());
+  table.Reclaim();
+}
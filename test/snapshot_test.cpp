@@ -5,6 +5,8 @@
 #include <spdlog/spdlog.h>
 #include <algorithm>
 #include <deque>
+#include <fstream>
+#include <iterator>
 #include <map>
 #include <random>
 #include <set>
@@ -252,4 +254,487 @@ TEST(Basic, T2) {
     snap_shot_manager.SetMetaFile("/tmp/T2/meta.dat");
     for (int i = 0; i < 100; i += 10) EXPECT_EQ(disk_map.Get(i), i + 4);
   }
-}
\ No newline at end of file
+}
+TEST(Basic, StageAndRestore) {
+  mkdir("/tmp/Stage", 0700);
+  remove("/tmp/Stage/index.db");
+  remove("/tmp/Stage/data.db");
+  remove("/tmp/Stage/stage.meta");
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/Stage/index.db", "data", "/tmp/Stage/data.db");
+    SnapShotManager snap_shot_manager;
+    sjtu::vector<DataDriverBase *> drivers;
+    drivers.push_back(&disk_map);
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.SetStageMetaFile("/tmp/Stage/stage.meta");
+    uint64_t lsn;
+    EXPECT_FALSE(snap_shot_manager.HasStage(lsn));
+    for (int i = 0; i < 10000; i++) disk_map.Put(i, i);
+    disk_map.Flush();
+    snap_shot_manager.Stage(10);
+    for (int i = 0; i < 10000; i++) {
+      int tmp = i + 1;
+      disk_map.Put(i, tmp);
+    }
+    disk_map.Flush();
+    snap_shot_manager.Stage(20);
+    ASSERT_TRUE(snap_shot_manager.HasStage(lsn));
+    EXPECT_EQ(lsn, 20);
+    // the changes after the last stage are lost by the restore
+    for (int i = 0; i < 10000; i++) {
+      int tmp = i + 2;
+      disk_map.Put(i, tmp);
+    }
+    EXPECT_EQ(snap_shot_manager.RestoreStage(), 20);
+  }
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/Stage/index.db", "data", "/tmp/Stage/data.db");
+    for (int i = 0; i < 10000; i++) EXPECT_EQ(disk_map.Get(i), i + 1);
+  }
+}
+
+TEST(Basic, DirtyPageDiff) {
+  mkdir("/tmp/DirtyPage", 0700);
+  const std::string path = "/tmp/DirtyPage/pages.db";
+  remove(path.c_str());
+  remove((path + ".dirty").c_str());
+  char page[4096];
+  {
+    DiskManager disk_manager(path);
+    for (int i = 0; i < 64; i++) {
+      page_id_t page_id = disk_manager.AllocNewEmptyPageId();
+      memset(page, i, sizeof(page));
+      disk_manager.WritePage(page_id, page);
+    }
+    disk_manager.FullyFlush();
+    CopyFile(path, path + ".frontier");
+    disk_manager.ResetDirtyPages();
+  }
+  {
+    DiskManager disk_manager(path);
+    sjtu::vector<page_id_t> pages;
+    ASSERT_TRUE(disk_manager.DirtyPages(pages));
+    // closing the file rewrites the internal page
+    ASSERT_EQ(pages.size(), 1);
+    EXPECT_EQ(pages[0], 0);
+    memset(page, 0xAB, 100);
+    disk_manager.WritePage(40, page);
+    disk_manager.WritePage(7, page);
+    page_id_t new_page_id = disk_manager.AllocNewEmptyPageId();
+    memset(page, 0xCD, sizeof(page));
+    disk_manager.WritePage(new_page_id, page);
+  }
+  {
+    DiskManager disk_manager(path);
+    sjtu::vector<page_id_t> pages;
+    ASSERT_TRUE(disk_manager.DirtyPages(pages));
+    // the pages written before the previous close are still known, page 0 is rewritten on every flush
+    ASSERT_EQ(pages.size(), 4);
+    EXPECT_EQ(pages[0], 0);
+    EXPECT_EQ(pages[1], 7);
+    EXPECT_EQ(pages[2], 40);
+    EXPECT_EQ(pages[3], 65);
+    // a copy taken while the file is open looks like a crash, the tracking of it is not trusted
+    disk_manager.FullyFlush();
+    CopyFile(path, "/tmp/DirtyPage/crashed.db");
+    CopyFile(path + ".dirty", "/tmp/DirtyPage/crashed.db.dirty");
+    {
+      DiskManager crashed("/tmp/DirtyPage/crashed.db");
+      EXPECT_FALSE(crashed.DirtyPages(pages));
+    }
+    ASSERT_TRUE(disk_manager.DirtyPages(pages));
+    GeneratePageDiff(path + ".frontier", path, pages, "/tmp/DirtyPage/page.diff");
+  }
+  // the page diff is as good as a diff of the whole file
+  ApplyPatch(path + ".frontier", "/tmp/DirtyPage/page.diff", "/tmp/DirtyPage/patched.db", false);
+  auto read_all = [](const std::string &file) {
+    std::ifstream in(file, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  };
+  std::string current = read_all(path);
+  EXPECT_EQ(read_all("/tmp/DirtyPage/patched.db"), current);
+  ApplyPatch(path, "/tmp/DirtyPage/page.diff", "/tmp/DirtyPage/reverted.db", true);
+  EXPECT_EQ(read_all("/tmp/DirtyPage/reverted.db"), read_all(path + ".frontier"));
+  sjtu::vector<page_id_t> pages;
+  pages.push_back(0);
+  pages.push_back(7);
+  pages.push_back(40);
+  UpdateFrontier(path + ".frontier", path, pages);
+  EXPECT_EQ(read_all(path + ".frontier"), current);
+}
+
+TEST(Basic, FrozenPages) {
+  const std::string path = "/tmp/DirtyPage/frozen.db";
+  remove(path.c_str());
+  char page[4096], read_back[4096];
+  DiskManager disk_manager(path);
+  page_id_t page_id = disk_manager.AllocNewEmptyPageId();
+  memset(page, 1, sizeof(page));
+  disk_manager.WritePage(page_id, page);
+  size_t frozen_size = disk_manager.FreezeForSnapShot();
+  EXPECT_EQ(frozen_size, 2 * sizeof(page));
+  memset(page, 2, sizeof(page));
+  disk_manager.WritePage(page_id, page);
+  disk_manager.WritePage(page_id, page);
+  disk_manager.AllocNewEmptyPageId();
+  disk_manager.ReadFrozenPage(page_id, read_back);
+  EXPECT_EQ(read_back[0], 1);
+  EXPECT_EQ(read_back[4095], 1);
+  disk_manager.ReadPage(page_id, read_back);
+  EXPECT_EQ(read_back[0], 2);
+  disk_manager.ReleaseFrozen();
+  EXPECT_EQ(access((path + ".cow").c_str(), F_OK), -1);
+}
+
+TEST(Basic, FrozenDeallocate) {
+  mkdir("/tmp/DirtyPage", 0700);
+  {
+    // every page starts with the id of a live page, like the sibling link of a B+ tree leaf
+    const std::string path = "/tmp/DirtyPage/dealloc.db";
+    remove(path.c_str());
+    DiskManager disk_manager(path);
+    char page[4096], read_back[4096];
+    for (int i = 0; i < 8; i++) {
+      page_id_t page_id = disk_manager.AllocNewEmptyPageId();
+      page_id_t live_page = 1;
+      memset(page, i + 1, sizeof(page));
+      memcpy(page, &live_page, sizeof(live_page));
+      disk_manager.WritePage(page_id, page);
+    }
+    disk_manager.FreezeForSnapShot();
+    disk_manager.DeallocatePage(5);
+    disk_manager.DeallocatePage(6);
+    disk_manager.DeallocatePage(7);
+    EXPECT_EQ(disk_manager.AllocNewEmptyPageId(), 7);
+    EXPECT_EQ(disk_manager.AllocNewEmptyPageId(), 6);
+    EXPECT_EQ(disk_manager.AllocNewEmptyPageId(), 5);
+    EXPECT_EQ(disk_manager.AllocNewEmptyPageId(), 9);
+    for (page_id_t page_id = 5; page_id <= 7; page_id++) {
+      disk_manager.ReadFrozenPage(page_id, read_back);
+      EXPECT_EQ(read_back[4095], (char)page_id);
+    }
+    disk_manager.ReleaseFrozen();
+  }
+  remove("/tmp/DirtyPage/dealloc_index.db");
+  remove("/tmp/DirtyPage/dealloc_data.db");
+  const int kKeys = 20000;
+  DiskMap<int, int> disk_map("index", "/tmp/DirtyPage/dealloc_index.db", "data", "/tmp/DirtyPage/dealloc_data.db");
+  for (int i = 0; i < kKeys; i++) disk_map.Put(i, i);
+  disk_map.Flush();
+  sjtu::vector<DataDriverBase::FileEntry> files = disk_map.ListFiles();
+  sjtu::vector<std::string> frozen_images;
+  for (size_t i = 0; i < files.size(); i++) {
+    files[i].disk_manager->FreezeForSnapShot();
+    std::ifstream fin(files[i].path, std::ios::binary);
+    frozen_images.push_back(std::string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>()));
+  }
+  // the removals free pages of the B+ tree while the files are frozen, then the insertions reuse them
+  for (int i = 0; i < kKeys; i++) {
+    if (i % 10 != 0) disk_map.Remove(i);
+  }
+  disk_map.Flush();
+  size_t page_count = files[0].disk_manager->CurrentTotalPageCount();
+  for (int i = kKeys; i < 2 * kKeys; i++) {
+    int value = -i;
+    disk_map.Put(i, value);
+  }
+  disk_map.Flush();
+  EXPECT_LE(files[0].disk_manager->CurrentTotalPageCount(), 2 * page_count);
+  int value;
+  for (int i = 0; i < kKeys; i += 10) {
+    disk_map.Get(i, value);
+    ASSERT_EQ(value, i);
+  }
+  for (int i = kKeys; i < 2 * kKeys; i++) {
+    disk_map.Get(i, value);
+    ASSERT_EQ(value, -i);
+  }
+  EXPECT_EQ(disk_map.size(), (size_t)(kKeys / 10 + kKeys));
+  for (size_t i = 0; i < files.size(); i++) {
+    const std::string &image = frozen_images[i];
+    char page[4096];
+    for (size_t page_id = 0; page_id * sizeof(page) < image.size(); page_id++) {
+      files[i].disk_manager->ReadFrozenPage(page_id, page);
+      size_t len = std::min(sizeof(page), image.size() - page_id * sizeof(page));
+      ASSERT_EQ(memcmp(page, image.data() + page_id * sizeof(page), len), 0) << files[i].path << " page " << page_id;
+    }
+    files[i].disk_manager->ReleaseFrozen();
+  }
+}
+
+TEST(Basic, SnapShotWhileWriting) {
+  mkdir("/tmp/CowSnap", 0700);
+  remove("/tmp/CowSnap/index.db");
+  remove("/tmp/CowSnap/data.db");
+  remove("/tmp/CowSnap/meta.dat");
+  const int kKeys = 50000;
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/CowSnap/index.db", "data", "/tmp/CowSnap/data.db");
+    SnapShotManager snap_shot_manager;
+    sjtu::vector<DataDriverBase *> drivers;
+    drivers.push_back(&disk_map);
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.SetMetaFile("/tmp/CowSnap/meta.dat");
+    for (int i = 0; i < kKeys; i++) disk_map.Put(i, i);
+    snap_shot_manager.CreateSnapShot("snap1");
+    // keep writing while the diffs of snap1 are written in the background
+    for (int i = 0; i < kKeys; i += 3) {
+      int tmp = -i;
+      disk_map.Put(i, tmp);
+    }
+    disk_map.Flush();
+    snap_shot_manager.CreateSnapShot("snap2");
+    snap_shot_manager.WaitForPendingSnapShot();
+    snap_shot_manager.SwitchToSnapShot("snap1");
+    snap_shot_manager.CheckOutFrontier();
+  }
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/CowSnap/index.db", "data", "/tmp/CowSnap/data.db");
+    SnapShotManager snap_shot_manager;
+    sjtu::vector<DataDriverBase *> drivers;
+    drivers.push_back(&disk_map);
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.SetMetaFile("/tmp/CowSnap/meta.dat");
+    for (int i = 0; i < kKeys; i++) ASSERT_EQ(disk_map.Get(i), i);
+    snap_shot_manager.SwitchToSnapShot("snap2");
+    snap_shot_manager.CheckOutFrontier();
+  }
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/CowSnap/index.db", "data", "/tmp/CowSnap/data.db");
+    for (int i = 0; i < kKeys; i++) ASSERT_EQ(disk_map.Get(i), i % 3 == 0 ? -i : i);
+  }
+}
+
+TEST(Basic, StreamingCompression) {
+  mkdir("/tmp/Stream", 0700);
+  std::mt19937 rnd(42);
+  std::string old_content(3 << 20, '\0'), new_content;
+  for (auto &c : old_content) c = rnd() % 4;
+  new_content = old_content;
+  // a run of changes longer than one segment, a few scattered changes and a longer tail
+  for (size_t i = 100; i < (5 << 19); i++) new_content[i] ^= 0x5A;
+  for (int i = 0; i < 100; i++) new_content[rnd() % new_content.size()] ^= 1;
+  new_content += std::string(12345, 'x');
+  auto write_all = [](const std::string &file, const std::string &content) {
+    std::ofstream out(file, std::ios::binary);
+    out.write(content.data(), content.size());
+  };
+  auto read_all = [](const std::string &file) {
+    std::ifstream in(file, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  };
+  write_all("/tmp/Stream/old", old_content);
+  write_all("/tmp/Stream/new", new_content);
+  DiffCompressionConfig configs[3];
+  configs[0].workers = 0;
+  configs[1].workers = 2;
+  configs[1].level = 3;
+  configs[2].window_log = 20;
+  configs[2].long_distance_matching = true;
+  for (const auto &config : configs) {
+    GenerateDiff("/tmp/Stream/old", "/tmp/Stream/new", "/tmp/Stream/diff", config);
+    ApplyPatch("/tmp/Stream/old", "/tmp/Stream/diff", "/tmp/Stream/patched", false);
+    EXPECT_EQ(read_all("/tmp/Stream/patched"), new_content);
+    ApplyPatch("/tmp/Stream/new", "/tmp/Stream/diff", "/tmp/Stream/reverted", true);
+    EXPECT_EQ(read_all("/tmp/Stream/reverted"), old_content);
+  }
+}
+
+TEST(Basic, KeyFrames) {
+  mkdir("/tmp/KeyFrame", 0700);
+  remove("/tmp/KeyFrame/index.db");
+  remove("/tmp/KeyFrame/data.db");
+  remove("/tmp/KeyFrame/meta.dat");
+  const int kSnapShots = 20, kKeys = 2000;
+  for (int t = 0; t < kSnapShots; t++) {
+    remove(("/tmp/KeyFrame/index.db.s" + std::to_string(t) + ".key").c_str());
+    remove(("/tmp/KeyFrame/data.db.s" + std::to_string(t) + ".key").c_str());
+  }
+  std::vector<std::map<int, int>> states;
+  std::map<int, int> state;
+  // checks out snap_shot_ID, then runs fn on the reopened map
+  auto with_snap_shot = [](const std::string &snap_shot_ID, const std::function<void(DiskMap<int, int> &)> &fn) {
+    {
+      DiskMap<int, int> disk_map("index", "/tmp/KeyFrame/index.db", "data", "/tmp/KeyFrame/data.db");
+      SnapShotManager snap_shot_manager;
+      sjtu::vector<DataDriverBase *> drivers;
+      drivers.push_back(&disk_map);
+      snap_shot_manager.Connect(drivers);
+      snap_shot_manager.SetKeyFrameInterval(4);
+      snap_shot_manager.SetMetaFile("/tmp/KeyFrame/meta.dat");
+      snap_shot_manager.SwitchToSnapShot(snap_shot_ID);
+      snap_shot_manager.CheckOutFrontier();
+    }
+    DiskMap<int, int> disk_map("index", "/tmp/KeyFrame/index.db", "data", "/tmp/KeyFrame/data.db");
+    fn(disk_map);
+  };
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/KeyFrame/index.db", "data", "/tmp/KeyFrame/data.db");
+    SnapShotManager snap_shot_manager;
+    sjtu::vector<DataDriverBase *> drivers;
+    drivers.push_back(&disk_map);
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.SetKeyFrameInterval(4);
+    snap_shot_manager.SetMetaFile("/tmp/KeyFrame/meta.dat");
+    for (int t = 0; t < kSnapShots; t++) {
+      for (int i = 0; i < kKeys; i++) {
+        if (t > 0 && (i * 7 + t) % 10 != 0) continue;
+        int value = i * 100 + t;
+        disk_map.Put(i, value);
+        state[i] = value;
+      }
+      snap_shot_manager.CreateSnapShot("s" + std::to_string(t));
+      states.push_back(state);
+    }
+    snap_shot_manager.WaitForPendingSnapShot();
+  }
+  // the chain s0 -> ... -> s19 gets a keyframe at every 4th snapshot
+  for (int t = 0; t < kSnapShots; t++) {
+    EXPECT_EQ(access(("/tmp/KeyFrame/data.db.s" + std::to_string(t) + ".key").c_str(), F_OK) == 0, (t + 1) % 4 == 0);
+  }
+  auto expect_state = [&](int t) {
+    return [&, t](DiskMap<int, int> &disk_map) {
+      for (auto &[key, value] : states[t]) ASSERT_EQ(disk_map.Get(key), value) << "at s" << t;
+    };
+  };
+  with_snap_shot("s1", expect_state(1));
+  with_snap_shot("s17", expect_state(17));
+  with_snap_shot("s9", expect_state(9));
+  {
+    DiskMap<int, int> disk_map("index", "/tmp/KeyFrame/index.db", "data", "/tmp/KeyFrame/data.db");
+    SnapShotManager snap_shot_manager;
+    sjtu::vector<DataDriverBase *> drivers;
+    drivers.push_back(&disk_map);
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.SetMetaFile("/tmp/KeyFrame/meta.dat");
+    // s11 passes its keyframe on to its son s12
+    snap_shot_manager.SwitchToSnapShot("s19");
+    snap_shot_manager.RemoveSnapShot("s11");
+  }
+  EXPECT_EQ(access("/tmp/KeyFrame/data.db.s11.key", F_OK), -1);
+  EXPECT_EQ(access("/tmp/KeyFrame/data.db.s12.key", F_OK), 0);
+  with_snap_shot("s12", expect_state(12));
+  with_snap_shot("s0", expect_state(0));
+}
+
+TEST(Basic, ParallelFiles) {
+  mkdir("/tmp/ParallelSnap", 0700);
+  const int kMaps = 3, kKeys = 5000;
+  auto index_file = [](int m) { return "/tmp/ParallelSnap/index" + std::to_string(m) + ".db"; };
+  auto data_file = [](int m) { return "/tmp/ParallelSnap/data" + std::to_string(m) + ".db"; };
+  for (int m = 0; m < kMaps; m++) {
+    remove(index_file(m).c_str());
+    remove(data_file(m).c_str());
+  }
+  remove("/tmp/ParallelSnap/meta.dat");
+  // runs fn on the maps connected to a snapshot manager
+  auto with_maps = [&](const std::function<void(std::vector<std::unique_ptr<DiskMap<int, int>>> &,
+                                                SnapShotManager &)> &fn) {
+    std::vector<std::unique_ptr<DiskMap<int, int>>> maps;
+    sjtu::vector<DataDriverBase *> drivers;
+    for (int m = 0; m < kMaps; m++) {
+      maps.emplace_back(new DiskMap<int, int>("index", index_file(m), "data", data_file(m)));
+      drivers.push_back(maps.back().get());
+    }
+    SnapShotManager snap_shot_manager;
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.SetConcurrency(3);
+    snap_shot_manager.SetMetaFile("/tmp/ParallelSnap/meta.dat");
+    fn(maps, snap_shot_manager);
+  };
+  with_maps([&](auto &maps, SnapShotManager &snap_shot_manager) {
+    for (int m = 0; m < kMaps; m++) {
+      for (int i = 0; i < kKeys; i++) {
+        int value = i * kMaps + m;
+        maps[m]->Put(i, value);
+      }
+    }
+    snap_shot_manager.CreateSnapShot("snap1");
+    for (int m = 0; m < kMaps; m++) {
+      for (int i = 0; i < kKeys; i += 2) {
+        int value = -1;
+        maps[m]->Put(i, value);
+      }
+    }
+    snap_shot_manager.CreateSnapShot("snap2");
+    snap_shot_manager.SwitchToSnapShot("snap1");
+    snap_shot_manager.CheckOutFrontier();
+  });
+  EXPECT_EQ(access("/tmp/ParallelSnap/meta.dat.tmp", F_OK), -1);
+  with_maps([&](auto &maps, SnapShotManager &) {
+    for (int m = 0; m < kMaps; m++) {
+      for (int i = 0; i < kKeys; i++) ASSERT_EQ(maps[m]->Get(i), i * kMaps + m);
+    }
+  });
+}
+
+TEST(Basic, PageStore) {
+  mkdir("/tmp/PageSnap", 0700);
+  remove("/tmp/PageSnap/index.db");
+  remove("/tmp/PageSnap/data.db");
+  remove("/tmp/PageSnap/meta.dat");
+  remove("/tmp/PageSnap/meta.dat.pages/index");
+  remove("/tmp/PageSnap/meta.dat.pages/pack");
+  const int kKeys = 5000, kSameSnapShots = 100;
+  // runs fn on the map connected to a snapshot manager
+  auto with_map = [](const std::function<void(DiskMap<int, int> &, SnapShotManager &)> &fn) {
+    DiskMap<int, int> disk_map("index", "/tmp/PageSnap/index.db", "data", "/tmp/PageSnap/data.db");
+    SnapShotManager snap_shot_manager;
+    sjtu::vector<DataDriverBase *> drivers;
+    drivers.push_back(&disk_map);
+    snap_shot_manager.Connect(drivers);
+    snap_shot_manager.EnablePageStore();
+    snap_shot_manager.SetMetaFile("/tmp/PageSnap/meta.dat");
+    fn(disk_map, snap_shot_manager);
+  };
+  auto stored_pages = [] { return PageStore("/tmp/PageSnap/meta.dat.pages").size(); };
+  auto check_out = [&](const std::string &snap_shot_ID, int modified) {
+    with_map([&](DiskMap<int, int> &, SnapShotManager &snap_shot_manager) {
+      snap_shot_manager.SwitchToSnapShot(snap_shot_ID);
+      snap_shot_manager.CheckOutFrontier();
+    });
+    with_map([&](DiskMap<int, int> &disk_map, SnapShotManager &) {
+      for (int i = 0; i < kKeys; i++) ASSERT_EQ(disk_map.Get(i), i < modified ? -i : i) << "at " << snap_shot_ID;
+    });
+  };
+  with_map([&](DiskMap<int, int> &disk_map, SnapShotManager &snap_shot_manager) {
+    for (int i = 0; i < kKeys; i++) {
+      int value = i;
+      disk_map.Put(i, value);
+    }
+    snap_shot_manager.CreateSnapShot("s0");
+  });
+  size_t base_pages = stored_pages();
+  EXPECT_GT(base_pages, 0);
+  // snapshots of an unchanged state only add manifests
+  with_map([&](DiskMap<int, int> &, SnapShotManager &snap_shot_manager) {
+    for (int t = 0; t < kSameSnapShots; t++) snap_shot_manager.CreateSnapShot("same" + std::to_string(t));
+  });
+  EXPECT_EQ(stored_pages(), base_pages);
+  with_map([&](DiskMap<int, int> &disk_map, SnapShotManager &snap_shot_manager) {
+    for (int i = 0; i < 100; i++) {
+      int value = -i;
+      disk_map.Put(i, value);
+    }
+    snap_shot_manager.CreateSnapShot("s1");
+  });
+  EXPECT_GT(stored_pages(), base_pages);
+  check_out("s0", 0);
+  check_out("same57", 0);
+  check_out("s1", 100);
+  with_map([&](DiskMap<int, int> &, SnapShotManager &snap_shot_manager) {
+    snap_shot_manager.SwitchToSnapShot("INIT");
+    snap_shot_manager.CheckOutFrontier();
+  });
+  with_map([&](DiskMap<int, int> &disk_map, SnapShotManager &) { EXPECT_EQ(disk_map.size(), 0); });
+  check_out("same99", 0);
+  // the pages only s1 refers to are dropped with it
+  with_map([](DiskMap<int, int> &, SnapShotManager &snap_shot_manager) { snap_shot_manager.RemoveSnapShot("s1"); });
+  EXPECT_EQ(access("/tmp/PageSnap/data.db.s1.manifest", F_OK), -1);
+  EXPECT_EQ(stored_pages(), base_pages);
+  with_map([](DiskMap<int, int> &, SnapShotManager &snap_shot_manager) {
+    snap_shot_manager.RemoveSnapShot("same10");
+    EXPECT_THROW(snap_shot_manager.SwitchToSnapShot("s1"), std::runtime_error);
+  });
+  check_out("same11", 0);
+}
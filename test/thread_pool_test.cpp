@@ -0,0 +1,47 @@
+#include "storage/thread_pool.hpp"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+TEST(ThreadPoolTest, ParallelForVisitsEveryIndexOnce) {
+  WorkStealingThreadPool pool(4);
+  const size_t n = 100000;
+  std::vector<int> visited(n, 0);
+  pool.ParallelFor(0, n, 7, [&](size_t i) { visited[i]++; });
+  for (size_t i = 0; i < n; i++) ASSERT_EQ(visited[i], 1);
+}
+
+TEST(ThreadPoolTest, NestedParallelFor) {
+  WorkStealingThreadPool pool(3);
+  std::atomic<long long> sum{0};
+  pool.ParallelFor(0, 64, 1, [&](size_t i) {
+    pool.ParallelFor(0, 1000, 16, [&](size_t j) { sum += i * 1000 + j; });
+  });
+  long long expected = 0;
+  for (long long i = 0; i < 64 * 1000; i++) expected += i;
+  ASSERT_EQ(sum.load(), expected);
+}
+
+TEST(ThreadPoolTest, SingleWorker) {
+  WorkStealingThreadPool pool(1);
+  std::atomic<int> count{0};
+  for (int round = 0; round < 100; round++) pool.ParallelFor(0, 50, 3, [&](size_t) { count++; });
+  ASSERT_EQ(count.load(), 5000);
+}
+
+TEST(ThreadPoolTest, ExceptionIsRethrownAfterAllChunks) {
+  WorkStealingThreadPool pool(4);
+  std::atomic<int> visited{0};
+  // the chunks starting at a multiple of 100 throw at once, the other 90 chunks of 10 run to the end
+  EXPECT_THROW(pool.ParallelFor(0, 1000, 10,
+                                [&](size_t i) {
+                                  visited++;
+                                  if (i % 100 == 0) throw std::runtime_error("chunk failed");
+                                }),
+               std::runtime_error);
+  EXPECT_EQ(visited.load(), 910);
+  std::atomic<int> count{0};
+  pool.ParallelFor(0, 1000, 10, [&](size_t) { count++; });
+  EXPECT_EQ(count.load(), 1000);
+}
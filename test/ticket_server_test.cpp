@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include "../src/include/ticket_server.h"
+
+const std::string main_version = "test";
+const std::string build_version = "test";
+std::shared_ptr<spdlog::logger> logger_ptr;
+const bool optimize_enabled = false;
+
+namespace {
+/**
+ * @brief read one whole reply frame from a blocking socket
+ */
+bool ReadReply(int fd, WireReply &reply) {
+  std::string buffer;
+  char data[4096];
+  while (true) {
+    int64_t frame_size = WireProtocol::FrameSize(buffer);
+    if (frame_size < 0) return false;
+    if (frame_size > 0) return WireProtocol::DecodeReply(std::string_view(buffer).substr(0, frame_size), reply);
+    ssize_t n = read(fd, data, sizeof(data));
+    if (n <= 0) return false;
+    buffer.append(data, n);
+  }
+}
+}  // namespace
+
+TEST(TicketServerTest, MalformedFrameIsAnswered) {
+  const std::string data_directory = "/tmp/ticket_server_test";
+  system(("rm -rf " + data_directory).c_str());
+  mkdir(data_directory.c_str(), 0755);
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listen_fd, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t address_size = sizeof(address);
+  ASSERT_EQ(bind(listen_fd, (sockaddr *)&address, sizeof(address)), 0);
+  ASSERT_EQ(listen(listen_fd, 16), 0);
+  ASSERT_EQ(getsockname(listen_fd, (sockaddr *)&address, &address_size), 0);
+  {
+    TicketSystemEngine engine(data_directory);
+    TicketServer::Config config;
+    config.reader_threads = 1;
+    config.stats_interval = std::chrono::seconds(0);
+    TicketServer server(engine, config);
+    std::thread serving([&] { server.Serve(listen_fd); });
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(fd, (sockaddr *)&address, sizeof(address)), 0);
+    timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string frames = WireProtocol::kMagic;
+    WireRequest request;
+    request.request_id = 7;
+    request.command = WireCommand::kQueryProfile;
+    request.args.push_back(std::make_pair('u', std::string("has space")));  // cannot be written as a text command
+    WireProtocol::AppendRequest(frames, request);
+    ASSERT_EQ(write(fd, frames.data(), frames.size()), (ssize_t)frames.size());
+    // the peer keeps the connection open, the reply must come without anything more being sent
+    WireReply reply;
+    EXPECT_TRUE(ReadReply(fd, reply));
+    EXPECT_EQ(reply.request_id, 7);
+    EXPECT_EQ(reply.status, WireStatus::kMalformed);
+    EXPECT_EQ(reply.rows.size(), 0);
+    frames.clear();
+    request.request_id = 8;
+    request.command = WireCommand::kExit;
+    request.args.clear();
+    WireProtocol::AppendRequest(frames, request);
+    ASSERT_EQ(write(fd, frames.data(), frames.size()), (ssize_t)frames.size());
+    EXPECT_TRUE(ReadReply(fd, reply));
+    EXPECT_EQ(reply.request_id, 8);
+    EXPECT_EQ(reply.status, WireStatus::kOk);
+    serving.join();
+    close(fd);
+  }
+  close(listen_fd);
+  system(("rm -rf " + data_directory).c_str());
+}
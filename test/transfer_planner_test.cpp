@@ -0,0 +1,216 @@
+#include <gtest/gtest.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include "../src/include/transfer_engine.hpp"
+#include "storage/thread_pool.hpp"
+
+namespace {
+const int kStationCount = 8;
+const hash_t kStationHashBase = 1000;
+
+/**
+ * @brief the old TicketSystemEngine::CheckTransfer on the loaded routes, called for every (train1, train2) pair
+ */
+void CheckTransfer(const sjtu::vector<TrainRouteInfo> &routes, int train1, int train2, hash_t from_station_hash,
+                   hash_t to_station_hash, int date, bool sort_by_time, TransferSolution &res) {
+  const TrainRouteInfo &route1 = routes[train1], &route2 = routes[train2];
+  if (route1.train_ID_hash == route2.train_ID_hash) return;
+  int transfer_stop_of[kStationCount];
+  for (int k = 0; k < kStationCount; k++) transfer_stop_of[k] = -1;
+  bool has_meet_begin_station = false;
+  int start_station_offset = 0;
+  for (int i = 0; i < route1.stationNum; i++) {
+    if (route1.stations_hash[i] == from_station_hash) {
+      has_meet_begin_station = true;
+      start_station_offset = i;
+      continue;
+    }
+    if (has_meet_begin_station) transfer_stop_of[route1.stations_hash[i] - kStationHashBase] = i;
+  }
+  bool has_meet_end_station = false;
+  int dest_station_offset = 0;
+  for (int i = route2.stationNum - 1; i >= 0; i--) {
+    if (route2.stations_hash[i] == to_station_hash) {
+      has_meet_end_station = true;
+      dest_station_offset = i;
+      continue;
+    }
+    if (!has_meet_end_station || transfer_stop_of[route2.stations_hash[i] - kStationHashBase] == -1) continue;
+    int transfer_station_offset = transfer_stop_of[route2.stations_hash[i] - kStationHashBase];
+    int train1_actual_time = route1.startTime + route1.leave_time_offset[start_station_offset];
+    int train1_actual_start_date = date - train1_actual_time / 1440;
+    ASSERT_GE(train1_actual_start_date, route1.saleDate_beg);
+    ASSERT_LE(train1_actual_start_date, route1.saleDate_end);
+    int cur_train1_leaving_time_stamp = train1_actual_start_date * 1440 + train1_actual_time;
+    int cur_train1_arriving_time_stamp =
+        train1_actual_start_date * 1440 + route1.startTime + route1.arrive_time_offset[transfer_station_offset];
+    int train2_earliest_leaving_time_stamp =
+        route2.saleDate_beg * 1440 + route2.startTime + route2.leave_time_offset[i];
+    int train2_latest_leaving_time_stamp =
+        route2.saleDate_end * 1440 + route2.startTime + route2.leave_time_offset[i];
+    if (cur_train1_arriving_time_stamp > train2_latest_leaving_time_stamp) continue;
+    int cur_train2_leaving_time_stamp = train2_earliest_leaving_time_stamp;
+    int train2_day_delta = 0;
+    if (cur_train2_leaving_time_stamp < cur_train1_arriving_time_stamp) {
+      train2_day_delta = (cur_train1_arriving_time_stamp - cur_train2_leaving_time_stamp + 1440 - 1) / 1440;
+      cur_train2_leaving_time_stamp += train2_day_delta * 1440;
+    }
+    int cur_train2_arriving_time_stamp =
+        cur_train2_leaving_time_stamp + route2.arrive_time_offset[dest_station_offset] - route2.leave_time_offset[i];
+    int cur_train1_price = route1.price_sum[transfer_station_offset] - route1.price_sum[start_station_offset];
+    int cur_train2_price = route2.price_sum[dest_station_offset] - route2.price_sum[i];
+    if (res.valid) {
+      int cur_total_time = cur_train2_arriving_time_stamp - cur_train1_leaving_time_stamp;
+      int existing_total_time = res.train2_arriving_time_stamp - res.train1_leaving_time_stamp;
+      int cur_total_price = cur_train1_price + cur_train2_price;
+      int existing_total_price = res.train1_price + res.train2_price;
+      // the keys in order, the existing solution is kept as soon as one of them is smaller
+      int keys[4][2] = {{existing_total_time, cur_total_time},
+                        {existing_total_price, cur_total_price},
+                        {strcmp(routes[res.train1].trainID, route1.trainID), 0},
+                        {strcmp(routes[res.train2].trainID, route2.trainID), 0}};
+      if (!sort_by_time) std::swap(keys[0], keys[1]);
+      bool keep_existing = false;
+      for (int k = 0; k < 4; k++) {
+        if (keys[k][0] == keys[k][1]) continue;
+        keep_existing = keys[k][0] < keys[k][1];
+        break;
+      }
+      if (keep_existing) continue;
+    }
+    // a full tie replaces the solution too, so the smallest transfer stop of train2 is kept
+    res.valid = true;
+    res.train1 = train1;
+    res.train2 = train2;
+    res.from_stop = start_station_offset;
+    res.transfer_stop1 = transfer_station_offset;
+    res.transfer_stop2 = i;
+    res.dest_stop = dest_station_offset;
+    res.train1_start_date = train1_actual_start_date;
+    res.train2_day_delta = train2_day_delta;
+    res.train1_leaving_time_stamp = cur_train1_leaving_time_stamp;
+    res.train1_arriving_time_stamp = cur_train1_arriving_time_stamp;
+    res.train2_leaving_time_stamp = cur_train2_leaving_time_stamp;
+    res.train2_arriving_time_stamp = cur_train2_arriving_time_stamp;
+    res.train1_price = cur_train1_price;
+    res.train2_price = cur_train2_price;
+  }
+}
+
+/**
+ * @brief a random network with few stations, coarse times and cheap segments, so that equal costs are common, and
+ * with rides and sale ranges of several days
+ */
+void GenerateRoutes(std::mt19937 &rng, int train_count, sjtu::vector<TrainRouteInfo> &routes) {
+  auto uniform = [&rng](int low, int high) { return std::uniform_int_distribution<int>(low, high)(rng); };
+  routes.clear();
+  for (int t = 0; t < train_count; t++) {
+    TrainRouteInfo route;
+    route.train_ID_hash = t + 1;
+    // shuffled, so the order of the IDs is not the order of the trains
+    std::string train_ID = "T" + std::to_string(uniform(0, 9)) + "_" + std::to_string(t);
+    strcpy(route.trainID, train_ID.c_str());
+    route.stationNum = uniform(2, 6);
+    route.startTime = uniform(0, 47) * 30;
+    route.saleDate_beg = uniform(0, 8);
+    route.saleDate_end = route.saleDate_beg + uniform(0, 4);
+    route.type = 'G';
+    int stations[kStationCount];
+    for (int k = 0; k < kStationCount; k++) stations[k] = k;
+    for (int k = kStationCount - 1; k > 0; k--) std::swap(stations[k], stations[uniform(0, k)]);
+    route.arrive_time_offset[0] = route.leave_time_offset[0] = route.price_sum[0] = 0;
+    for (int i = 0; i < route.stationNum; i++) {
+      route.stations_hash[i] = kStationHashBase + stations[i];
+      if (i == 0) continue;
+      // up to two days on one segment
+      int travel_time = uniform(0, 4) == 0 ? uniform(1, 48) * 60 : uniform(1, 6) * 60;
+      int stopover_time = i + 1 < route.stationNum ? uniform(0, 2) * 30 : 0;
+      route.arrive_time_offset[i] = route.leave_time_offset[i - 1] + travel_time;
+      route.leave_time_offset[i] = route.arrive_time_offset[i] + stopover_time;
+      route.price_sum[i] = route.price_sum[i - 1] + uniform(1, 3);
+    }
+    routes.push_back(route);
+  }
+}
+
+/**
+ * @brief the candidates StopRegister would fetch: the trains leaving `from` on `date`, and the trains passing `to`
+ */
+void FetchCandidates(const sjtu::vector<TrainRouteInfo> &routes, hash_t from_station_hash, hash_t to_station_hash,
+                     int date, sjtu::vector<int> &train1_route_ids, sjtu::vector<int> &train2_route_ids) {
+  train1_route_ids.clear();
+  train2_route_ids.clear();
+  for (size_t t = 0; t < routes.size(); t++) {
+    const TrainRouteInfo &route = routes[t];
+    for (int i = 0; i < route.stationNum; i++) {
+      if (route.stations_hash[i] == from_station_hash && i + 1 < route.stationNum) {
+        int start_date = date - (route.startTime + route.leave_time_offset[i]) / 1440;
+        if (start_date >= route.saleDate_beg && start_date <= route.saleDate_end) train1_route_ids.push_back(t);
+      }
+      if (route.stations_hash[i] == to_station_hash && i > 0) train2_route_ids.push_back(t);
+    }
+  }
+}
+
+void ExpectSameSolution(const TransferSolution &expected, const TransferSolution &actual) {
+  ASSERT_EQ(expected.valid, actual.valid);
+  if (!expected.valid) return;
+  EXPECT_EQ(expected.train1, actual.train1);
+  EXPECT_EQ(expected.train2, actual.train2);
+  EXPECT_EQ(expected.from_stop, actual.from_stop);
+  EXPECT_EQ(expected.transfer_stop1, actual.transfer_stop1);
+  EXPECT_EQ(expected.transfer_stop2, actual.transfer_stop2);
+  EXPECT_EQ(expected.dest_stop, actual.dest_stop);
+  EXPECT_EQ(expected.train1_start_date, actual.train1_start_date);
+  EXPECT_EQ(expected.train2_day_delta, actual.train2_day_delta);
+  EXPECT_EQ(expected.train1_leaving_time_stamp, actual.train1_leaving_time_stamp);
+  EXPECT_EQ(expected.train1_arriving_time_stamp, actual.train1_arriving_time_stamp);
+  EXPECT_EQ(expected.train2_leaving_time_stamp, actual.train2_leaving_time_stamp);
+  EXPECT_EQ(expected.train2_arriving_time_stamp, actual.train2_arriving_time_stamp);
+  EXPECT_EQ(expected.train1_price, actual.train1_price);
+  EXPECT_EQ(expected.train2_price, actual.train2_price);
+}
+}  // namespace
+
+TEST(TransferPlannerTest, MatchesNestedLoop) {
+  std::mt19937 rng(20240521);
+  WorkStealingThreadPool pool(4);
+  sjtu::vector<TrainRouteInfo> routes;
+  sjtu::vector<int> train1_route_ids, train2_route_ids;
+  int solved = 0, waited_days = 0;
+  for (int round = 0; round < 400; round++) {
+    GenerateRoutes(rng, std::uniform_int_distribution<int>(2, 80)(rng), routes);
+    hash_t from_station_hash = kStationHashBase + rng() % kStationCount;
+    hash_t to_station_hash = kStationHashBase + rng() % kStationCount;
+    if (from_station_hash == to_station_hash) continue;
+    int date = std::uniform_int_distribution<int>(0, 14)(rng);
+    FetchCandidates(routes, from_station_hash, to_station_hash, date, train1_route_ids, train2_route_ids);
+    for (bool sort_by_time : {true, false}) {
+      SCOPED_TRACE("round " + std::to_string(round) + (sort_by_time ? " -p time" : " -p cost"));
+      TransferSolution expected;
+      for (size_t i = 0; i < train1_route_ids.size(); i++) {
+        for (size_t j = 0; j < train2_route_ids.size(); j++) {
+          CheckTransfer(routes, train1_route_ids[i], train2_route_ids[j], from_station_hash, to_station_hash, date,
+                        sort_by_time, expected);
+        }
+      }
+      if (expected.valid) {
+        solved++;
+        if (expected.train2_leaving_time_stamp - expected.train1_arriving_time_stamp >= 1440) waited_days++;
+      }
+      ExpectSameSolution(expected, PlanTransfer(routes, train1_route_ids, train2_route_ids, from_station_hash,
+                                                to_station_hash, date, sort_by_time));
+      for (size_t tile_size : {1, 3, 32}) {
+        SCOPED_TRACE("tiles of " + std::to_string(tile_size));
+        ExpectSameSolution(expected,
+                           PlanTransferInTiles(routes, train1_route_ids, train2_route_ids, from_station_hash,
+                                               to_station_hash, date, sort_by_time, pool, tile_size));
+      }
+    }
+  }
+  // the network must actually produce plans, including ones waiting a day or more for train2
+  EXPECT_GT(solved, 200);
+  EXPECT_GT(waited_days, 10);
+}
@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dataguard/txn_logger.h"
+
+namespace {
+std::string PayloadOf(int thread_id, int i) { return std::to_string(thread_id) + ":" + std::to_string(i); }
+}  // namespace
+
+TEST(TxnLoggerTest, ConcurrentAppendAndReadBack) {
+  const std::string path = "/tmp/txn_logger_test.log";
+  remove(path.c_str());
+  const int kThreads = 4, kRecordsPerThread = 20000;
+  TxnLogger::Config config;
+  config.ring_capacity = 1 << 12;  // small, so the appenders have to wait for the writer
+  config.group_commit_window = std::chrono::microseconds(500);
+  {
+    TxnLogger logger(path, config);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&logger, t] {
+        for (int i = 0; i < kRecordsPerThread; i++) logger.Append(TxnLogger::kCommand, PayloadOf(t, i));
+      });
+    }
+    for (auto &thread : threads) thread.join();
+    uint64_t lsn = logger.Append(TxnLogger::kCheckpoint, "");
+    logger.WaitDurable(lsn);
+    EXPECT_EQ(logger.DurableLSN(), (uint64_t)kThreads * kRecordsPerThread + 1);
+    EXPECT_LT(logger.GetStats().batches, logger.GetStats().records);
+  }
+  std::vector<int> next(kThreads, 0);
+  uint64_t expected_lsn = 1;
+  int checkpoints = 0;
+  TxnLogger::ReadLog(path, [&](const TxnLogger::Record &record) {
+    ASSERT_EQ(record.lsn, expected_lsn++);
+    if (record.type == TxnLogger::kCheckpoint) {
+      checkpoints++;
+      return;
+    }
+    int t = std::stoi(record.payload.substr(0, record.payload.find(':')));
+    // the records of one thread keep their order
+    ASSERT_EQ(record.payload, PayloadOf(t, next[t]++));
+  });
+  EXPECT_EQ(checkpoints, 1);
+  for (int t = 0; t < kThreads; t++) EXPECT_EQ(next[t], kRecordsPerThread);
+  remove(path.c_str());
+}
+
+TEST(TxnLoggerTest, TornTailIsCutOff) {
+  const std::string path = "/tmp/txn_logger_torn_test.log";
+  remove(path.c_str());
+  TxnLogger::Config config;
+  config.synchronous_commit = true;
+  {
+    TxnLogger logger(path, config);
+    for (int i = 0; i < 10; i++) logger.Append(TxnLogger::kCommand, "record " + std::to_string(i));
+  }
+  size_t full_size = TxnLogger::ReadLog(path, [](const TxnLogger::Record &) {});
+  // simulate a crash in the middle of the last record
+  ASSERT_EQ(truncate(path.c_str(), full_size - 3), 0);
+  int count = 0;
+  TxnLogger::ReadLog(path, [&count](const TxnLogger::Record &) { count++; });
+  EXPECT_EQ(count, 9);
+  {
+    TxnLogger logger(path, config);
+    EXPECT_EQ(logger.LastLSN(), 9);
+    EXPECT_EQ(logger.Append(TxnLogger::kCommand, "after crash"), 10);
+  }
+  std::string last_payload;
+  uint64_t last_lsn = 0;
+  TxnLogger::ReadLog(path, [&](const TxnLogger::Record &record) {
+    last_payload = record.payload;
+    last_lsn = record.lsn;
+  });
+  EXPECT_EQ(last_lsn, 10);
+  EXPECT_EQ(last_payload, "after crash");
+  remove(path.c_str());
+}
+
+TEST(TxnLoggerTest, WriteFailureIsSticky) {
+  // every write to /dev/full fails with ENOSPC
+  if (access("/dev/full", W_OK) != 0) GTEST_SKIP() << "/dev/full is not available";
+  TxnLogger::Config config;
+  TxnLogger logger("/dev/full", config);
+  uint64_t lsn = logger.Append(TxnLogger::kCommand, "lost");
+  EXPECT_THROW(logger.WaitDurable(lsn), std::runtime_error);
+  EXPECT_EQ(logger.DurableLSN(), 0);
+  EXPECT_THROW(logger.Append(TxnLogger::kCommand, "after the failure"), std::runtime_error);
+  EXPECT_EQ(logger.DurableLSN(), 0);
+}
@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include "../src/include/engine.h"
+#include "../src/include/ticket_server.h"
+#include "../src/include/txn_log_follower.h"
+
+const std::string main_version = "test";
+const std::string build_version = "test";
+std::shared_ptr<spdlog::logger> logger_ptr;
+const bool optimize_enabled = false;
+
+namespace {
+const char *const kSetupCommands[] = {
+    "[1] add_user -c x -u root -p pw -n Root -m r@x -g 10",
+    "[2] login -u root -p pw",
+    "[3] add_train -i T1 -n 3 -m 1000 -s A|B|C -p 10|20 -x 08:00 -t 60|60 -o 10 -d 06-01|08-31 -y G",
+    "[4] release_train -i T1"};
+std::string BuyCommand(int timestamp) {
+  return "[" + std::to_string(timestamp) + "] buy_ticket -u root -i T1 -d 06-10 -n " + std::to_string(timestamp) +
+         " -f A -t C";
+}
+std::string QueryOrderCommand(int timestamp) { return "[" + std::to_string(timestamp) + "] query_order -u root"; }
+void ResetDirectory(const std::string &directory) {
+  system(("rm -rf " + directory).c_str());
+  mkdir(directory.c_str(), 0755);
+}
+void CopyFileTo(const std::string &from, const std::string &to) { system(("cp " + from + " " + to).c_str()); }
+bool ReadStageMeta(const std::string &directory, uint64_t &lsn, uint64_t &log_offset) {
+  std::ifstream fs(directory + "/stage.meta");
+  int generation;
+  return (bool)(fs >> lsn >> generation >> log_offset);
+}
+}  // namespace
+
+TEST(TxnReplayTest, FsckAcrossCheckpointKeepsOrderCounts) {
+  const std::string primary = "/tmp/txn_replay_test_primary", crashed = "/tmp/txn_replay_test_crashed";
+  ResetDirectory(primary);
+  TxnLogger::Config config;
+  config.synchronous_commit = true;
+  TicketSystemEngine engine(primary);
+  engine.EnableTxnLog(config, 0);
+  for (const char *command : kSetupCommands) engine.Execute(command);
+  engine.Checkpoint();
+  engine.Execute(BuyCommand(5));
+  engine.Execute(BuyCommand(6));
+  engine.WaitForCheckpoint();
+  // a crash while the next checkpoint is staged leaves this stage, with the log going on past that checkpoint
+  system(("rm -rf " + crashed + " && cp -r " + primary + " " + crashed).c_str());
+  engine.Checkpoint();
+  engine.Execute(BuyCommand(7));
+  engine.Execute(BuyCommand(8));
+  CopyFileTo(primary + "/txn.log", crashed + "/txn.log");
+  uint64_t checkpoint_lsn, log_offset;
+  {
+    TicketSystemEngine recovering(crashed);
+    checkpoint_lsn = recovering.RestoreCheckpoint(&log_offset);
+  }
+  // the stage points at its checkpoint record, the setup before it is not read again
+  EXPECT_GT(log_offset, 0);
+  TicketSystemEngine recovered(crashed);
+  EXPECT_EQ(recovered.ReplayTxnLog(checkpoint_lsn, config, log_offset).commands, 4);
+  EXPECT_EQ(recovered.Execute(QueryOrderCommand(9)), engine.Execute(QueryOrderCommand(9)));
+  // the next order takes a new id instead of overwriting one
+  recovered.Execute(BuyCommand(10));
+  engine.Execute(BuyCommand(10));
+  EXPECT_EQ(recovered.Execute(QueryOrderCommand(11)), engine.Execute(QueryOrderCommand(11)));
+}
+
+TEST(TxnReplayTest, FollowerAcrossCheckpointKeepsOrderCounts) {
+  const std::string primary = "/tmp/txn_replay_test_primary", replica = "/tmp/txn_replay_test_replica";
+  ResetDirectory(primary);
+  ResetDirectory(replica);
+  TxnLogger::Config config;
+  config.synchronous_commit = true;
+  TicketSystemEngine engine(primary);
+  engine.EnableTxnLog(config, 0);
+  for (const char *command : kSetupCommands) engine.Execute(command);
+  engine.Checkpoint();
+  engine.WaitForCheckpoint();
+  uint64_t checkpoint_lsn, log_offset;
+  {
+    TicketSystemEngine restoring(replica);
+    checkpoint_lsn = restoring.RestoreCheckpointFrom(primary, &log_offset);
+  }
+  TicketSystemEngine replica_engine(replica);
+  TicketServer::Config server_config;
+  server_config.reader_threads = 1;
+  server_config.read_only = true;
+  TicketServer server(replica_engine, server_config);
+  TxnLogFollower::Config follower_config;
+  follower_config.poll_interval = std::chrono::milliseconds(1);
+  TxnLogFollower follower(replica_engine, server, primary + "/txn.log", checkpoint_lsn, log_offset,
+                          follower_config);
+  engine.Execute(BuyCommand(5));
+  engine.Execute(BuyCommand(6));
+  engine.Checkpoint();
+  engine.Execute(BuyCommand(7));
+  engine.Execute(BuyCommand(8));
+  std::string expected = engine.Execute(QueryOrderCommand(9)), followed;
+  // the follower applies the log in the background, wait until it is caught up
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (std::chrono::steady_clock::now() < deadline) {
+    server.RunExclusive([&] { followed = replica_engine.Execute(QueryOrderCommand(9)); });
+    if (followed == expected) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_EQ(followed, expected);
+}
+
+TEST(TxnReplayTest, StageRecordsTheOffsetOfItsCheckpoint) {
+  const std::string primary = "/tmp/txn_replay_test_primary";
+  ResetDirectory(primary);
+  TxnLogger::Config config;
+  config.synchronous_commit = true;
+  {
+    TicketSystemEngine engine(primary);
+    engine.EnableTxnLog(config, 0);
+    for (const char *command : kSetupCommands) engine.Execute(command);
+    engine.Checkpoint();
+    engine.Execute(BuyCommand(5));
+    engine.WaitForCheckpoint();
+    uint64_t staged_lsn, log_offset, first_lsn = 0;
+    ASSERT_TRUE(ReadStageMeta(primary, staged_lsn, log_offset));
+    TxnLogger::ReadLog(
+        primary + "/txn.log",
+        [&](const TxnLogger::Record &record) {
+          if (first_lsn == 0) {
+            first_lsn = record.lsn;
+            EXPECT_EQ(record.type, TxnLogger::kCheckpoint);
+          }
+        },
+        log_offset);
+    EXPECT_EQ(first_lsn, staged_lsn);
+  }
+  // reopened after the clean shutdown, the LSNs continue though only the log after the last stage is scanned
+  TicketSystemEngine engine(primary);
+  engine.EnableTxnLog(config, 0);
+  engine.Execute("[6] login -u root -p pw");
+  engine.Execute(BuyCommand(7));
+  engine.Checkpoint();
+  engine.WaitForCheckpoint();
+  uint64_t lsns = 0, staged_lsn, log_offset;
+  TxnLogger::ReadLog(primary + "/txn.log", [&](const TxnLogger::Record &record) { EXPECT_EQ(record.lsn, ++lsns); });
+  ASSERT_TRUE(ReadStageMeta(primary, staged_lsn, log_offset));
+  EXPECT_EQ(staged_lsn, lsns);
+}
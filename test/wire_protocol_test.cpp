@@ -0,0 +1,70 @@
+#include "../src/include/wire_protocol.hpp"
+#include <gtest/gtest.h>
+#include <string>
+
+TEST(WireProtocolTest, RequestRoundTrip) {
+  WireRequest request;
+  request.request_id = 0x0123456789ABCDEFull;
+  request.command = WireCommand::kQueryTicket;
+  request.timestamp = 42;
+  request.args.push_back(std::make_pair('s', std::string("上海")));
+  request.args.push_back(std::make_pair('t', std::string("北京")));
+  request.args.push_back(std::make_pair('d', std::string("06-01")));
+  std::string buffer;
+  WireProtocol::AppendRequest(buffer, request);
+  // a frame is only complete with its last byte
+  EXPECT_EQ(WireProtocol::FrameSize(std::string_view(buffer).substr(0, buffer.size() - 1)), 0);
+  ASSERT_EQ(WireProtocol::FrameSize(buffer), (int64_t)buffer.size());
+  WireRequest decoded;
+  ASSERT_TRUE(WireProtocol::DecodeRequest(buffer, decoded));
+  EXPECT_EQ(decoded.request_id, request.request_id);
+  EXPECT_EQ(decoded.command, WireCommand::kQueryTicket);
+  std::string command;
+  ASSERT_TRUE(WireProtocol::CommandLine(decoded, command));
+  EXPECT_EQ(command, "[42] query_ticket -s 上海 -t 北京 -d 06-01");
+}
+
+TEST(WireProtocolTest, RejectsMalformedRequests) {
+  WireRequest request;
+  request.request_id = 7;
+  request.command = WireCommand::kLogin;
+  request.args.push_back(std::make_pair('u', std::string("a b")));
+  std::string buffer, command;
+  WireProtocol::AppendRequest(buffer, request);
+  WireRequest decoded;
+  ASSERT_TRUE(WireProtocol::DecodeRequest(buffer, decoded));
+  EXPECT_FALSE(WireProtocol::CommandLine(decoded, command));
+  // an unknown command keeps the request id so that it can still be answered
+  buffer[4 + 8] = 100;
+  EXPECT_FALSE(WireProtocol::DecodeRequest(buffer, decoded));
+  EXPECT_EQ(decoded.request_id, 7u);
+  EXPECT_FALSE(WireProtocol::DecodeRequest(std::string_view(buffer).substr(0, buffer.size() - 1), decoded));
+  std::string huge("\xff\xff\xff\xff", 4);
+  EXPECT_EQ(WireProtocol::FrameSize(huge), -1);
+}
+
+TEST(WireProtocolTest, ReplyRows) {
+  std::string buffer;
+  WireProtocol::AppendReply(buffer, 1, WireStatus::kOk, "[5] 2\nrow one\nrow two");
+  WireProtocol::AppendReply(buffer, 2, WireStatus::kOk, "[6] -1");
+  WireProtocol::AppendReply(buffer, 3, WireStatus::kFailed, "");
+  std::string_view rest(buffer);
+  WireReply reply;
+  int64_t size = WireProtocol::FrameSize(rest);
+  ASSERT_TRUE(WireProtocol::DecodeReply(rest.substr(0, size), reply));
+  EXPECT_EQ(reply.request_id, 1u);
+  ASSERT_EQ(reply.rows.size(), 3u);
+  EXPECT_EQ(reply.rows[0], "2");
+  EXPECT_EQ(reply.rows[2], "row two");
+  rest.remove_prefix(size);
+  size = WireProtocol::FrameSize(rest);
+  ASSERT_TRUE(WireProtocol::DecodeReply(rest.substr(0, size), reply));
+  ASSERT_EQ(reply.rows.size(), 1u);
+  EXPECT_EQ(reply.rows[0], "-1");
+  rest.remove_prefix(size);
+  size = WireProtocol::FrameSize(rest);
+  ASSERT_EQ(size, (int64_t)rest.size());
+  ASSERT_TRUE(WireProtocol::DecodeReply(rest, reply));
+  EXPECT_EQ(reply.status, WireStatus::kFailed);
+  EXPECT_TRUE(reply.rows.empty());
+}